@@ -0,0 +1,31 @@
+-- Minetest: builtin/async.lua
+--
+-- Runs functions on the async worker threads and hands their return
+-- values to a callback on the server thread.
+--
+
+minetest.async_jobs = {}
+
+function minetest.async_event_handler(jobid, serialized_retval, err)
+	local callback = minetest.async_jobs[jobid]
+	minetest.async_jobs[jobid] = nil
+	if err then
+		minetest.log("error", "Async job "..jobid.." failed: "..err)
+		return
+	end
+	if callback == nil then
+		return
+	end
+	local retval = minetest.deserialize(serialized_retval) or {n = 0}
+	callback(unpack(retval, 1, retval.n))
+end
+
+function minetest.handle_async(func, callback, ...)
+	assert(type(func) == "function" and type(callback) == "function",
+			"Invalid minetest.handle_async invocation")
+	local params = {n = select("#", ...), ...}
+	local jobid = minetest.do_async_callback(string.dump(func),
+			minetest.serialize(params))
+	minetest.async_jobs[jobid] = callback
+	return jobid
+end
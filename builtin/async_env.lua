@@ -0,0 +1,15 @@
+-- Minetest: builtin/async_env.lua
+--
+-- Loaded into the lua_States of the async worker threads, after
+-- serialize.lua. Nothing else of the minetest table is available there.
+--
+
+local function pack(...)
+	return {n = select("#", ...), ...}
+end
+
+function minetest.async_job_handler(serialized_function, serialized_params)
+	local func = assert(loadstring(serialized_function))
+	local params = minetest.deserialize(serialized_params) or {n = 0}
+	return minetest.serialize(pack(func(unpack(params, 1, params.n))))
+end
@@ -12,6 +12,8 @@ os.setlocale("C", "numeric")
 
 -- Load other files
 dofile(minetest.get_modpath("__builtin").."/serialize.lua")
+dofile(minetest.get_modpath("__builtin").."/async.lua")
+dofile(minetest.get_modpath("__builtin").."/voxelarea.lua")
 dofile(minetest.get_modpath("__builtin").."/misc_helpers.lua")
 dofile(minetest.get_modpath("__builtin").."/item.lua")
 dofile(minetest.get_modpath("__builtin").."/misc_register.lua")
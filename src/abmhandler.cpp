@@ -0,0 +1,432 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "abmhandler.h"
+#include "environment.h"
+#include "map.h"
+#include "mapblock.h"
+#include "nodedef.h"
+#include "gamedef.h"
+#include "noise.h" // PseudoRandom
+#include "debug.h"
+#include "log.h"
+#include "main.h" // for g_profiler
+#include "profiler.h"
+
+/*
+	ABMHandler
+*/
+
+ABMHandler::ABMHandler(std::list<ABMWithState> &abms,
+		float dtime_s, ServerEnvironment *env,
+		bool use_timers):
+	m_env(env)
+{
+	u32 k = 0;
+	for(s32 z=-1; z<=1; z++)
+	for(s32 y=-1; y<=1; y++)
+	for(s32 x=-1; x<=1; x++)
+	{
+		if(x == 0 && y == 0 && z == 0)
+			continue;
+		m_neighbor_offsets[k++] = z*ABM_NEIGHBORHOOD_EDGE*ABM_NEIGHBORHOOD_EDGE
+				+ y*ABM_NEIGHBORHOOD_EDGE + x;
+	}
+
+	if(dtime_s < 0.001)
+		return;
+	INodeDefManager *ndef = env->getGameDef()->ndef();
+	for(std::list<ABMWithState>::iterator
+			i = abms.begin(); i != abms.end(); ++i){
+		ActiveBlockModifier *abm = i->abm;
+		float trigger_interval = abm->getTriggerInterval();
+		if(trigger_interval < 0.001)
+			trigger_interval = 0.001;
+		float actual_interval = dtime_s;
+		if(use_timers){
+			i->timer += dtime_s;
+			if(i->timer < trigger_interval)
+				continue;
+			i->timer -= trigger_interval;
+			actual_interval = trigger_interval;
+		}
+		float intervals = actual_interval / trigger_interval;
+		if(intervals == 0)
+			continue;
+		float chance = abm->getTriggerChance();
+		if(chance == 0)
+			chance = 1;
+		m_aabm_storage.push_back(ActiveABM());
+		ActiveABM &aabm = m_aabm_storage.back();
+		aabm.abm = abm;
+		aabm.trigger_count = 0;
+		aabm.time_us = 0;
+		aabm.chance = chance / intervals;
+		if(aabm.chance == 0)
+			aabm.chance = 1;
+		// Trigger neighbors
+		std::set<std::string> required_neighbors_s
+				= abm->getRequiredNeighbors();
+		for(std::set<std::string>::iterator
+				i = required_neighbors_s.begin();
+				i != required_neighbors_s.end(); i++)
+		{
+			std::set<content_t> ids;
+			ndef->getIds(*i, ids);
+			for(std::set<content_t>::const_iterator k = ids.begin();
+					k != ids.end(); k++)
+			{
+				if(*k >= aabm.required_neighbors.size())
+					aabm.required_neighbors.resize(*k + 1, false);
+				aabm.required_neighbors[*k] = true;
+			}
+		}
+		// Trigger contents
+		std::set<std::string> contents_s = abm->getTriggerContents();
+		for(std::set<std::string>::iterator
+				i = contents_s.begin(); i != contents_s.end(); i++)
+		{
+			std::set<content_t> ids;
+			ndef->getIds(*i, ids);
+			for(std::set<content_t>::const_iterator k = ids.begin();
+					k != ids.end(); k++)
+			{
+				content_t c = *k;
+				if(c >= m_aabms.size())
+					m_aabms.resize(c + 1);
+				m_aabms[c].push_back(&aabm);
+				m_trigger_contents.insert(c);
+			}
+		}
+	}
+}
+
+void ABMHandler::prepareJob(ABMBlockJob &job, MapBlock *block, u32 seed)
+{
+	ServerMap *map = &m_env->getServerMap();
+	u32 k = 0;
+	for(s16 z=-1; z<=1; z++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 x=-1; x<=1; x++, k++)
+	{
+		MapBlock *b = block;
+		if(k != 13)
+			b = map->getBlockNoCreateNoEx(block->getPos() + v3s16(x,y,z));
+		if(b && b->isDummy())
+			b = NULL;
+		job.blocks[k] = b;
+	}
+	job.seed = seed;
+	job.triggers.clear();
+}
+
+void ABMHandler::snapshotNeighborhood(ABMBlockJob &job,
+		content_t *neighborhood)
+{
+	u32 i = 0;
+	for(s16 z=-1; z<=MAP_BLOCKSIZE; z++)
+	for(s16 y=-1; y<=MAP_BLOCKSIZE; y++)
+	for(s16 x=-1; x<=MAP_BLOCKSIZE; x++, i++)
+	{
+		s16 bx = x < 0 ? 0 : (x < MAP_BLOCKSIZE ? 1 : 2);
+		s16 by = y < 0 ? 0 : (y < MAP_BLOCKSIZE ? 1 : 2);
+		s16 bz = z < 0 ? 0 : (z < MAP_BLOCKSIZE ? 1 : 2);
+		MapBlock *b = job.blocks[bz*9 + by*3 + bx];
+		if(b == NULL){
+			neighborhood[i] = CONTENT_IGNORE;
+			continue;
+		}
+		v3s16 rel(x - (bx-1)*MAP_BLOCKSIZE, y - (by-1)*MAP_BLOCKSIZE,
+				z - (bz-1)*MAP_BLOCKSIZE);
+		neighborhood[i] = b->getNodeNoCheck(rel).getContent();
+	}
+}
+
+bool ABMHandler::hasRequiredNeighbor(const ActiveABM &aabm, v3s16 p0,
+		const content_t *neighborhood)
+{
+	s32 center = (p0.Z+1)*ABM_NEIGHBORHOOD_EDGE*ABM_NEIGHBORHOOD_EDGE
+			+ (p0.Y+1)*ABM_NEIGHBORHOOD_EDGE + (p0.X+1);
+	const std::vector<bool> &mask = aabm.required_neighbors;
+	for(u32 k=0; k<26; k++)
+	{
+		content_t c = neighborhood[center + m_neighbor_offsets[k]];
+		if(c < mask.size() && mask[c])
+			return true;
+	}
+	return false;
+}
+
+void ABMHandler::scanBlock(ABMBlockJob &job, content_t *neighborhood)
+{
+	MapBlock *block = job.getBlock();
+	if(block == NULL)
+		return;
+
+	// Most blocks contain nothing that could trigger
+	if(!block->containsAnyContent(m_trigger_contents))
+		return;
+
+	// The chances are rolled the same way whatever thread does this
+	PseudoRandom pr(job.seed);
+	bool have_neighborhood = false;
+
+	v3s16 p0;
+	for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+	for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+	{
+		content_t c = block->getNodeNoCheck(p0).getContent();
+		if(c >= m_aabms.size() || m_aabms[c].empty())
+			continue;
+
+		std::vector<ActiveABM*> &aabms = m_aabms[c];
+		for(std::vector<ActiveABM*>::iterator
+				i = aabms.begin(); i != aabms.end(); i++)
+		{
+			ActiveABM &aabm = **i;
+			// PseudoRandom gives 15 bits; chances can be larger
+			u32 r = ((u32)pr.next() << 15) | (u32)pr.next();
+			if(r % aabm.chance != 0)
+				continue;
+
+			// Check neighbors
+			if(!aabm.required_neighbors.empty())
+			{
+				if(!have_neighborhood){
+					snapshotNeighborhood(job, neighborhood);
+					have_neighborhood = true;
+				}
+				if(!hasRequiredNeighbor(aabm, p0, neighborhood))
+					continue;
+			}
+
+			ABMTrigger trigger;
+			trigger.aabm = &aabm;
+			trigger.p0 = p0;
+			trigger.content = c;
+			job.triggers.push_back(trigger);
+		}
+	}
+}
+
+void ABMHandler::runTriggers(ABMBlockJob &job)
+{
+	if(job.triggers.empty())
+		return;
+
+	MapBlock *block = job.getBlock();
+	ServerMap *map = &m_env->getServerMap();
+
+	// Find out how many objects the block contains
+	u32 active_object_count = block->m_static_objects.m_active.size();
+	// Find out how many objects this and all the neighbors contain
+	u32 active_object_count_wider = 0;
+	u32 wider_unknown_count = 0;
+	for(s16 x=-1; x<=1; x++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 z=-1; z<=1; z++)
+	{
+		MapBlock *block2 = map->getBlockNoCreateNoEx(
+				block->getPos() + v3s16(x,y,z));
+		if(block2==NULL){
+			wider_unknown_count++;
+			continue;
+		}
+		active_object_count_wider +=
+				block2->m_static_objects.m_active.size()
+				+ block2->m_static_objects.m_stored.size();
+	}
+	// Extrapolate
+	u32 wider_known_count = 3*3*3 - wider_unknown_count;
+	active_object_count_wider += wider_unknown_count *
+			active_object_count_wider / wider_known_count;
+
+	for(std::vector<ABMTrigger>::iterator
+			i = job.triggers.begin(); i != job.triggers.end(); ++i)
+	{
+		// An earlier trigger may have changed the node
+		MapNode n = block->getNodeNoEx(i->p0);
+		if(n.getContent() != i->content)
+			continue;
+		v3s16 p = i->p0 + block->getPosRelative();
+
+		// Call all the trigger variations
+		u32 time_start = porting::getTimeUs();
+		ActiveBlockModifier *abm = i->aabm->abm;
+		abm->trigger(m_env, p, n);
+		abm->trigger(m_env, p, n,
+				active_object_count, active_object_count_wider);
+		i->aabm->time_us += porting::getTimeUs() - time_start;
+		i->aabm->trigger_count++;
+	}
+}
+
+void ABMHandler::apply(MapBlock *block, u32 seed)
+{
+	if(!isActive() || block->isDummy())
+		return;
+
+	content_t neighborhood[ABM_NEIGHBORHOOD_VOLUME];
+	ABMBlockJob job;
+	prepareJob(job, block, seed);
+	scanBlock(job, neighborhood);
+	runTriggers(job);
+}
+
+void ABMHandler::reportProfiling()
+{
+	for(std::list<ActiveABM>::iterator
+			i = m_aabm_storage.begin(); i != m_aabm_storage.end(); ++i)
+	{
+		if(i->trigger_count == 0)
+			continue;
+		std::string name = i->abm->getName();
+		g_profiler->add("ABM: " + name + " triggers", i->trigger_count);
+		g_profiler->add("ABM: " + name + " time (ms)",
+				i->time_us / 1000.0);
+	}
+}
+
+/*
+	ABMScanPool
+*/
+
+class ABMScanThread : public SimpleThread
+{
+public:
+	ABMScanThread(ABMScanPool *pool):
+		SimpleThread(),
+		m_pool(pool)
+	{
+	}
+
+	void *Thread()
+	{
+		ThreadStarted();
+		log_register_thread("ABMScanThread");
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		while(getRun())
+		{
+			m_start_event.wait();
+			if(!getRun())
+				break;
+			m_pool->work(m_neighborhood);
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		log_deregister_thread();
+		return NULL;
+	}
+
+	Event m_start_event;
+
+private:
+	ABMScanPool *m_pool;
+	content_t m_neighborhood[ABM_NEIGHBORHOOD_VOLUME];
+};
+
+ABMScanPool::ABMScanPool(u32 num_threads):
+	m_handler(NULL),
+	m_jobs(NULL),
+	m_next_job(0),
+	m_jobs_done(0),
+	m_waiting(false)
+{
+	m_mutex.Init();
+	for(u32 i = 1; i < num_threads; i++)
+	{
+		ABMScanThread *thread = new ABMScanThread(this);
+		m_threads.push_back(thread);
+		thread->setRun(true);
+		thread->Start();
+	}
+}
+
+ABMScanPool::~ABMScanPool()
+{
+	for(u32 i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i]->setRun(false);
+		m_threads[i]->m_start_event.signal();
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+}
+
+void ABMScanPool::scan(ABMHandler *handler, std::vector<ABMBlockJob> &jobs)
+{
+	if(jobs.empty())
+		return;
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_handler = handler;
+		m_jobs = &jobs;
+		m_next_job = 0;
+		m_jobs_done = 0;
+		m_waiting = false;
+	}
+	// Don't bother the threads with less than a job each
+	for(u32 i = 0; i < m_threads.size() && i + 1 < jobs.size(); i++)
+		m_threads[i]->m_start_event.signal();
+
+	work(m_neighborhood);
+
+	// Wait for the jobs still being scanned by the threads
+	{
+		JMutexAutoLock lock(m_mutex);
+		if(m_jobs_done == m_jobs->size())
+		{
+			m_jobs = NULL;
+			return;
+		}
+		m_waiting = true;
+	}
+	m_done_event.wait();
+
+	JMutexAutoLock lock(m_mutex);
+	m_jobs = NULL;
+	m_waiting = false;
+}
+
+void ABMScanPool::work(content_t *neighborhood)
+{
+	for(;;)
+	{
+		ABMBlockJob *job;
+		ABMHandler *handler;
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_jobs == NULL || m_next_job >= m_jobs->size())
+				return;
+			job = &(*m_jobs)[m_next_job++];
+			handler = m_handler;
+		}
+
+		handler->scanBlock(*job, neighborhood);
+
+		JMutexAutoLock lock(m_mutex);
+		m_jobs_done++;
+		if(m_jobs_done == m_jobs->size() && m_waiting)
+			m_done_event.signal();
+	}
+}
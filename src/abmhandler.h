@@ -0,0 +1,176 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ABMHANDLER_HEADER
+#define ABMHANDLER_HEADER
+
+#include <list>
+#include <set>
+#include <vector>
+#include "irr_v3d.h"
+#include "mapnode.h"
+#include "porting.h"
+#include "util/container.h"
+#include "util/thread.h"
+
+class ServerEnvironment;
+class MapBlock;
+class ActiveBlockModifier;
+struct ABMWithState;
+
+// Edge length of the snapshot of a block and the nodes around it
+#define ABM_NEIGHBORHOOD_EDGE (MAP_BLOCKSIZE + 2)
+#define ABM_NEIGHBORHOOD_VOLUME \
+	(ABM_NEIGHBORHOOD_EDGE * ABM_NEIGHBORHOOD_EDGE * ABM_NEIGHBORHOOD_EDGE)
+
+struct ActiveABM
+{
+	ActiveBlockModifier *abm;
+	int chance;
+	// Indexed by content id; empty if no neighbors are required
+	std::vector<bool> required_neighbors;
+	// For the profiler
+	u32 trigger_count;
+	u32 time_us;
+};
+
+// A trigger found by ABMHandler::scanBlock()
+struct ABMTrigger
+{
+	ActiveABM *aabm;
+	// Position in the block
+	v3s16 p0;
+	content_t content;
+};
+
+/*
+	ABM work of one active block.
+	The blocks are looked up from the Map by the server thread, so
+	scanning a block doesn't need anything else of the Map.
+*/
+struct ABMBlockJob
+{
+	// The block and its neighbors at (z+1)*9 + (y+1)*3 + (x+1).
+	// NULL if not loaded.
+	MapBlock *blocks[27];
+	// Seed of the chance rolls
+	u32 seed;
+	std::vector<ABMTrigger> triggers;
+
+	MapBlock *getBlock()
+	{
+		return blocks[13];
+	}
+};
+
+/*
+	Applies the ActiveBlockModifiers that are due to blocks.
+
+	This is done in two phases. scanBlock() finds the nodes that
+	trigger: it matches contents, rolls the chances and checks the
+	neighbors. It only reads the blocks of its job, so different jobs
+	can be scanned in parallel while the Map isn't being modified.
+	runTriggers() then calls the ABMs in the server thread.
+*/
+class ABMHandler
+{
+public:
+	ABMHandler(std::list<ABMWithState> &abms,
+			float dtime_s, ServerEnvironment *env,
+			bool use_timers);
+
+	// Whether any ABM is due
+	bool isActive()
+	{
+		return !m_trigger_contents.empty();
+	}
+
+	// Look up the blocks of a job. Call in the server thread.
+	void prepareJob(ABMBlockJob &job, MapBlock *block, u32 seed);
+	// Find the triggers of a job. neighborhood is scratch space of
+	// ABM_NEIGHBORHOOD_VOLUME content ids.
+	void scanBlock(ABMBlockJob &job, content_t *neighborhood);
+	// Call the triggers found by scanBlock(). Call in the server thread.
+	void runTriggers(ABMBlockJob &job);
+
+	// All of the above for one block
+	void apply(MapBlock *block, u32 seed);
+
+	// Add the trigger counts and times of the ABMs to the profiler
+	void reportProfiling();
+
+private:
+	void snapshotNeighborhood(ABMBlockJob &job, content_t *neighborhood);
+	bool hasRequiredNeighbor(const ActiveABM &aabm, v3s16 p0,
+			const content_t *neighborhood);
+
+	ServerEnvironment *m_env;
+	std::list<ActiveABM> m_aabm_storage;
+	// ActiveABMs indexed by trigger content id
+	std::vector<std::vector<ActiveABM*> > m_aabms;
+	// All trigger content ids, for skipping whole blocks
+	std::set<content_t> m_trigger_contents;
+	// Index offsets of the 26 neighbors of a node in a neighborhood
+	s32 m_neighbor_offsets[26];
+};
+
+class ABMScanThread;
+
+/*
+	Runs ABMHandler::scanBlock() for a list of jobs on a pool of
+	threads. The calling thread takes part and returns when all jobs
+	have been scanned.
+*/
+class ABMScanPool
+{
+public:
+	// num_threads includes the calling thread
+	ABMScanPool(u32 num_threads);
+	~ABMScanPool();
+
+	void scan(ABMHandler *handler, std::vector<ABMBlockJob> &jobs);
+
+	u32 getThreadCount()
+	{
+		return m_threads.size() + 1;
+	}
+
+private:
+	friend class ABMScanThread;
+
+	// Scan jobs until none are left to take
+	void work(content_t *neighborhood);
+
+	std::vector<ABMScanThread*> m_threads;
+	content_t m_neighborhood[ABM_NEIGHBORHOOD_VOLUME];
+
+	// Protected by m_mutex
+	JMutex m_mutex;
+	ABMHandler *m_handler;
+	std::vector<ABMBlockJob> *m_jobs;
+	u32 m_next_job;
+	u32 m_jobs_done;
+	bool m_waiting;
+
+	Event m_done_event;
+};
+
+#endif
+
@@ -57,6 +57,12 @@ static std::string getMediaCacheDir()
 	return porting::path_user + DIR_DELIM + "cache" + DIR_DELIM + "media";
 }
 
+static std::string getDefinitionCacheDir()
+{
+	return porting::path_user + DIR_DELIM + "cache" + DIR_DELIM
+			+ "definitions";
+}
+
 /*
 	QueuedMeshUpdate
 */
@@ -154,13 +160,22 @@ QueuedMeshUpdate * MeshUpdateQueue::pop()
 		QueuedMeshUpdate *q = *i;
 		if(must_be_urgent && m_urgents.count(q->p) == 0)
 			continue;
+		if(m_inflight.count(q->p) != 0)
+			continue;
 		m_queue.erase(i);
 		m_urgents.erase(q->p);
+		m_inflight.insert(q->p);
 		return q;
 	}
 	return NULL;
 }
 
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_inflight.erase(p);
+}
+
 /*
 	MeshUpdateThread
 */
@@ -169,7 +184,7 @@ void * MeshUpdateThread::Thread()
 {
 	ThreadStarted();
 
-	log_register_thread("MeshUpdateThread");
+	log_register_thread("MeshUpdateThread" + itos(m_id));
 
 	DSTACK(__FUNCTION_NAME);
 	
@@ -186,7 +201,7 @@ void * MeshUpdateThread::Thread()
 			continue;
 		}*/
 
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_manager->m_queue_in.pop();
 		if(q == NULL)
 		{
 			sleep_ms(3);
@@ -211,8 +226,9 @@ void * MeshUpdateThread::Thread()
 				<<"("<<q->p.X<<","<<q->p.Y<<","<<q->p.Z<<")"
 				<<std::endl;*/
 
-		m_queue_out.push_back(r);
+		m_manager->m_queue_out.push_back(r);
 
+		m_manager->m_queue_in.done(q->p);
 		delete q;
 	}
 
@@ -221,6 +237,71 @@ void * MeshUpdateThread::Thread()
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager(IGameDef *gamedef):
+	m_gamedef(gamedef)
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stop();
+}
+
+void MeshUpdateManager::start()
+{
+	if(!m_threads.empty())
+		return;
+
+	int nthreads;
+	if(g_settings->get("mesh_generation_threads").empty())
+	{
+		int nprocs = porting::getNumberOfProcessors();
+		// leave a proc for the main thread and one for the network
+		nthreads = (nprocs > 2) ? nprocs - 2 : 1;
+	}
+	else
+	{
+		nthreads = g_settings->getU16("mesh_generation_threads");
+	}
+	if(nthreads < 1)
+		nthreads = 1;
+
+	infostream<<"MeshUpdateManager: using "<<nthreads<<" threads"<<std::endl;
+
+	for(int i = 0; i < nthreads; i++)
+	{
+		MeshUpdateThread *thread = new MeshUpdateThread(m_gamedef, this, i);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+void MeshUpdateManager::stop()
+{
+	for(std::vector<MeshUpdateThread*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+		(*i)->setRun(false);
+	for(std::vector<MeshUpdateThread*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		while((*i)->IsRunning())
+			sleep_ms(100);
+		delete *i;
+	}
+	m_threads.clear();
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	return !m_threads.empty();
+}
+
 void * MediaFetchThread::Thread()
 {
 	ThreadStarted();
@@ -279,7 +360,7 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
+	m_mesh_update_manager(this),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -306,6 +387,7 @@ Client::Client(
 	m_media_received_count(0),
 	m_itemdef_received(false),
 	m_nodedef_received(false),
+	m_definition_cache(getDefinitionCacheDir()),
 	m_time_of_day_set(false),
 	m_last_time_of_day_f(-1),
 	m_time_of_day_update_timer(0),
@@ -347,11 +429,9 @@ Client::~Client()
 		m_con.Disconnect();
 	}
 
-	m_mesh_update_thread.setRun(false);
-	while(m_mesh_update_thread.IsRunning())
-		sleep_ms(100);
-	while(!m_mesh_update_thread.m_queue_out.empty()) {
-		MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+	m_mesh_update_manager.stop();
+	while(!m_mesh_update_manager.m_queue_out.empty()) {
+		MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 		delete r.mesh;
 	}
 
@@ -739,14 +819,14 @@ void Client::step(float dtime)
 		// 0ms
 		
 		/*infostream<<"Mesh update result queue size is "
-				<<m_mesh_update_thread.m_queue_out.size()
+				<<m_mesh_update_manager.m_queue_out.size()
 				<<std::endl;*/
 		
 		int num_processed_meshes = 0;
-		while(!m_mesh_update_thread.m_queue_out.empty())
+		while(!m_mesh_update_manager.m_queue_out.empty())
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block)
 			{
@@ -1045,6 +1125,90 @@ void Client::deletingPeer(con::Peer *peer, bool timeout)
 		string name
 	}
 */
+std::string Client::getDefinitionIndexName()
+{
+	Address address = m_con.GetPeerAddress(PEER_ID_SERVER);
+	std::string name = address.serializeString() + "_"
+			+ itos(address.getPort());
+	for(u32 i=0; i<name.size(); i++)
+		if(!isalnum(name[i]))
+			name[i] = '_';
+	return "server_" + name;
+}
+
+void Client::loadCachedDefinitions()
+{
+	std::ostringstream index_os(std::ios_base::binary);
+	if(!m_definition_cache.load(getDefinitionIndexName(), index_os))
+		return;
+	std::istringstream is(index_os.str(), std::ios_base::binary);
+	std::string itemdef_sha1;
+	std::string nodedef_sha1;
+	try{
+		itemdef_sha1 = deSerializeString(is);
+		nodedef_sha1 = deSerializeString(is);
+	}
+	catch(SerializationError &e){
+		errorstream<<"Client: Corrupt definition cache index"<<std::endl;
+		return;
+	}
+	// Only offer what can actually be loaded
+	std::ostringstream item_os(std::ios_base::binary);
+	if(m_definition_cache.load_sha1(itemdef_sha1, item_os)){
+		m_cached_itemdef = item_os.str();
+		m_itemdef_sha1 = itemdef_sha1;
+	}
+	std::ostringstream node_os(std::ios_base::binary);
+	if(m_definition_cache.load_sha1(nodedef_sha1, node_os)){
+		m_cached_nodedef = node_os.str();
+		m_nodedef_sha1 = nodedef_sha1;
+	}
+}
+
+void Client::saveDefinitionIndex()
+{
+	if(!fs::CreateAllDirs(getDefinitionCacheDir())){
+		errorstream<<"Could not create definition cache directory"
+				<<std::endl;
+		return;
+	}
+	std::ostringstream os(std::ios_base::binary);
+	os<<serializeString(m_itemdef_sha1);
+	os<<serializeString(m_nodedef_sha1);
+	m_definition_cache.update(getDefinitionIndexName(), os.str());
+}
+
+std::string Client::receiveDefinitions(std::istream &is, std::string &sha1,
+		std::string &cached)
+{
+	std::string compressed = deSerializeLongString(is);
+	std::string sent_sha1;
+	try{
+		sent_sha1 = deSerializeString(is);
+	}
+	catch(SerializationError &e){
+		// Older server
+	}
+
+	if(compressed.empty() && sent_sha1 != ""){
+		if(sent_sha1 == sha1){
+			infostream<<"Client: Using cached definitions "
+					<<hex_encode(sha1)<<std::endl;
+			compressed.swap(cached);
+		} else{
+			errorstream<<"Client: Server skipped definitions that "
+					<<"are not cached"<<std::endl;
+		}
+	} else if(sent_sha1 != ""){
+		sha1 = sent_sha1;
+		if(fs::CreateAllDirs(getDefinitionCacheDir()))
+			m_definition_cache.update_sha1(compressed);
+		saveDefinitionIndex();
+	}
+	cached = "";
+	return compressed;
+}
+
 void Client::request_media(const std::list<MediaRequest> &file_requests)
 {
 	std::ostringstream os(std::ios_base::binary);
@@ -1055,6 +1219,11 @@ void Client::request_media(const std::list<MediaRequest> &file_requests)
 			i != file_requests.end(); ++i) {
 		os<<serializeString(i->name);
 	}
+	// Ignored by servers that don't support resuming
+	for(std::list<MediaRequest>::const_iterator i = file_requests.begin();
+			i != file_requests.end(); ++i) {
+		writeU32(os, i->offset);
+	}
 
 	// Make data buffer
 	std::string s = os.str();
@@ -1193,10 +1362,14 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 					<<m_recommended_send_interval<<std::endl;
 		}
 		
-		// Reply to server
-		u32 replysize = 2;
-		SharedBuffer<u8> reply(replysize);
-		writeU16(&reply[0], TOSERVER_INIT2);
+		// Reply to server, telling which definitions we have
+		loadCachedDefinitions();
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, TOSERVER_INIT2);
+		os<<serializeString(m_itemdef_sha1);
+		os<<serializeString(m_nodedef_sha1);
+		std::string s = os.str();
+		SharedBuffer<u8> reply((u8*)s.c_str(), s.size());
 		// Send as reliable
 		m_con.Send(PEER_ID_SERVER, 1, reply, true);
 
@@ -1643,9 +1816,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		int num_files = readU16(is);
 		
@@ -1686,10 +1859,19 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 							<<sha1_hex<<" \""<<name<<"\""<<std::endl;
 				}
 			}
+			// Continue from what was received earlier
+			u32 offset = 0;
+			std::ostringstream part_os(std::ios_base::binary);
+			if(m_media_cache.load(sha1_hex + ".part", part_os))
+			{
+				m_media_partial[name] = part_os.str();
+				offset = m_media_partial[name].size();
+				m_media_resumed.insert(name);
+			}
 			// Didn't load from cache; queue it to be requested
 			verbosestream<<"Client: Adding file to request list: \""
-					<<sha1_hex<<" \""<<name<<"\""<<std::endl;
-			file_requests.push_back(MediaRequest(name));
+					<<sha1_hex<<" \""<<name<<"\" offset="<<offset<<std::endl;
+			file_requests.push_back(MediaRequest(name, offset));
 		}
 
 		std::string remote_media = "";
@@ -1741,9 +1923,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		/*
 			u16 command
@@ -1794,11 +1976,16 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 			{
 				std::map<std::string, std::string>::iterator n;
 				n = m_media_name_sha1_map.find(name);
-				if(n == m_media_name_sha1_map.end())
+				if(n == m_media_name_sha1_map.end()){
 					errorstream<<"The server sent a file that has not "
 							<<"been announced."<<std::endl;
-				else
+				} else {
 					m_media_cache.update_sha1(data);
+					// Left over from a server that could resume
+					if(m_media_partial.erase(name) != 0)
+						m_media_cache.remove(hex_encode(n->second)
+								+ ".part");
+				}
 			}
 		}
 
@@ -1806,6 +1993,107 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		event.type = CE_TEXTURES_UPDATED;
 		m_client_event_queue.push_back(event);
 	}
+	else if(command == TOCLIENT_MEDIA_CHUNK)
+	{
+		if (m_media_count == 0)
+			return;
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+
+		// Mesh update threads must be stopped while
+		// updating content definitions
+		assert(!m_mesh_update_manager.isRunning());
+
+		std::string name = deSerializeString(is);
+		u8 compression = readU8(is);
+		u32 total_size = readU32(is);
+		u32 offset = readU32(is);
+		std::string chunk = deSerializeLongString(is);
+
+		std::map<std::string, std::string>::iterator n;
+		n = m_media_name_sha1_map.find(name);
+		if(n == m_media_name_sha1_map.end()){
+			errorstream<<"Client: The server sent a file that has not "
+					<<"been announced: \""<<name<<"\""<<std::endl;
+			return;
+		}
+		std::string sha1_raw = n->second;
+		std::string part_name = hex_encode(sha1_raw) + ".part";
+
+		bool did = fs::CreateAllDirs(getMediaCacheDir());
+		if(!did){
+			errorstream<<"Could not create media cache directory"
+					<<std::endl;
+		}
+
+		// The server starts over if it can't resume
+		std::string &part = m_media_partial[name];
+		if(offset == 0){
+			part = "";
+			m_media_cache.update(part_name, "");
+		}
+		if(offset != part.size()){
+			errorstream<<"Client: Received chunk of \""<<name<<"\" at "
+					<<offset<<", expected "<<part.size()<<std::endl;
+			return;
+		}
+		part += chunk;
+		m_media_cache.append(part_name, chunk);
+		if(part.size() < total_size)
+			return;
+
+		// The file is complete
+		std::string filedata;
+		if(compression == MEDIA_COMPRESSION_ZLIB){
+			std::istringstream tmp_is(part, std::ios_base::binary);
+			std::ostringstream tmp_os(std::ios_base::binary);
+			try{
+				decompressZlib(tmp_is, tmp_os);
+			}
+			catch(SerializationError &e){
+			}
+			filedata = tmp_os.str();
+		} else {
+			filedata.swap(part);
+		}
+		m_media_partial.erase(name);
+		m_media_cache.remove(part_name);
+
+		SHA1 sha1;
+		sha1.addBytes(filedata.c_str(), filedata.size());
+		unsigned char *digest = sha1.getDigest();
+		std::string sha1_real_raw((char*)digest, 20);
+		free(digest);
+
+		if(sha1_real_raw != sha1_raw){
+			// Whatever was resumed from may not have been the same
+			// file; get the whole thing
+			if(m_media_resumed.erase(name) != 0){
+				infostream<<"Client: Resumed media \""<<name<<"\" is "
+						<<"corrupt; requesting it again"<<std::endl;
+				std::list<MediaRequest> file_requests;
+				file_requests.push_back(MediaRequest(name));
+				request_media(file_requests);
+				return;
+			}
+			errorstream<<"Client: Received media \""<<name<<"\" "
+					<<"mismatches its checksum"<<std::endl;
+		}
+		else if(loadMedia(filedata, name)){
+			verbosestream<<"Client: Loaded received media: "
+					<<"\""<<name<<"\". Caching."<<std::endl;
+			m_media_cache.update_sha1(filedata);
+		} else{
+			infostream<<"Client: Failed to load received media: "
+					<<"\""<<name<<"\". Not caching."<<std::endl;
+		}
+		m_media_resumed.erase(name);
+		m_media_received_count++;
+
+		ClientEvent event;
+		event.type = CE_TEXTURES_UPDATED;
+		m_client_event_queue.push_back(event);
+	}
 	else if(command == TOCLIENT_TOOLDEF)
 	{
 		infostream<<"Client: WARNING: Ignoring TOCLIENT_TOOLDEF"<<std::endl;
@@ -1815,14 +2103,15 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		infostream<<"Client: Received node definitions: packet size: "
 				<<datasize<<std::endl;
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress node definitions
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
-		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::istringstream tmp_is(receiveDefinitions(is, m_nodedef_sha1,
+				m_cached_nodedef), std::ios::binary);
 		std::ostringstream tmp_os;
 		decompressZlib(tmp_is, tmp_os);
 
@@ -1840,14 +2129,15 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		infostream<<"Client: Received item definitions: packet size: "
 				<<datasize<<std::endl;
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress item definitions
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
-		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::istringstream tmp_is(receiveDefinitions(is, m_itemdef_sha1,
+				m_cached_itemdef), std::ios::binary);
 		std::ostringstream tmp_os;
 		decompressZlib(tmp_is, tmp_os);
 
@@ -2741,13 +3031,13 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 	}
 
 	// Debug wait
-	//while(m_mesh_update_thread.m_queue_in.size() > 0) sleep_ms(10);
+	//while(m_mesh_update_manager.m_queue_in.size() > 0) sleep_ms(10);
 	
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 
 	/*infostream<<"Mesh update input queue size is "
-			<<m_mesh_update_thread.m_queue_in.size()
+			<<m_mesh_update_manager.m_queue_in.size()
 			<<std::endl;*/
 }
 
@@ -2886,9 +3176,9 @@ void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 		delete[] text;
 	}
 
-	// Start mesh update thread after setting up content definitions
-	infostream<<"- Starting mesh update thread"<<std::endl;
-	m_mesh_update_thread.Start();
+	// Start mesh update threads after setting up content definitions
+	infostream<<"- Starting mesh update threads"<<std::endl;
+	m_mesh_update_manager.start();
 	
 	infostream<<"Client::afterContentReceived() done"<<std::endl;
 }
@@ -86,8 +86,14 @@ class MeshUpdateQueue
 
 	// Returned pointer must be deleted
 	// Returns NULL if queue is empty
+	// Blocks that are being processed are not returned until
+	// done() has been called for them, so that the meshes of a block
+	// are finished in the order its updates were queued.
 	QueuedMeshUpdate * pop();
 
+	// Call when the block returned by pop() has been processed
+	void done(v3s16 p);
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -97,6 +103,7 @@ class MeshUpdateQueue
 private:
 	std::vector<QueuedMeshUpdate*> m_queue;
 	std::set<v3s16> m_urgents;
+	std::set<v3s16> m_inflight;
 	JMutex m_mutex;
 };
 
@@ -114,22 +121,47 @@ struct MeshUpdateResult
 	}
 };
 
+class MeshUpdateManager;
+
 class MeshUpdateThread : public SimpleThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(IGameDef *gamedef, MeshUpdateManager *manager, int id):
+		m_gamedef(gamedef),
+		m_manager(manager),
+		m_id(id)
 	{
 	}
 
 	void * Thread();
 
+	IGameDef *m_gamedef;
+	MeshUpdateManager *m_manager;
+	int m_id;
+};
+
+/*
+	A pool of MeshUpdateThreads making meshes from a shared queue.
+	The number of threads is set by mesh_generation_threads.
+*/
+class MeshUpdateManager
+{
+public:
+	MeshUpdateManager(IGameDef *gamedef);
+	~MeshUpdateManager();
+
+	void start();
+	void stop();
+	bool isRunning();
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
 
+private:
 	IGameDef *m_gamedef;
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 class MediaFetchThread : public SimpleThread
@@ -408,6 +440,18 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 
 	void request_media(const std::list<MediaRequest> &file_requests);
 
+	/*
+		Definitions received from a server are cached by their SHA1,
+		and the SHA1s of the last ones are remembered per server.
+	*/
+	std::string getDefinitionIndexName();
+	void loadCachedDefinitions();
+	void saveDefinitionIndex();
+	// Get the compressed definitions out of TOCLIENT_ITEMDEF or
+	// TOCLIENT_NODEDEF, from the cache if the server skipped them
+	std::string receiveDefinitions(std::istream &is, std::string &sha1,
+			std::string &cached);
+
 	// Virtual methods from con::PeerHandler
 	void peerAdded(con::Peer *peer);
 	void deletingPeer(con::Peer *peer, bool timeout);
@@ -435,7 +479,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	ISoundManager *m_sound;
 	MtEventManager *m_event;
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
 	std::list<MediaFetchThread*> m_media_fetch_threads;
 	ClientEnvironment m_env;
 	con::Connection m_con;
@@ -465,11 +509,24 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	FileCache m_media_cache;
 	// Mapping from media file name to SHA1 checksum
 	std::map<std::string, std::string> m_media_name_sha1_map;
+	// Files being received with TOCLIENT_MEDIA_CHUNK, as sent so far.
+	// These are kept in the media cache as <sha1>.part until complete.
+	std::map<std::string, std::string> m_media_partial;
+	// Files that were requested from an offset of an earlier partial
+	std::set<std::string> m_media_resumed;
 	bool m_media_receive_started;
 	u32 m_media_count;
 	u32 m_media_received_count;
 	bool m_itemdef_received;
 	bool m_nodedef_received;
+	FileCache m_definition_cache;
+	// Compressed definitions from an earlier visit to the server,
+	// released when they have been used
+	std::string m_cached_itemdef;
+	std::string m_cached_nodedef;
+	// SHA1s of the cached or current definitions, empty if none
+	std::string m_itemdef_sha1;
+	std::string m_nodedef_sha1;
 	friend class FarMesh;
 
 	// time_of_day speed approximation for old protocol
@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 #include "profiler.h"
 #include "settings.h"
+#include "porting.h"
 #include "util/mathconstants.h"
 #include <algorithm>
 
@@ -158,6 +159,71 @@ static bool isOccluded(Map *map, v3s16 p0, v3s16 p1, float step, float stepfac,
 	return false;
 }
 
+/*
+	A block is occluded if the center and all the corners of it are
+	hidden from the camera.
+*/
+static bool isBlockOccluded(Map *map, v3s16 blockpos, v3s16 cam_pos_nodes,
+		INodeDefManager *nodemgr)
+{
+	v3s16 cpn = blockpos * MAP_BLOCKSIZE;
+	cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
+	float step = BS*1;
+	float stepfac = 1.1;
+	float startoff = BS*1;
+	float endoff = -BS*MAP_BLOCKSIZE*1.42*1.42;
+	v3s16 spn = cam_pos_nodes + v3s16(0,0,0);
+	s16 bs2 = MAP_BLOCKSIZE/2 + 1;
+	u32 needed_count = 1;
+	return (
+		isOccluded(map, spn, cpn + v3s16(0,0,0),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(bs2,bs2,bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(bs2,bs2,-bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(bs2,-bs2,bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(bs2,-bs2,-bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(-bs2,bs2,bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(-bs2,bs2,-bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(-bs2,-bs2,bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+		isOccluded(map, spn, cpn + v3s16(-bs2,-bs2,-bs2),
+			step, stepfac, startoff, endoff, needed_count, nodemgr)
+	);
+}
+
+/*
+	Whether any block of a cell of DRAWLIST_CELL_SIZE^3 blocks can
+	pass isBlockInSight()
+*/
+static bool isCellInSight(v3s16 cellpos, v3f camera_pos, v3f camera_dir,
+		f32 camera_fov, f32 range)
+{
+	s16 cell_nodes = DRAWLIST_CELL_SIZE * MAP_BLOCKSIZE;
+	v3s16 cellpos_nodes = cellpos * cell_nodes;
+
+	// Cell center position
+	v3f center(
+			((float)cellpos_nodes.X + cell_nodes/2) * BS,
+			((float)cellpos_nodes.Y + cell_nodes/2) * BS,
+			((float)cellpos_nodes.Z + cell_nodes/2) * BS
+	);
+
+	// This contains the bounding spheres of all the blocks of the cell
+	f32 cell_max_radius = 0.866025403784 * cell_nodes * BS;
+
+	if((center - camera_pos).getLength() - cell_max_radius > range)
+		return false;
+
+	return isSphereInSight(center, cell_max_radius,
+			camera_pos, camera_dir, camera_fov);
+}
+
 void ClientMap::updateDrawList(video::IVideoDriver* driver)
 {
 	ScopeProfiler sp(g_profiler, "CM::updateDrawList()", SPT_AVG);
@@ -199,11 +265,37 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 			p_nodes_max.X / MAP_BLOCKSIZE + 1,
 			p_nodes_max.Y / MAP_BLOCKSIZE + 1,
 			p_nodes_max.Z / MAP_BLOCKSIZE + 1);
+
+	float range = 100000 * BS;
+	if(m_control.range_all == false)
+		range = m_control.wanted_range * BS;
+
+	// No occlusion culling when free_move is on and camera is
+	// inside ground
+	bool occlusion_culling_enabled = true;
+	if(g_settings->getBool("free_move")){
+		MapNode n = getNodeNoEx(cam_pos_nodes);
+		if(n.getContent() == CONTENT_IGNORE ||
+				nodemgr->get(n).solidness == 2)
+			occlusion_culling_enabled = false;
+	}
+
+	u32 time_ms = porting::getTimeMs();
+
+	// Results of isCellInSight() for this update
+	std::map<v3s16, bool> cells_in_sight;
+	// Whether any cell of a column of cells is in sight
+	std::map<v2s16, bool> columns_in_sight;
+	// Occlusion test results for the blocks in sight. This replaces
+	// m_occlusion_cache, dropping the blocks that went out of sight.
+	std::map<v3s16, OcclusionCacheEntry> occlusion_cache;
 	
 	// Number of blocks in rendering range
 	u32 blocks_in_range = 0;
 	// Number of blocks occlusion culled
 	u32 blocks_occlusion_culled = 0;
+	// Number of occlusion tests skipped by using an earlier result
+	u32 occlusion_cache_hits = 0;
 	// Number of blocks in rendering range but don't have a mesh
 	u32 blocks_in_range_without_mesh = 0;
 	// Blocks that had mesh that would have been drawn according to
@@ -216,19 +308,63 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	// Blocks from which stuff was actually drawn
 	//u32 blocks_without_stuff = 0;
 
-	for(std::map<v2s16, MapSector*>::iterator
-			si = m_sectors.begin();
-			si != m_sectors.end(); ++si)
+	/*
+		Only walk the sectors within the range. Sectors are sorted by
+		X and then by Y, so every row of sectors along Y can be looked
+		up separately.
+	*/
+	std::map<v2s16, MapSector*>::iterator si;
+	if(m_control.range_all)
+		si = m_sectors.begin();
+	else
+		si = m_sectors.lower_bound(v2s16(p_blocks_min.X, p_blocks_min.Z));
+	while(si != m_sectors.end())
 	{
 		MapSector *sector = si->second;
 		v2s16 sp = sector->getPos();
 		
 		if(m_control.range_all == false)
 		{
-			if(sp.X < p_blocks_min.X
-			|| sp.X > p_blocks_max.X
-			|| sp.Y < p_blocks_min.Z
-			|| sp.Y > p_blocks_max.Z)
+			if(sp.X > p_blocks_max.X)
+				break;
+			if(sp.Y < p_blocks_min.Z)
+			{
+				si = m_sectors.lower_bound(v2s16(sp.X, p_blocks_min.Z));
+				continue;
+			}
+			if(sp.Y > p_blocks_max.Z)
+			{
+				si = m_sectors.lower_bound(v2s16(sp.X + 1, p_blocks_min.Z));
+				continue;
+			}
+		}
+		++si;
+
+		/*
+			Skip the sector if no cell of its column of cells is in
+			sight
+		*/
+		if(m_control.range_all == false)
+		{
+			v2s16 columnpos = getContainerPos(sp, DRAWLIST_CELL_SIZE);
+			std::map<v2s16, bool>::iterator ci =
+					columns_in_sight.find(columnpos);
+			if(ci == columns_in_sight.end())
+			{
+				bool in_sight = false;
+				s16 y_min = getContainerPos(p_blocks_min.Y, DRAWLIST_CELL_SIZE);
+				s16 y_max = getContainerPos(p_blocks_max.Y, DRAWLIST_CELL_SIZE);
+				for(s16 y = y_min; y <= y_max && !in_sight; y++)
+				{
+					in_sight = isCellInSight(
+							v3s16(columnpos.X, y, columnpos.Y),
+							camera_position, camera_direction,
+							camera_fov, range);
+				}
+				ci = columns_in_sight.insert(
+						std::make_pair(columnpos, in_sight)).first;
+			}
+			if(ci->second == false)
 				continue;
 		}
 
@@ -245,18 +381,27 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 		for(i=sectorblocks.begin(); i!=sectorblocks.end(); i++)
 		{
 			MapBlock *block = *i;
+			v3s16 bp = block->getPos();
 
 			/*
 				Compare block position to camera position, skip
 				if not seen on display
 			*/
-			
-			float range = 100000 * BS;
-			if(m_control.range_all == false)
-				range = m_control.wanted_range * BS;
+
+			v3s16 cellpos = getContainerPos(bp, DRAWLIST_CELL_SIZE);
+			std::map<v3s16, bool>::iterator ci = cells_in_sight.find(cellpos);
+			if(ci == cells_in_sight.end())
+			{
+				bool in_sight = isCellInSight(cellpos, camera_position,
+						camera_direction, camera_fov, range);
+				ci = cells_in_sight.insert(
+						std::make_pair(cellpos, in_sight)).first;
+			}
+			if(ci->second == false)
+				continue;
 
 			float d = 0.0;
-			if(isBlockInSight(block->getPos(), camera_position,
+			if(isBlockInSight(bp, camera_position,
 					camera_direction, camera_fov,
 					range, &d) == false)
 			{
@@ -284,51 +429,48 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 
 			/*
 				Occlusion culling
-			*/
 
-			// No occlusion culling when free_move is on and camera is
-			// inside ground
-			bool occlusion_culling_enabled = true;
-			if(g_settings->getBool("free_move")){
-				MapNode n = getNodeNoEx(cam_pos_nodes);
-				if(n.getContent() == CONTENT_IGNORE ||
-						nodemgr->get(n).solidness == 2)
-					occlusion_culling_enabled = false;
-			}
+				Occlusion doesn't depend on the camera direction, so the
+				result of the test is reused while the camera stays near
+				where it was made. The farther away the block is, the
+				more the camera can move.
+			*/
 
-			v3s16 cpn = block->getPos() * MAP_BLOCKSIZE;
-			cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
-			float step = BS*1;
-			float stepfac = 1.1;
-			float startoff = BS*1;
-			float endoff = -BS*MAP_BLOCKSIZE*1.42*1.42;
-			v3s16 spn = cam_pos_nodes + v3s16(0,0,0);
-			s16 bs2 = MAP_BLOCKSIZE/2 + 1;
-			u32 needed_count = 1;
-			if(
-				occlusion_culling_enabled &&
-				isOccluded(this, spn, cpn + v3s16(0,0,0),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr)
-			)
+			if(occlusion_culling_enabled)
 			{
-				blocks_occlusion_culled++;
-				continue;
+				std::map<v3s16, OcclusionCacheEntry>::iterator oi =
+						m_occlusion_cache.find(bp);
+				bool reuse = false;
+				if(oi != m_occlusion_cache.end() &&
+						time_ms - oi->second.time_ms < OCCLUSION_CACHE_TIMEOUT_MS)
+				{
+					v3s16 moved = cam_pos_nodes - oi->second.camera_pos;
+					s16 max_moved = d / (BS * MAP_BLOCKSIZE * 4);
+					reuse = (abs(moved.X) <= max_moved &&
+							abs(moved.Y) <= max_moved &&
+							abs(moved.Z) <= max_moved);
+				}
+
+				OcclusionCacheEntry entry;
+				if(reuse)
+				{
+					entry = oi->second;
+					occlusion_cache_hits++;
+				}
+				else
+				{
+					entry.occluded = isBlockOccluded(this, bp,
+							cam_pos_nodes, nodemgr);
+					entry.camera_pos = cam_pos_nodes;
+					entry.time_ms = time_ms;
+				}
+				occlusion_cache[bp] = entry;
+
+				if(entry.occluded)
+				{
+					blocks_occlusion_culled++;
+					continue;
+				}
 			}
 			
 			// This block is in range. Reset usage timer.
@@ -343,7 +485,7 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 
 			// Add to set
 			block->refGrab();
-			m_drawlist[block->getPos()] = block;
+			m_drawlist[bp] = block;
 
 			sector_blocks_drawn++;
 			blocks_drawn++;
@@ -354,11 +496,14 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 			m_last_drawn_sectors.insert(sp);
 	}
 
+	m_occlusion_cache.swap(occlusion_cache);
+
 	m_control.blocks_would_have_drawn = blocks_would_have_drawn;
 	m_control.blocks_drawn = blocks_drawn;
 
 	g_profiler->avg("CM: blocks in range", blocks_in_range);
 	g_profiler->avg("CM: blocks occlusion culled", blocks_occlusion_culled);
+	g_profiler->avg("CM: occlusion cache hits", occlusion_cache_hits);
 	if(blocks_in_range != 0)
 		g_profiler->avg("CM: blocks in range without mesh (frac)",
 				(float)blocks_in_range_without_mesh/blocks_in_range);
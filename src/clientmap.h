@@ -25,6 +25,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 
+// Edge length of the cubes of blocks that are frustum culled as a whole
+// before looking at the blocks in them
+#define DRAWLIST_CELL_SIZE 4
+// How long an occlusion test result of a block can be reused
+#define OCCLUSION_CACHE_TIMEOUT_MS 1000
+
 struct MapDrawControl
 {
 	MapDrawControl():
@@ -146,6 +152,19 @@ class ClientMap : public Map, public scene::ISceneNode
 	JMutex m_camera_mutex;
 
 	std::map<v3s16, MapBlock*> m_drawlist;
+
+	/*
+		Occlusion test results of the blocks that were in sight on the
+		last updateDrawList()
+	*/
+	struct OcclusionCacheEntry
+	{
+		bool occluded;
+		// Camera position in nodes when the test was made
+		v3s16 camera_pos;
+		u32 time_ms;
+	};
+	std::map<v3s16, OcclusionCacheEntry> m_occlusion_cache;
 	
 	std::set<v2s16> m_last_drawn_sectors;
 };
@@ -95,9 +95,20 @@ SharedBuffer<u8> makePacket_TOCLIENT_TIME_OF_DAY(u16 time, float time_speed);
 		TOCLIENT_HUDRM
 		TOCLIENT_HUDCHANGE
 		TOCLIENT_HUD_SET_FLAGS
+	PROTOCOL_VERSION 21:
+		GENERIC_CMD_UPDATE_POSITION_BASELINE
+		GENERIC_CMD_UPDATE_POSITION_DELTA
+		(object positions are sent as deltas against a reliable baseline)
+	PROTOCOL_VERSION 22:
+		TOCLIENT_MEDIA_CHUNK
+		Offsets in TOSERVER_REQUEST_MEDIA for resuming files
+	PROTOCOL_VERSION 23:
+		SHA1s of cached definitions in TOSERVER_INIT2
+		SHA1 in TOCLIENT_ITEMDEF and TOCLIENT_NODEDEF, which are sent
+		    empty if the client has them cached
 */
 
-#define LATEST_PROTOCOL_VERSION 20
+#define LATEST_PROTOCOL_VERSION 23
 
 // Server's supported network protocol range
 #define SERVER_PROTOCOL_VERSION_MIN 13
@@ -113,6 +124,10 @@ SharedBuffer<u8> makePacket_TOCLIENT_TIME_OF_DAY(u16 time, float time_speed);
 #define PASSWORD_SIZE 28       // Maximum password length. Allows for
                                // base64-encoded SHA-1 (27+\0).
 
+// Encodings of files sent with TOCLIENT_MEDIA_CHUNK
+#define MEDIA_COMPRESSION_NONE 0
+#define MEDIA_COMPRESSION_ZLIB 1
+
 #define TEXTURENAME_ALLOWED_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_."
 
 enum ToClientCommand
@@ -300,7 +315,10 @@ enum ToClientCommand
 	/*
 		u16 command
 		u32 length of the next item
-		serialized NodeDefManager
+		zlib-compressed serialized NodeDefManager
+		    (empty if the client has it cached, new as of 23)
+		u16 length of the next item (new as of 23)
+		SHA1 of the compressed definitions
 	*/
 	
 	TOCLIENT_CRAFTITEMDEF = 0x3b,
@@ -327,7 +345,10 @@ enum ToClientCommand
 	/*
 		u16 command
 		u32 length of next item
-		serialized ItemDefManager
+		zlib-compressed serialized ItemDefManager
+		    (empty if the client has it cached, new as of 23)
+		u16 length of the next item (new as of 23)
+		SHA1 of the compressed definitions
 	*/
 	
 	TOCLIENT_PLAY_SOUND = 0x3f,
@@ -488,6 +509,21 @@ enum ToClientCommand
 		u16 len
 		u8[len] value
 	*/
+
+	TOCLIENT_MEDIA_CHUNK = 0x4e,
+	/*
+		Replaces TOCLIENT_MEDIA. The chunks of the requested files are
+		interleaved, each file is sent in order.
+
+		u16 command
+		u16 length of name
+		string name
+		u8 compression (MEDIA_COMPRESSION_*)
+		u32 size of the file as sent (compressed)
+		u32 offset of this chunk
+		u32 length of data
+		data
+	*/
 };
 
 enum ToServerCommand
@@ -510,6 +546,12 @@ enum ToServerCommand
 		After this, the server can send data.
 
 		[0] u16 TOSERVER_INIT2
+		(new as of 23:)
+		u16 length of the next item
+		SHA1 of the item definitions the client has cached for this
+		    server (empty if none)
+		u16 length of the next item
+		SHA1 of the cached node definitions
 	*/
 
 	TOSERVER_GETBLOCK=0x20, // Obsolete
@@ -705,6 +747,9 @@ enum ToServerCommand
 			u16 length of name
 			string name
 		}
+		for each file { (new as of 22)
+			u32 offset to continue a partially received file from
+		}
 	 */
 
 	TOSERVER_RECEIVED_MEDIA = 0x41,
@@ -13,6 +13,7 @@
 #define USE_SOUND 0
 #define USE_CURL 0
 #define USE_FREETYPE 0
+#define USE_LEVELDB 0
 #define STATIC_SHAREDIR ""
 #define BUILD_INFO "non-cmake"
 
@@ -32,6 +33,8 @@
 	#define USE_CURL CMAKE_USE_CURL
 	#undef USE_FREETYPE
 	#define USE_FREETYPE CMAKE_USE_FREETYPE
+	#undef USE_LEVELDB
+	#define USE_LEVELDB CMAKE_USE_LEVELDB
 	#undef STATIC_SHAREDIR
 	#define STATIC_SHAREDIR CMAKE_STATIC_SHAREDIR
 	#undef BUILD_INFO
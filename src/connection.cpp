@@ -26,6 +26,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "util/string.h"
 #include "settings.h"
+#include "profiler.h"
+#include <algorithm>
+#include <set>
 
 namespace con
 {
@@ -39,6 +42,101 @@ static u8 readChannel(u8 *packetdata)
 	return readU8(&packetdata[6]);
 }
 
+/*
+	PacketBuilder
+*/
+
+PacketBuilder::PacketBuilder(u32 size_hint):
+	std::ostream(NULL),
+	m_buf(size_hint)
+{
+	rdbuf(&m_buf);
+}
+
+SharedBuffer<u8> PacketBuilder::getBuffer()
+{
+	return m_buf.getBuffer();
+}
+
+PacketBuilder::Buf::Buf(u32 size_hint):
+	m_buffer(SharedBuffer<u8>::withHeadroom(PACKET_HEADROOM, size_hint))
+{
+	char *begin = (char*)*m_buffer;
+	setp(begin, begin + m_buffer.getSize());
+}
+
+SharedBuffer<u8> PacketBuilder::Buf::getBuffer()
+{
+	u32 used = pptr() - pbase();
+	/*
+		The buffer is doubled when it runs out, so up to half of it can
+		be unused. Data can stay queued for a while, so a lot of unused
+		room is given back by copying the data to a buffer of its size.
+	*/
+	u32 unused = m_buffer.getSize() - used;
+	if(unused > PACKET_BUILDER_MAX_UNUSED && unused > used / 4)
+	{
+		SharedBuffer<u8> b = SharedBuffer<u8>::withHeadroom(
+				PACKET_HEADROOM, used);
+		memcpy(*b, *m_buffer, used);
+		m_buffer = b;
+		char *begin = (char*)*m_buffer;
+		setp(begin, begin + used);
+		pbump(used);
+	}
+	SharedBuffer<u8> b = m_buffer;
+	b.shrink(used);
+	return b;
+}
+
+PacketBuilder::Buf::int_type PacketBuilder::Buf::overflow(int_type c)
+{
+	if(traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+	grow(pptr() - pbase() + 1);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+std::streamsize PacketBuilder::Buf::xsputn(const char *s, std::streamsize n)
+{
+	if(epptr() - pptr() < n)
+		grow(pptr() - pbase() + n);
+	memcpy(pptr(), s, n);
+	pbump(n);
+	return n;
+}
+
+void PacketBuilder::Buf::grow(u32 min_size)
+{
+	u32 used = pptr() - pbase();
+	u32 size = MYMAX(m_buffer.getSize() * 2, min_size);
+	SharedBuffer<u8> b = SharedBuffer<u8>::withHeadroom(PACKET_HEADROOM, size);
+	if(used != 0)
+		memcpy(*b, *m_buffer, used);
+	m_buffer = b;
+	char *begin = (char*)*m_buffer;
+	setp(begin, begin + size);
+	pbump(used);
+}
+
+/*
+	Returns data with room for a header of header_size in front of it.
+	The headroom of data is used if it has some; otherwise data is
+	copied once, into a buffer with room for the rest of the headers.
+*/
+static SharedBuffer<u8> prependHeader(SharedBuffer<u8> &data, u32 header_size)
+{
+	if(data.canPrepend(header_size))
+		return data.prepend(header_size);
+	SharedBuffer<u8> b = SharedBuffer<u8>::withHeadroom(PACKET_HEADROOM,
+			header_size + data.getSize());
+	if(data.getSize() != 0)
+		memcpy(&b[header_size], *data, data.getSize());
+	return b;
+}
+
 BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel)
 {
@@ -58,21 +156,23 @@ BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel)
 {
-	return makePacket(address, *data, data.getSize(),
-			protocol_id, sender_peer_id, channel);
+	BufferedPacket p(prependHeader(data, BASE_HEADER_SIZE));
+	p.address = address;
+
+	writeU32(&p.data[0], protocol_id);
+	writeU16(&p.data[4], sender_peer_id);
+	writeU8(&p.data[6], channel);
+
+	return p;
 }
 
 SharedBuffer<u8> makeOriginalPacket(
 		SharedBuffer<u8> data)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	SharedBuffer<u8> b = prependHeader(data, ORIGINAL_HEADER_SIZE);
 
 	writeU8(&b[0], TYPE_ORIGINAL);
 
-	memcpy(&b[header_size], *data, data.getSize());
-
 	return b;
 }
 
@@ -98,7 +198,8 @@ std::list<SharedBuffer<u8> > makeSplitPacket(
 		u32 payload_size = end - start + 1;
 		u32 packet_size = chunk_header_size + payload_size;
 
-		SharedBuffer<u8> chunk(packet_size);
+		SharedBuffer<u8> chunk = SharedBuffer<u8>::withHeadroom(
+				PACKET_HEADROOM, packet_size);
 		
 		writeU8(&chunk[0], TYPE_SPLIT);
 		writeU16(&chunk[1], seqnum);
@@ -151,15 +252,11 @@ SharedBuffer<u8> makeReliablePacket(
 	/*dstream<<"BEGIN SharedBuffer<u8> makeReliablePacket()"<<std::endl;
 	dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
 			<<((unsigned int)data[0]&0xff)<<std::endl;*/
-	u32 header_size = 3;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	SharedBuffer<u8> b = prependHeader(data, RELIABLE_HEADER_SIZE);
 
 	writeU8(&b[0], TYPE_RELIABLE);
 	writeU16(&b[1], seqnum);
 
-	memcpy(&b[header_size], *data, data.getSize());
-
 	/*dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
 			<<((unsigned int)data[0]&0xff)<<std::endl;*/
 	//dstream<<"END SharedBuffer<u8> makeReliablePacket()"<<std::endl;
@@ -170,71 +267,87 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(RELIABLE_BUFFER_SIZE, (BufferedPacket*)NULL),
+	m_count(0),
+	m_oldest(0),
+	m_newest(0)
+{
+}
+
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for(u32 i=0; i<m_slots.size(); i++)
+		delete m_slots[i];
+}
 
 void ReliablePacketBuffer::print()
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
+	if(empty())
+		return;
+	for(u16 s = m_oldest;; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		if(m_slots[getIndex(s)] != NULL)
+			dout_con<<s<<" ";
+		if(s == m_newest)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_count == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list_size;
-}
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
-{
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
+	return m_count;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+BufferedPacket* ReliablePacketBuffer::findPacket(u16 seqnum)
 {
-	return m_list.end();
+	BufferedPacket *p = m_slots[getIndex(seqnum)];
+	if(p == NULL)
+		return NULL;
+	if(readU16(&(p->data[BASE_HEADER_SIZE+1])) != seqnum)
+		return NULL;
+	return p;
 }
 u16 ReliablePacketBuffer::getFirstSeqnum()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	return m_oldest;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
+	BufferedPacket *r = remove(m_oldest);
+	BufferedPacket p = *r;
+	delete r;
 	return p;
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	if(findPacket(seqnum) == NULL){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
+	BufferedPacket *r = remove(seqnum);
 	BufferedPacket p = *r;
-	m_list.erase(r);
-	--m_list_size;
+	delete r;
 	return p;
 }
+bool ReliablePacketBuffer::canInsert(u16 seqnum)
+{
+	if(empty())
+		return true;
+	u16 oldest = m_oldest;
+	u16 newest = m_newest;
+	if(seqnum_higher(oldest, seqnum))
+		oldest = seqnum;
+	if(seqnum_higher(seqnum, newest))
+		newest = seqnum;
+	return (u16)(newest - oldest) < RELIABLE_BUFFER_SIZE;
+}
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
 	assert(p.data.getSize() >= BASE_HEADER_SIZE+3);
@@ -242,68 +355,93 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	++m_list_size;
-	// Find the right place for the packet and insert it there
-
-	// If list is empty, just add it
-	if(m_list.empty())
-	{
-		m_list.push_back(p);
-		// Done.
-		return;
+	// Callers check this; another packet could be in the slot otherwise
+	assert(canInsert(seqnum));
+
+	u32 i = getIndex(seqnum);
+	if(m_slots[i] != NULL)
+		throw AlreadyExistsException("Same seqnum in buffer");
+
+	m_slots[i] = new BufferedPacket(p);
+	if(m_count == 0){
+		m_oldest = seqnum;
+		m_newest = seqnum;
+	} else {
+		if(seqnum_higher(m_oldest, seqnum))
+			m_oldest = seqnum;
+		if(seqnum_higher(seqnum, m_newest))
+			m_newest = seqnum;
 	}
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); ++i){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			--m_list_size;
-			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+	m_count++;
+}
+
+BufferedPacket* ReliablePacketBuffer::remove(u16 seqnum)
+{
+	u32 i = getIndex(seqnum);
+	BufferedPacket *p = m_slots[i];
+	m_slots[i] = NULL;
+	m_count--;
+	if(m_count == 0)
+		return p;
+	// Move the ends of the range past empty slots
+	if(seqnum == m_oldest){
+		do{
+			m_oldest++;
+		} while(m_slots[getIndex(m_oldest)] == NULL);
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
-	{
-		m_list.push_back(p);
-		// Done.
-		return;
+	else if(seqnum == m_newest){
+		do{
+			m_newest--;
+		} while(m_slots[getIndex(m_newest)] == NULL);
 	}
-	// Insert before i
-	m_list.insert(i, p);
+	return p;
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return;
+	for(u16 s = m_oldest;; s++)
 	{
-		i->time += dtime;
-		i->totaltime += dtime;
+		BufferedPacket *p = m_slots[getIndex(s)];
+		if(p != NULL){
+			p->time += dtime;
+			p->totaltime += dtime;
+		}
+		if(s == m_newest)
+			break;
 	}
 }
 
 void ReliablePacketBuffer::resetTimedOuts(float timeout)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return;
+	for(u16 s = m_oldest;; s++)
 	{
-		if(i->time >= timeout)
-			i->time = 0.0;
+		BufferedPacket *p = m_slots[getIndex(s)];
+		if(p != NULL && p->time >= timeout){
+			p->time = 0.0;
+			p->resend_count++;
+			p->later_acks = 0;
+			p->fast_resent = false;
+		}
+		if(s == m_newest)
+			break;
 	}
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return false;
+	for(u16 s = m_oldest;; s++)
 	{
-		if(i->totaltime >= timeout)
+		BufferedPacket *p = m_slots[getIndex(s)];
+		if(p != NULL && p->totaltime >= timeout)
 			return true;
+		if(s == m_newest)
+			break;
 	}
 	return false;
 }
@@ -311,15 +449,39 @@ bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return timed_outs;
+	for(u16 s = m_oldest;; s++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		BufferedPacket *p = m_slots[getIndex(s)];
+		if(p != NULL && p->time >= timeout)
+			timed_outs.push_back(*p);
+		if(s == m_newest)
+			break;
 	}
 	return timed_outs;
 }
 
+std::list<BufferedPacket> ReliablePacketBuffer::getPassedByAck(u16 seqnum,
+		u16 later_acks)
+{
+	std::list<BufferedPacket> passed;
+	if(empty() || !seqnum_higher(seqnum, m_oldest))
+		return passed;
+	BufferedPacket *p = m_slots[getIndex(m_oldest)];
+	if(p->fast_resent)
+		return passed;
+	p->later_acks++;
+	if(p->later_acks >= later_acks){
+		p->time = 0.0;
+		p->resend_count++;
+		p->later_acks = 0;
+		p->fast_resent = true;
+		passed.push_back(*p);
+	}
+	return passed;
+}
+
 /*
 	IncomingSplitBuffer
 */
@@ -346,12 +508,17 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	u16 chunk_count = readU16(&p.data[BASE_HEADER_SIZE+3]);
 	u16 chunk_num = readU16(&p.data[BASE_HEADER_SIZE+5]);
 
+	if(chunk_count == 0 || chunk_count > MAX_SPLIT_CHUNK_COUNT){
+		derr_con<<"Connection: WARNING: Dropping split packet with "
+				<<"chunk_count="<<chunk_count<<std::endl;
+		return SharedBuffer<u8>();
+	}
+
 	// Add if doesn't exist
 	if(m_buf.find(seqnum) == m_buf.end())
 	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
-		sp->chunk_count = chunk_count;
-		sp->reliable = reliable;
+		IncomingSplitPacket *sp = new IncomingSplitPacket(chunk_count,
+				reliable);
 		m_buf[seqnum] = sp;
 	}
 	
@@ -367,6 +534,13 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl;
 
+	if(chunk_num >= sp->chunk_count){
+		derr_con<<"Connection: WARNING: chunk_num="<<chunk_num
+				<<" >= sp->chunk_count="<<sp->chunk_count
+				<<std::endl;
+		return SharedBuffer<u8>();
+	}
+
 	// If chunk already exists, ignore it.
 	// Sometimes two identical packets may arrive when there is network
 	// lag and the server re-sends stuff.
@@ -388,19 +562,17 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	// Calculate total size
 	u32 totalsize = 0;
 	for(std::map<u16, SharedBuffer<u8> >::iterator i = sp->chunks.begin();
-		i != sp->chunks.end(); ++i)
-	{
+			i != sp->chunks.end(); ++i)
 		totalsize += i->second.getSize();
-	}
 	
 	SharedBuffer<u8> fulldata(totalsize);
 
-	// Copy chunks to data buffer
+	// Copy chunks to data buffer; the map is ordered by chunk number
 	u32 start = 0;
-	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
-			chunk_i++)
+	for(std::map<u16, SharedBuffer<u8> >::iterator i = sp->chunks.begin();
+			i != sp->chunks.end(); ++i)
 	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
+		SharedBuffer<u8> &buf = i->second;
 		u16 chunkdatasize = buf.getSize();
 		memcpy(&fulldata[start], *buf, chunkdatasize);
 		start += chunkdatasize;;
@@ -468,7 +640,14 @@ Peer::Peer(u16 a_id, Address a_address):
 	m_max_num_sent(0),
 	congestion_control_aim_rtt(0.2),
 	congestion_control_max_rate(400),
-	congestion_control_min_rate(10)
+	congestion_control_min_rate(10),
+	cwnd(CONGESTION_WINDOW_INITIAL),
+	ssthresh(CONGESTION_WINDOW_MAX),
+	min_rtt(-1.0),
+	loss_timer(0.0),
+	m_rate_bytes_sent(0),
+	m_rate_bytes_received(0),
+	m_rate_timer(0.0)
 {
 }
 Peer::~Peer()
@@ -477,20 +656,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < congestion_control_max_rate)
-				m_max_packets_per_second += 10;
-		} else if(rtt < congestion_control_aim_rtt){
-			if(m_max_packets_per_second < congestion_control_max_rate)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < congestion_control_min_rate)
-				m_max_packets_per_second = congestion_control_min_rate;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -515,6 +680,81 @@ void Peer::reportRTT(float rtt)
 		timeout = RESEND_TIMEOUT_MAX;
 	resend_timeout = timeout;
 }
+
+void Peer::reportAck(float rtt)
+{
+	if(rtt >= 0.0 && (min_rtt < 0.0 || rtt < min_rtt))
+		min_rtt = rtt;
+
+	/*
+		Don't grow the window while packets are queueing up somewhere
+		on the way. This is what keeps a high latency link from being
+		flooded before anything gets lost.
+	*/
+	if(rtt >= 0.0 && rtt - min_rtt > congestion_control_aim_rtt)
+		return;
+
+	if(cwnd < ssthresh)
+		cwnd += 1.0;
+	else
+		cwnd += 1.0 / cwnd;
+	if(cwnd > CONGESTION_WINDOW_MAX)
+		cwnd = CONGESTION_WINDOW_MAX;
+}
+
+void Peer::reportLoss()
+{
+	// Losses within one round trip are one congestion event
+	float rtt = avg_rtt >= 0.0 ? avg_rtt : resend_timeout;
+	if(loss_timer < rtt)
+		return;
+	loss_timer = 0.0;
+
+	ssthresh = cwnd / 2;
+	if(ssthresh < CONGESTION_WINDOW_MIN)
+		ssthresh = CONGESTION_WINDOW_MIN;
+	cwnd = ssthresh;
+}
+
+void Peer::step(float dtime)
+{
+	loss_timer += dtime;
+
+	// Forget the minimum slowly, the route may have changed
+	if(min_rtt >= 0.0 && avg_rtt > min_rtt)
+		min_rtt += (avg_rtt - min_rtt) * MYMIN(dtime * 0.01, 1.0);
+
+	/*
+		Pace the packets so that a window is sent over about half a
+		round trip instead of in one burst
+	*/
+	float rtt = avg_rtt >= 0.0 ? MYMAX(avg_rtt, 0.01) : resend_timeout;
+	m_max_packets_per_second = cwnd * 2 / rtt;
+	if(m_max_packets_per_second > congestion_control_max_rate)
+		m_max_packets_per_second = congestion_control_max_rate;
+	if(m_max_packets_per_second < congestion_control_min_rate)
+		m_max_packets_per_second = congestion_control_min_rate;
+
+	m_rate_timer += dtime;
+	if(m_rate_timer >= 1.0)
+	{
+		stats.send_rate = m_rate_bytes_sent / m_rate_timer;
+		stats.receive_rate = m_rate_bytes_received / m_rate_timer;
+		m_rate_bytes_sent = 0;
+		m_rate_bytes_received = 0;
+		m_rate_timer = 0.0;
+	}
+	stats.congestion_window = cwnd;
+	stats.avg_rtt = avg_rtt;
+}
+
+u32 Peer::getReliablesInFlight()
+{
+	u32 count = 0;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+		count += channels[i].outgoing_reliables.size();
+	return count;
+}
 				
 /*
 	Connection
@@ -527,10 +767,16 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout):
 	m_peer_id(0),
 	m_bc_peerhandler(NULL),
 	m_bc_receive_timeout(0),
-	m_indentation(0)
+	m_indentation(0),
+	m_received_count(0),
+	m_receive_thread(this),
+	m_send_thread(this)
 {
+	m_io_mutex.Init();
 	m_socket.setTimeoutMs(5);
 
+	m_receive_thread.Start();
+	m_send_thread.Start();
 	Start();
 }
 
@@ -542,10 +788,16 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_peer_id(0),
 	m_bc_peerhandler(peerhandler),
 	m_bc_receive_timeout(0),
-	m_indentation(0)
+	m_indentation(0),
+	m_received_count(0),
+	m_receive_thread(this),
+	m_send_thread(this)
 {
+	m_io_mutex.Init();
 	m_socket.setTimeoutMs(5);
 
+	m_receive_thread.Start();
+	m_send_thread.Start();
 	Start();
 }
 
@@ -553,6 +805,11 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 Connection::~Connection()
 {
 	stop();
+	// The send thread sends what is left before quitting
+	m_send_thread.setRun(false);
+	m_to_send_event.signal();
+	m_send_thread.stop();
+	m_receive_thread.stop();
 	// Delete peers
 	for(std::map<u16, Peer*>::iterator
 			j = m_peers.begin();
@@ -596,6 +853,11 @@ void * Connection::Thread()
 		send(dtime);
 
 		receive();
+
+		flushSend();
+
+		// Wait for something to be received or a command
+		m_wakeup.wait(CONNECTION_STEP_MAX_MS);
 		
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
@@ -603,6 +865,170 @@ void * Connection::Thread()
 	return NULL;
 }
 
+void * ConnectionReceiveThread::Thread()
+{
+	ThreadStarted();
+	log_register_thread("ConnectionReceive");
+
+	Connection *con = m_connection;
+	u32 size = con->m_max_packet_size * 2 + BASE_HEADER_SIZE;
+	std::vector<SharedBuffer<u8> > buffers;
+	void *data[CONNECTION_IO_BATCH];
+	for(u32 i=0; i<CONNECTION_IO_BATCH; i++){
+		buffers.push_back(SharedBuffer<u8>(size));
+		data[i] = *buffers[i];
+	}
+	Address senders[CONNECTION_IO_BATCH];
+	int sizes[CONNECTION_IO_BATCH];
+
+	u32 stats_time = porting::getTimeMs();
+	u32 stats_packets = 0;
+	u32 stats_batches = 0;
+	u32 stats_dropped = 0;
+
+	while(getRun())
+	{
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		int count = 0;
+		if(con->m_socket.WaitData(50))
+			count = con->m_socket.ReceiveMultiple(senders, data, size,
+					sizes, CONNECTION_IO_BATCH);
+		if(count > 0)
+		{
+			std::list<BufferedPacket> received;
+			for(int i=0; i<count; i++){
+				BufferedPacket p((u8*)data[i], sizes[i]);
+				p.address = senders[i];
+				received.push_back(p);
+			}
+			{
+				JMutexAutoLock lock(con->m_io_mutex);
+				u32 room = 0;
+				if(con->m_received_count < CONNECTION_RECEIVE_QUEUE_MAX)
+					room = CONNECTION_RECEIVE_QUEUE_MAX - con->m_received_count;
+				// What doesn't fit stays in received and is dropped
+				std::list<BufferedPacket>::iterator end = received.begin();
+				for(u32 i=0; i<room && end != received.end(); i++, ++end)
+					con->m_received_count++;
+				con->m_received.splice(con->m_received.end(), received,
+						received.begin(), end);
+			}
+			con->m_wakeup.signal();
+			stats_packets += count;
+			stats_batches++;
+			if(!received.empty()){
+				u32 dropped = received.size();
+				g_profiler->add("Connection: received packets dropped",
+						dropped);
+				stats_dropped += dropped;
+			}
+		}
+
+		u32 time = porting::getTimeMs();
+		if(time - stats_time >= 1000)
+		{
+			float dtime = (float)(time - stats_time) / 1000.;
+			g_profiler->avg("Connection: received packets/s",
+					stats_packets / dtime);
+			if(stats_batches != 0)
+				g_profiler->avg("Connection: received packets/syscall",
+						(float)stats_packets / stats_batches);
+			if(stats_dropped != 0)
+				derr_con<<"Connection: Receive queue full, dropped "
+						<<stats_dropped<<" datagrams"<<std::endl;
+			stats_time = time;
+			stats_packets = 0;
+			stats_batches = 0;
+			stats_dropped = 0;
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(derr_con);
+	}
+
+	log_deregister_thread();
+	return NULL;
+}
+
+void * ConnectionSendThread::Thread()
+{
+	ThreadStarted();
+	log_register_thread("ConnectionSend");
+
+	Connection *con = m_connection;
+	Address destinations[CONNECTION_IO_BATCH];
+	const void *data[CONNECTION_IO_BATCH];
+	int sizes[CONNECTION_IO_BATCH];
+
+	u32 stats_time = porting::getTimeMs();
+	u32 stats_packets = 0;
+	u32 stats_batches = 0;
+
+	for(;;)
+	{
+		bool run = getRun();
+		if(run)
+			con->m_to_send_event.wait(1000);
+
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		std::list<BufferedPacket> to_send;
+		{
+			JMutexAutoLock lock(con->m_io_mutex);
+			to_send.swap(con->m_to_send);
+		}
+
+		std::list<BufferedPacket>::iterator i = to_send.begin();
+		while(i != to_send.end())
+		{
+			int count = 0;
+			for(; i != to_send.end() && count < CONNECTION_IO_BATCH; ++i){
+				destinations[count] = i->address;
+				data[count] = *i->data;
+				sizes[count] = i->data.getSize();
+				count++;
+			}
+			int sent = 0;
+			while(sent < count)
+			{
+				int r = con->m_socket.SendMultiple(&destinations[sent],
+						&data[sent], &sizes[sent], count - sent);
+				stats_batches++;
+				sent += r;
+				if(sent < count){
+					// Skip the one that failed
+					derr_con<<"ConnectionSendThread: Failed to send packet to "
+							<<destinations[sent].serializeString()<<std::endl;
+					sent++;
+				}
+			}
+			stats_packets += count;
+		}
+
+		u32 time = porting::getTimeMs();
+		if(time - stats_time >= 1000)
+		{
+			float dtime = (float)(time - stats_time) / 1000.;
+			g_profiler->avg("Connection: sent packets/s",
+					stats_packets / dtime);
+			if(stats_batches != 0)
+				g_profiler->avg("Connection: sent packets/syscall",
+						(float)stats_packets / stats_batches);
+			stats_time = time;
+			stats_packets = 0;
+			stats_batches = 0;
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(derr_con);
+
+		if(!run)
+			break;
+	}
+
+	log_deregister_thread();
+	return NULL;
+}
+
 void Connection::putEvent(ConnectionEvent &e)
 {
 	assert(e.type != CONNEVENT_NONE);
@@ -656,20 +1082,28 @@ void Connection::send(float dtime)
 				peer->m_max_packets_per_second;
 	}
 	Queue<OutgoingPacket> postponed_packets;
+	// Once a packet of a channel is postponed, the rest of the channel
+	// is too, so that packets are sent in the order they were queued
+	std::set<std::pair<u16, u8> > postponed_channels;
 	while(!m_outgoing_queue.empty()){
 		OutgoingPacket packet = m_outgoing_queue.pop_front();
 		Peer *peer = getPeerNoEx(packet.peer_id);
 		if(!peer)
 			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
-			postponed_packets.push_back(packet);
-		} else if(peer->m_num_sent < peer->m_max_num_sent){
-			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
-			peer->m_num_sent++;
-		} else {
+		Channel *channel = &(peer->channels[packet.channelnum]);
+		std::pair<u16, u8> channel_key(packet.peer_id, packet.channelnum);
+		if(postponed_channels.count(channel_key) != 0 ||
+				peer->m_num_sent >= peer->m_max_num_sent ||
+				(packet.reliable && (peer->getReliablesInFlight() >=
+				(u32)peer->cwnd || !channel->outgoing_reliables.canInsert(
+				channel->next_outgoing_seqnum)))){
+			postponed_channels.insert(channel_key);
 			postponed_packets.push_back(packet);
+			continue;
 		}
+		rawSendAsPacket(packet.peer_id, packet.channelnum,
+				packet.data, packet.reliable);
+		peer->m_num_sent++;
 	}
 	while(!postponed_packets.empty()){
 		m_outgoing_queue.push_back(postponed_packets.pop_front());
@@ -686,208 +1120,216 @@ void Connection::send(float dtime)
 	}
 }
 
-// Receive packets from the network and buffers and create ConnectionEvents
+// Process the received datagrams and buffers and create ConnectionEvents
 void Connection::receive()
 {
-	u32 datasize = m_max_packet_size * 2;  // Double it just to be safe
-	// TODO: We can not know how many layers of header there are.
-	// For now, just assume there are no other than the base headers.
-	u32 packet_maxsize = datasize + BASE_HEADER_SIZE;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	std::list<BufferedPacket> received;
+	{
+		JMutexAutoLock lock(m_io_mutex);
+		received.swap(m_received);
+		m_received_count = 0;
+	}
 
-	bool single_wait_done = false;
-	
+	for(std::list<BufferedPacket>::iterator i = received.begin();
+			i != received.end(); ++i)
+	{
+		deliverBuffered();
+		try{
+			processReceived(*i);
+		}catch(InvalidIncomingDataException &e){
+		}
+		catch(ProcessedSilentlyException &e){
+		}
+	}
+	deliverBuffered();
+
+	sendPendingAcks();
+}
+
+void Connection::deliverBuffered()
+{
 	for(;;)
 	{
-	try{
-		/* Check if some buffer has relevant data */
-		{
+		try{
 			u16 peer_id;
 			SharedBuffer<u8> resultdata;
 			bool got = getFromBuffers(peer_id, resultdata);
-			if(got){
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				putEvent(e);
-				continue;
-			}
-		}
-		
-		if(single_wait_done){
-			if(m_socket.WaitData(0) == false)
+			if(!got)
 				break;
+			ConnectionEvent e;
+			e.dataReceived(peer_id, resultdata);
+			putEvent(e);
+		}catch(InvalidIncomingDataException &e){
 		}
-		
-		single_wait_done = true;
-
-		Address sender;
-		s32 received_size = m_socket.Receive(sender, *packetdata, packet_maxsize);
-
-		if(received_size < 0)
-			break;
-		if(received_size < BASE_HEADER_SIZE)
-			continue;
-		if(readU32(&packetdata[0]) != m_protocol_id)
-			continue;
-		
-		u16 peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
-		if(channelnum > CHANNEL_COUNT-1){
-			PrintInfo(derr_con);
-			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
-			throw InvalidIncomingDataException("Channel doesn't exist");
+		catch(ProcessedSilentlyException &e){
 		}
+	}
+}
 
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			/*
-				Somebody is trying to send stuff to us with no peer id.
-				
-				Check if the same address and port was added to our peer
-				list before.
-				Allow only entries that have has_sent_with_id==false.
-			*/
+void Connection::processReceived(BufferedPacket &packet)
+{
+	Address &sender = packet.address;
+	u32 received_size = packet.data.getSize();
+	if(received_size < BASE_HEADER_SIZE)
+		return;
+	if(readU32(&packet.data[0]) != m_protocol_id)
+		return;
+	
+	u16 peer_id = readPeerId(*packet.data);
+	u8 channelnum = readChannel(*packet.data);
+	if(channelnum > CHANNEL_COUNT-1){
+		PrintInfo(derr_con);
+		derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
+		throw InvalidIncomingDataException("Channel doesn't exist");
+	}
 
-			std::map<u16, Peer*>::iterator j;
-			j = m_peers.begin();
-			for(; j != m_peers.end(); ++j)
-			{
-				Peer *peer = j->second;
-				if(peer->has_sent_with_id)
-					continue;
-				if(peer->address == sender)
-					break;
-			}
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		/*
+			Somebody is trying to send stuff to us with no peer id.
 			
-			/*
-				If no peer was found with the same address and port,
-				we shall assume it is a new peer and create an entry.
-			*/
-			if(j == m_peers.end())
-			{
-				// Pass on to adding the peer
-			}
-			// Else: A peer was found.
-			else
-			{
-				Peer *peer = j->second;
-				peer_id = peer->id;
-				PrintInfo(derr_con);
-				derr_con<<"WARNING: Assuming unknown peer to be "
-						<<"peer_id="<<peer_id<<std::endl;
-			}
+			Check if the same address and port was added to our peer
+			list before.
+			Allow only entries that have has_sent_with_id==false.
+		*/
+
+		std::map<u16, Peer*>::iterator j;
+		j = m_peers.begin();
+		for(; j != m_peers.end(); ++j)
+		{
+			Peer *peer = j->second;
+			if(peer->has_sent_with_id)
+				continue;
+			if(peer->address == sender)
+				break;
 		}
 		
 		/*
-			The peer was not found in our lists. Add it.
+			If no peer was found with the same address and port,
+			we shall assume it is a new peer and create an entry.
 		*/
-		if(peer_id == PEER_ID_INEXISTENT)
+		if(j == m_peers.end())
 		{
-			// Somebody wants to make a new connection
-
-			// Get a unique peer id (2 or higher)
-			u16 peer_id_new = 2;
-			/*
-				Find an unused peer id
-			*/
-			bool out_of_ids = false;
-			for(;;)
-			{
-				// Check if exists
-				if(m_peers.find(peer_id_new) == m_peers.end())
-					break;
-				// Check for overflow
-				if(peer_id_new == 65535){
-					out_of_ids = true;
-					break;
-				}
-				peer_id_new++;
-			}
-			if(out_of_ids){
-				errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
-				continue;
-			}
-
-			PrintInfo();
-			dout_con<<"Receive(): Got a packet with peer_id=PEER_ID_INEXISTENT,"
-					" giving peer_id="<<peer_id_new<<std::endl;
-
-			// Create a peer
-			Peer *peer = new Peer(peer_id_new, sender);
-			m_peers[peer->id] = peer;
-			
-			// Create peer addition event
-			ConnectionEvent e;
-			e.peerAdded(peer_id_new, sender);
-			putEvent(e);
-			
-			// Create CONTROL packet to tell the peer id to the new peer.
-			SharedBuffer<u8> reply(4);
-			writeU8(&reply[0], TYPE_CONTROL);
-			writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
-			writeU16(&reply[2], peer_id_new);
-			sendAsPacket(peer_id_new, 0, reply, true);
-			
-			// We're now talking to a valid peer_id
-			peer_id = peer_id_new;
-
-			// Go on and process whatever it sent
+			// Pass on to adding the peer
 		}
-
-		std::map<u16, Peer*>::iterator node = m_peers.find(peer_id);
-
-		if(node == m_peers.end())
+		// Else: A peer was found.
+		else
 		{
-			// Peer not found
-			// This means that the peer id of the sender is not PEER_ID_INEXISTENT
-			// and it is invalid.
+			Peer *peer = j->second;
+			peer_id = peer->id;
 			PrintInfo(derr_con);
-			derr_con<<"Receive(): Peer not found"<<std::endl;
-			throw InvalidIncomingDataException("Peer not found (possible timeout)");
+			derr_con<<"WARNING: Assuming unknown peer to be "
+					<<"peer_id="<<peer_id<<std::endl;
 		}
+	}
+	
+	/*
+		The peer was not found in our lists. Add it.
+	*/
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		// Somebody wants to make a new connection
 
-		Peer *peer = node->second;
-
-		// Validate peer address
-		if(peer->address != sender)
+		// Get a unique peer id (2 or higher)
+		u16 peer_id_new = 2;
+		/*
+			Find an unused peer id
+		*/
+		bool out_of_ids = false;
+		for(;;)
 		{
-			PrintInfo(derr_con);
-			derr_con<<"Peer "<<peer_id<<" sending from different address."
-					" Ignoring."<<std::endl;
-			continue;
+			// Check if exists
+			if(m_peers.find(peer_id_new) == m_peers.end())
+				break;
+			// Check for overflow
+			if(peer_id_new == 65535){
+				out_of_ids = true;
+				break;
+			}
+			peer_id_new++;
+		}
+		if(out_of_ids){
+			errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
+			return;
 		}
-		
-		peer->timeout_counter = 0.0;
 
-		Channel *channel = &(peer->channels[channelnum]);
-		
-		// Throw the received packet to channel->processPacket()
+		PrintInfo();
+		dout_con<<"Receive(): Got a packet with peer_id=PEER_ID_INEXISTENT,"
+				" giving peer_id="<<peer_id_new<<std::endl;
 
-		// Make a new SharedBuffer from the data without the base headers
-		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-				strippeddata.getSize());
+		// Create a peer
+		Peer *peer = new Peer(peer_id_new, sender);
+		m_peers[peer->id] = peer;
 		
-		try{
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
-			
-			PrintInfo();
-			dout_con<<"ProcessPacket returned data of size "
-					<<resultdata.getSize()<<std::endl;
-			
-			ConnectionEvent e;
-			e.dataReceived(peer_id, resultdata);
-			putEvent(e);
-			continue;
-		}catch(ProcessedSilentlyException &e){
-		}
-	}catch(InvalidIncomingDataException &e){
+		// Create peer addition event
+		ConnectionEvent e;
+		e.peerAdded(peer_id_new, sender);
+		putEvent(e);
+		
+		// Create CONTROL packet to tell the peer id to the new peer.
+		SharedBuffer<u8> reply(4);
+		writeU8(&reply[0], TYPE_CONTROL);
+		writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
+		writeU16(&reply[2], peer_id_new);
+		sendAsPacket(peer_id_new, 0, reply, true);
+		
+		// We're now talking to a valid peer_id
+		peer_id = peer_id_new;
+
+		// Go on and process whatever it sent
 	}
-	catch(ProcessedSilentlyException &e){
+
+	std::map<u16, Peer*>::iterator node = m_peers.find(peer_id);
+
+	if(node == m_peers.end())
+	{
+		// Peer not found
+		// This means that the peer id of the sender is not PEER_ID_INEXISTENT
+		// and it is invalid.
+		PrintInfo(derr_con);
+		derr_con<<"Receive(): Peer not found"<<std::endl;
+		throw InvalidIncomingDataException("Peer not found (possible timeout)");
+	}
+
+	Peer *peer = node->second;
+
+	// Validate peer address
+	if(peer->address != sender)
+	{
+		PrintInfo(derr_con);
+		derr_con<<"Peer "<<peer_id<<" sending from different address."
+				" Ignoring."<<std::endl;
+		return;
+	}
+	
+	peer->timeout_counter = 0.0;
+	peer->stats.packets_received++;
+	peer->stats.bytes_received += received_size;
+	peer->m_rate_bytes_received += received_size;
+
+	Channel *channel = &(peer->channels[channelnum]);
+	
+	// Throw the received packet to channel->processPacket()
+
+	// Make a new SharedBuffer from the data without the base headers
+	SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
+	memcpy(*strippeddata, &packet.data[BASE_HEADER_SIZE],
+			strippeddata.getSize());
+	
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
+		
+		PrintInfo();
+		dout_con<<"ProcessPacket returned data of size "
+				<<resultdata.getSize()<<std::endl;
+		
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		putEvent(e);
+	}catch(ProcessedSilentlyException &e){
 	}
-	} // for
 }
 
 void Connection::runTimeouts(float dtime)
@@ -909,6 +1351,8 @@ void Connection::runTimeouts(float dtime)
 		peer->congestion_control_aim_rtt = congestion_control_aim_rtt;
 		peer->congestion_control_max_rate = congestion_control_max_rate;
 		peer->congestion_control_min_rate = congestion_control_min_rate;
+
+		peer->step(dtime);
 		
 		/*
 			Check peer timeout
@@ -964,20 +1408,7 @@ void Connection::runTimeouts(float dtime)
 			for(std::list<BufferedPacket>::iterator j = timed_outs.begin();
 				j != timed_outs.end(); ++j)
 			{
-				u16 peer_id = readPeerId(*(j->data));
-				u8 channel = readChannel(*(j->data));
-				u16 seqnum = readU16(&(j->data[BASE_HEADER_SIZE+1]));
-
-				PrintInfo(derr_con);
-				derr_con<<"RE-SENDING timed-out RELIABLE to ";
-				j->address.print(&derr_con);
-				derr_con<<"(t/o="<<resend_timeout<<"): "
-						<<"from_peer_id="<<peer_id
-						<<", channel="<<((int)channel&0xff)
-						<<", seqnum="<<seqnum
-						<<std::endl;
-
-				rawSend(*j);
+				resendReliable(peer, *j, false);
 
 				// Enlarge avg_rtt and resend_timeout:
 				// The rtt will be at least the timeout.
@@ -1132,6 +1563,13 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 	if(reliable)
 	{
 		u16 seqnum = channel->next_outgoing_seqnum;
+
+		// Wait for ACKs of the oldest packets if the buffer is full
+		if(!channel->outgoing_reliables.canInsert(seqnum)){
+			sendAsPacket(peer_id, channelnum, data, reliable);
+			return;
+		}
+
 		channel->next_outgoing_seqnum++;
 
 		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
@@ -1154,7 +1592,8 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		}
 		
 		// Send the packet
-		rawSend(p);
+		rawSendToPeer(peer, p);
+		peer->stats.reliables_sent++;
 	}
 	else
 	{
@@ -1163,17 +1602,85 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 				m_protocol_id, m_peer_id, channelnum);
 
 		// Send the packet
-		rawSend(p);
+		rawSendToPeer(peer, p);
 	}
 }
 
 void Connection::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
-	} catch(SendFailedException &e){
-		derr_con<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl;
+	m_send_batch.push_back(packet);
+}
+
+void Connection::flushSend()
+{
+	if(m_send_batch.empty())
+		return;
+	{
+		JMutexAutoLock lock(m_io_mutex);
+		m_to_send.splice(m_to_send.end(), m_send_batch);
+	}
+	m_to_send_event.signal();
+}
+
+void Connection::rawSendToPeer(Peer *peer, const BufferedPacket &packet)
+{
+	u32 size = packet.data.getSize();
+	peer->stats.packets_sent++;
+	peer->stats.bytes_sent += size;
+	peer->m_rate_bytes_sent += size;
+	rawSend(packet);
+}
+
+void Connection::resendReliable(Peer *peer, const BufferedPacket &packet,
+		bool fast)
+{
+	u16 peer_id = readPeerId(*(packet.data));
+	u8 channel = readChannel(*(packet.data));
+	u16 seqnum = readU16(&(packet.data[BASE_HEADER_SIZE+1]));
+
+	PrintInfo(derr_con);
+	derr_con<<"RE-SENDING "<<(fast ? "passed" : "timed-out")
+			<<" RELIABLE to ";
+	packet.address.print(&derr_con);
+	derr_con<<"(t/o="<<peer->resend_timeout
+			<<", cwnd="<<peer->cwnd<<"): "
+			<<"from_peer_id="<<peer_id
+			<<", channel="<<((int)channel&0xff)
+			<<", seqnum="<<seqnum
+			<<std::endl;
+
+	rawSendToPeer(peer, packet);
+
+	if(fast){
+		peer->stats.reliables_fast_resent++;
+		g_profiler->add("Connection: reliables fast re-sent", 1);
+	} else {
+		peer->stats.reliables_resent++;
+		g_profiler->add("Connection: reliables re-sent", 1);
+	}
+	peer->reportLoss();
+}
+
+void Connection::sendPendingAcks()
+{
+	for(std::map<u16, Peer*>::iterator j = m_peers.begin();
+		j != m_peers.end(); ++j)
+	{
+		Peer *peer = j->second;
+		for(u16 i=0; i<CHANNEL_COUNT; i++)
+		{
+			Channel *channel = &peer->channels[i];
+			for(std::list<u16>::iterator k = channel->acks_pending.begin();
+				k != channel->acks_pending.end(); ++k)
+			{
+				SharedBuffer<u8> reply(4);
+				writeU8(&reply[0], TYPE_CONTROL);
+				writeU8(&reply[1], CONTROLTYPE_ACK);
+				writeU16(&reply[2], *k);
+				rawSendAsPacket(peer->id, i, reply, false);
+			}
+			channel->acks_pending.clear();
+		}
 	}
 }
 
@@ -1325,6 +1832,18 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				Peer *peer = getPeer(peer_id);
 				peer->reportRTT(rtt);
 
+				// The time of a re-sent packet doesn't tell which copy
+				// got through, so it only grows the window
+				peer->reportAck(p.resend_count == 0 ? rtt : -1.0);
+
+				// Re-send the oldest packet if too many later ones got through
+				std::list<BufferedPacket> passed = channel->
+						outgoing_reliables.getPassedByAck(seqnum,
+						FAST_RESEND_LATER_ACKS);
+				for(std::list<BufferedPacket>::iterator i = passed.begin();
+					i != passed.end(); ++i)
+					resendReliable(peer, *i, true);
+
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
 
@@ -1453,19 +1972,28 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			dout_con<<"RECUR";
 		dout_con<<" TYPE_RELIABLE seqnum="<<seqnum
 				<<" next="<<channel->next_incoming_seqnum;
-		dout_con<<" [sending CONTROLTYPE_ACK"
+		dout_con<<" [queueing CONTROLTYPE_ACK"
 				" to peer_id="<<peer_id<<"]";
 		dout_con<<std::endl;
 		
 		//DEBUG
 		//assert(channel->incoming_reliables.size() < 100);
 
-		// Send a CONTROLTYPE_ACK
-		SharedBuffer<u8> reply(4);
-		writeU8(&reply[0], TYPE_CONTROL);
-		writeU8(&reply[1], CONTROLTYPE_ACK);
-		writeU16(&reply[2], seqnum);
-		rawSendAsPacket(peer_id, channelnum, reply, false);
+		// A packet that doesn't fit in the buffer is not ACKed; the
+		// sender will re-send it when there is room.
+		// A well-behaving sender doesn't send this far ahead.
+		if(is_future_packet && ((u16)(seqnum - channel->next_incoming_seqnum)
+				>= RELIABLE_BUFFER_SIZE ||
+				!channel->incoming_reliables.canInsert(seqnum)))
+			throw InvalidIncomingDataException
+					("Reliable packet too far ahead");
+
+		// Queue a CONTROLTYPE_ACK; duplicates received in the same
+		// round are ACKed once
+		if(std::find(channel->acks_pending.begin(),
+				channel->acks_pending.end(), seqnum)
+				== channel->acks_pending.end())
+			channel->acks_pending.push_back(seqnum);
 
 		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
 		if(is_future_packet)
@@ -1533,6 +2061,15 @@ bool Connection::deletePeer(u16 peer_id, bool timeout)
 	
 	Peer *peer = m_peers[peer_id];
 
+	infostream<<getDesc()<<": peer "<<peer_id<<" removed: "
+			<<"sent "<<peer->stats.bytes_sent<<" bytes in "
+			<<peer->stats.packets_sent<<" packets, received "
+			<<peer->stats.bytes_received<<" bytes in "
+			<<peer->stats.packets_received<<" packets, re-sent "
+			<<peer->stats.reliables_resent<<"+"
+			<<peer->stats.reliables_fast_resent<<" of "
+			<<peer->stats.reliables_sent<<" reliables"<<std::endl;
+
 	// Create event
 	ConnectionEvent e;
 	e.peerRemoved(peer_id, timeout, peer->address);
@@ -1569,6 +2106,7 @@ ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 void Connection::putCommand(ConnectionCommand &c)
 {
 	m_command_queue.push_back(c);
+	m_wakeup.signal();
 }
 
 void Connection::Serve(unsigned short port)
@@ -1677,6 +2215,12 @@ float Connection::GetPeerAvgRTT(u16 peer_id)
 	return getPeer(peer_id)->avg_rtt;
 }
 
+PeerStats Connection::GetPeerStats(u16 peer_id)
+{
+	JMutexAutoLock peerlock(m_peers_mutex);
+	return getPeer(peer_id)->stats;
+}
+
 void Connection::DeletePeer(u16 peer_id)
 {
 	ConnectionCommand c;
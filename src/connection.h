@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
 
 namespace con
 {
@@ -116,26 +117,47 @@ inline bool seqnum_higher(u16 higher, u16 lower)
 	if(lower > higher && lower - higher > SEQNUM_MAX/2){
 		return true;
 	}
+	// Wrapped around the other way
+	if(higher > lower && higher - lower > SEQNUM_MAX/2){
+		return false;
+	}
 	return (higher > lower);
 }
 
 struct BufferedPacket
 {
+	BufferedPacket():
+		time(0.0), totaltime(0.0), resend_count(0), later_acks(0),
+		fast_resent(false)
+	{}
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0)
+		data(a_data, a_size), time(0.0), totaltime(0.0), resend_count(0),
+		later_acks(0), fast_resent(false)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0)
+		data(a_size), time(0.0), totaltime(0.0), resend_count(0),
+		later_acks(0), fast_resent(false)
+	{}
+	// Shares the data
+	BufferedPacket(SharedBuffer<u8> a_data):
+		data(a_data), time(0.0), totaltime(0.0), resend_count(0),
+		later_acks(0), fast_resent(false)
 	{}
 	SharedBuffer<u8> data; // Data of the packet, including headers
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
+	u16 resend_count; // Number of times the packet has been re-sent
+	u16 later_acks; // ACKs of later packets since sending or re-sending
+	// Re-sent because of later ACKs; not done again until it times out
+	bool fast_resent;
 	Address address; // Sender or destination
 };
 
 // This adds the base headers to the data and makes a packet out of it
 BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
+// Puts the headers in the headroom of data if it has some, see
+// PacketBuilder
 BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
 
@@ -161,14 +183,19 @@ SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
 		u16 seqnum);
 
+// Split packets with more chunks than this are dropped. Nothing sent is
+// this big; the chunk count comes from the network and isn't trusted.
+#define MAX_SPLIT_CHUNK_COUNT 16384
+
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
-	{
-		time = 0.0;
-		reliable = false;
-	}
-	// Key is chunk number, value is data without headers
+	IncomingSplitPacket(u16 a_chunk_count, bool a_reliable):
+		chunk_count(a_chunk_count),
+		time(0.0),
+		reliable(a_reliable)
+	{}
+	// Key is chunk number, value is data without headers. Only the
+	// chunks that have arrived take memory.
 	std::map<u16, SharedBuffer<u8> > chunks;
 	u32 chunk_count;
 	float time; // Seconds from adding
@@ -266,33 +293,122 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	Room reserved in front of outgoing data for the headers that are
+	added on the way to the socket: base, reliable and original headers.
+	A split packet chunk has its own split header instead of the
+	original header.
 */
+#define PACKET_HEADROOM (BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE \
+		+ ORIGINAL_HEADER_SIZE)
+// Unused bytes at the end of a built packet that are not worth a copy
+#define PACKET_BUILDER_MAX_UNUSED 256
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+/*
+	An output stream for building outgoing data.
+
+	The data is written into a buffer with PACKET_HEADROOM in front of
+	it, so the headers are written in place and the buffer is passed as
+	it is all the way down to the socket. Data sent with a plain
+	SharedBuffer is copied once, when the first header is added.
+*/
+class PacketBuilder : public std::ostream
+{
+public:
+	PacketBuilder(u32 size_hint = 256);
+	// The data written so far
+	SharedBuffer<u8> getBuffer();
+
+private:
+	class Buf : public std::streambuf
+	{
+	public:
+		Buf(u32 size_hint);
+		SharedBuffer<u8> getBuffer();
+	protected:
+		int_type overflow(int_type c);
+		std::streamsize xsputn(const char *s, std::streamsize n);
+	private:
+		void grow(u32 min_size);
+		SharedBuffer<u8> m_buffer;
+	};
+	Buf m_buf;
+};
+
+/*
+	Congestion control
+
+	Reliable packets in flight to a peer are limited by a congestion
+	window. It grows by one packet per ACK until it reaches the slow
+	start threshold and by about one packet per round trip after that.
+	A lost packet halves it, at most once per round trip.
+
+	ACKs carry a single seqnum, so every ACK selectively acknowledges
+	one packet. The oldest packet in flight, which holds up delivery at
+	the receiving end, is considered lost when FAST_RESEND_LATER_ACKS
+	packets sent after it have been ACKed, and is re-sent without
+	waiting for the resend timeout.
+*/
+#define CONGESTION_WINDOW_INITIAL 8.0
+#define CONGESTION_WINDOW_MIN 2.0
+#define CONGESTION_WINDOW_MAX 512.0
+#define FAST_RESEND_LATER_ACKS 3
+
+/*
+	A buffer which stores reliable packets by seqnum.
+
+	The packets are kept in a ring of RELIABLE_BUFFER_SIZE slots indexed
+	by seqnum modulo the ring size, so finding, inserting and removing a
+	packet doesn't depend on how many packets there are. The seqnums in
+	the buffer have to stay within RELIABLE_BUFFER_SIZE of each other;
+	see canInsert().
+
+	The size must divide 65536 for the index to survive seqnum
+	wraparound, and it must be larger than CONGESTION_WINDOW_MAX.
+*/
+#define RELIABLE_BUFFER_SIZE 1024
 
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
+	// Returns NULL if the packet is not in the buffer
+	BufferedPacket* findPacket(u16 seqnum);
 	u16 getFirstSeqnum();
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
+	// Whether a packet with seqnum fits in the ring
+	bool canInsert(u16 seqnum);
 	void insert(BufferedPacket &p);
 	void incrementTimeouts(float dtime);
 	void resetTimedOuts(float timeout);
 	bool anyTotaltimeReached(float timeout);
 	std::list<BufferedPacket> getTimedOuts(float timeout);
+	/*
+		Counts an ACK of seqnum against the oldest packet if it is
+		older, and returns it once it has been passed by later_acks
+		ACKs. Its timer is reset, as it is going to be re-sent. This
+		is done once per packet; the ACKs of packets sent before the
+		re-send keep coming for a round trip, so only a timeout makes
+		it count them again.
+	*/
+	std::list<BufferedPacket> getPassedByAck(u16 seqnum, u16 later_acks);
 
 private:
-	std::list<BufferedPacket> m_list;
-	u16 m_list_size;
+	u32 getIndex(u16 seqnum)
+	{
+		return seqnum & (RELIABLE_BUFFER_SIZE - 1);
+	}
+	BufferedPacket* remove(u16 seqnum);
+
+	std::vector<BufferedPacket*> m_slots;
+	u32 m_count;
+	// Smallest and largest seqnum in the buffer if it isn't empty
+	u16 m_oldest;
+	u16 m_newest;
 };
 
 /*
@@ -335,6 +451,10 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	// Seqnums of received reliable packets that haven't been ACKed yet.
+	// They are sent out once per receive round.
+	std::list<u16> acks_pending;
 };
 
 class Peer;
@@ -361,6 +481,38 @@ class PeerHandler
 	virtual void deletingPeer(Peer *peer, bool timeout) = 0;
 };
 
+struct PeerStats
+{
+	PeerStats():
+		packets_sent(0),
+		packets_received(0),
+		bytes_sent(0),
+		bytes_received(0),
+		reliables_sent(0),
+		reliables_resent(0),
+		reliables_fast_resent(0),
+		send_rate(0),
+		receive_rate(0),
+		congestion_window(0),
+		avg_rtt(-1.0)
+	{}
+
+	u32 packets_sent;
+	u32 packets_received;
+	u32 bytes_sent;
+	u32 bytes_received;
+	u32 reliables_sent;
+	// Re-sent because of the resend timeout
+	u32 reliables_resent;
+	// Re-sent because later packets were ACKed
+	u32 reliables_fast_resent;
+	// Bytes per second, over the last second
+	float send_rate;
+	float receive_rate;
+	float congestion_window;
+	float avg_rtt;
+};
+
 class Peer
 {
 public:
@@ -374,6 +526,15 @@ class Peer
 		rtt=-1 only recalculates resend_timeout
 	*/
 	void reportRTT(float rtt);
+	// Grows the congestion window on an ACK of a packet that wasn't
+	// re-sent; rtt is its round trip time
+	void reportAck(float rtt);
+	// Shrinks the congestion window
+	void reportLoss();
+	// Updates the window limits, the send rate and the stats
+	void step(float dtime);
+	// Number of reliable packets waiting for an ACK on all channels
+	u32 getReliablesInFlight();
 
 	Channel channels[CHANNEL_COUNT];
 
@@ -402,6 +563,20 @@ class Peer
 	float congestion_control_aim_rtt;
 	float congestion_control_max_rate;
 	float congestion_control_min_rate;
+
+	// Congestion window in reliable packets and slow start threshold
+	float cwnd;
+	float ssthresh;
+	// Smallest round trip time seen; rtt above it is queueing delay
+	float min_rtt;
+	// Seconds from last shrinking of the window
+	float loss_timer;
+
+	PeerStats stats;
+	// Bytes counted into stats since the rates were last updated
+	u32 m_rate_bytes_sent;
+	u32 m_rate_bytes_received;
+	float m_rate_timer;
 private:
 };
 
@@ -545,6 +720,51 @@ struct ConnectionCommand
 	}
 };
 
+/*
+	The socket I/O of a Connection runs in threads of its own, so that
+	the protocol work in Connection::Thread() doesn't wait for system
+	calls. Datagrams are received and sent in batches.
+*/
+
+// Datagrams per batch of socket I/O
+#define CONNECTION_IO_BATCH 64
+// How long Connection::Thread() waits for something to do
+#define CONNECTION_STEP_MAX_MS 5
+// Maximum number of received datagrams waiting to be processed. More are
+// dropped, so that a flood doesn't eat up memory; peers resend what is
+// reliable.
+#define CONNECTION_RECEIVE_QUEUE_MAX 4096
+
+class ConnectionReceiveThread : public SimpleThread
+{
+	Connection *m_connection;
+
+public:
+
+	ConnectionReceiveThread(Connection *connection):
+		SimpleThread(),
+		m_connection(connection)
+	{
+	}
+
+	void * Thread();
+};
+
+class ConnectionSendThread : public SimpleThread
+{
+	Connection *m_connection;
+
+public:
+
+	ConnectionSendThread(Connection *connection):
+		SimpleThread(),
+		m_connection(connection)
+	{
+	}
+
+	void * Thread();
+};
+
 class Connection: public SimpleThread
 {
 public:
@@ -572,6 +792,7 @@ class Connection: public SimpleThread
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
+	PeerStats GetPeerStats(u16 peer_id);
 	void DeletePeer(u16 peer_id);
 	
 private:
@@ -579,6 +800,10 @@ class Connection: public SimpleThread
 	void processCommand(ConnectionCommand &c);
 	void send(float dtime);
 	void receive();
+	// Processes a datagram from m_received
+	void processReceived(BufferedPacket &packet);
+	// Passes reliable packets that have become deliverable to the user
+	void deliverBuffered();
 	void runTimeouts(float dtime);
 	void serve(u16 port);
 	void connect(Address address);
@@ -589,7 +814,17 @@ class Connection: public SimpleThread
 			SharedBuffer<u8> data, bool reliable);
 	void rawSendAsPacket(u16 peer_id, u8 channelnum,
 			SharedBuffer<u8> data, bool reliable);
+	// Queues the packet to m_send_thread
 	void rawSend(const BufferedPacket &packet);
+	// Passes the packets queued by rawSend() to m_send_thread
+	void flushSend();
+	// Counts the packet into the stats of the peer and sends it
+	void rawSendToPeer(Peer *peer, const BufferedPacket &packet);
+	// Re-sends a reliable packet that is presumed lost
+	void resendReliable(Peer *peer, const BufferedPacket &packet,
+			bool fast);
+	// Sends the ACKs collected during a receive round
+	void sendPendingAcks();
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	std::list<Peer*> getPeers();
@@ -635,6 +870,28 @@ class Connection: public SimpleThread
 	void PrintInfo();
 	std::string getDesc();
 	u16 m_indentation;
+
+	// Packets from rawSend(), passed to m_send_thread once per step
+	std::list<BufferedPacket> m_send_batch;
+
+	/*
+		Datagrams from m_receive_thread and to m_send_thread; both
+		queues are protected by m_io_mutex
+	*/
+	JMutex m_io_mutex;
+	std::list<BufferedPacket> m_received;
+	u32 m_received_count;
+	std::list<BufferedPacket> m_to_send;
+	// Signaled when there is something in m_received or a command
+	Event m_wakeup;
+	// Signaled when there is something in m_to_send
+	Event m_to_send_event;
+
+	ConnectionReceiveThread m_receive_thread;
+	ConnectionSendThread m_send_thread;
+
+	friend class ConnectionReceiveThread;
+	friend class ConnectionSendThread;
 };
 
 } // namespace
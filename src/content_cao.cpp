@@ -575,6 +575,10 @@ class GenericCAO : public ClientActiveObject
 	float m_yaw;
 	s16 m_hp;
 	SmoothTranslator pos_translator;
+	// Position deltas from the server are made against this
+	bool m_has_position_baseline;
+	u8 m_position_baseline_id;
+	ObjectPosition m_position_baseline;
 	// Spritesheet/animation stuff
 	v2f m_tx_size;
 	v2s16 m_tx_basepos;
@@ -619,6 +623,8 @@ class GenericCAO : public ClientActiveObject
 		m_acceleration(v3f(0,0,0)),
 		m_yaw(0),
 		m_hp(1),
+		m_has_position_baseline(false),
+		m_position_baseline_id(0),
 		m_tx_size(1,1),
 		m_tx_basepos(0,0),
 		m_initial_tx_basepos_set(false),
@@ -1611,6 +1617,34 @@ class GenericCAO : public ClientActiveObject
 		}
 	}
 
+	void updatePosition(const ObjectPosition &p)
+	{
+		// Not sent by the server if this object is an attachment.
+		// We might however get here if the server notices the object being detached before the client.
+		m_position = p.position;
+		m_velocity = p.velocity;
+		m_acceleration = p.acceleration;
+		if(fabs(m_prop.automatic_rotate) < 0.001)
+			m_yaw = p.yaw;
+
+		// Place us a bit higher if we're physical, to not sink into
+		// the ground due to sucky collision detection...
+		if(m_prop.physical)
+			m_position += v3f(0,0.002,0);
+
+		if(getParent() != NULL) // Just in case
+			return;
+
+		if(p.do_interpolate){
+			if(!m_prop.physical)
+				pos_translator.update(m_position, p.is_movement_end,
+						p.update_interval);
+		} else {
+			pos_translator.init(m_position);
+		}
+		updateNodePos();
+	}
+
 	void processMessage(const std::string &data)
 	{
 		//infostream<<"GenericCAO: Got message"<<std::endl;
@@ -1637,32 +1671,25 @@ class GenericCAO : public ClientActiveObject
 		}
 		else if(cmd == GENERIC_CMD_UPDATE_POSITION)
 		{
-			// Not sent by the server if this object is an attachment.
-			// We might however get here if the server notices the object being detached before the client.
-			m_position = readV3F1000(is);
-			m_velocity = readV3F1000(is);
-			m_acceleration = readV3F1000(is);
-			if(fabs(m_prop.automatic_rotate) < 0.001)
-				m_yaw = readF1000(is);
-			bool do_interpolate = readU8(is);
-			bool is_end_position = readU8(is);
-			float update_interval = readF1000(is);
-
-			// Place us a bit higher if we're physical, to not sink into
-			// the ground due to sucky collision detection...
-			if(m_prop.physical)
-				m_position += v3f(0,0.002,0);
-
-			if(getParent() != NULL) // Just in case
+			updatePosition(gob_read_update_position(is));
+		}
+		else if(cmd == GENERIC_CMD_UPDATE_POSITION_BASELINE)
+		{
+			m_position_baseline_id = readU8(is);
+			m_position_baseline = gob_read_update_position(is);
+			m_has_position_baseline = true;
+			updatePosition(m_position_baseline);
+		}
+		else if(cmd == GENERIC_CMD_UPDATE_POSITION_DELTA)
+		{
+			// Deltas are unreliable and can arrive before the baseline
+			// they refer to; such ones are dropped.
+			u8 baseline_id = readU8(is);
+			if(!m_has_position_baseline ||
+					baseline_id != m_position_baseline_id)
 				return;
-
-			if(do_interpolate){
-				if(!m_prop.physical)
-					pos_translator.update(m_position, is_end_position, update_interval);
-			} else {
-				pos_translator.init(m_position);
-			}
-			updateNodePos();
+			updatePosition(gob_read_update_position_delta(is,
+					m_position_baseline));
 		}
 		else if(cmd == GENERIC_CMD_SET_TEXTURE_MOD)
 		{
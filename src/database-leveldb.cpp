@@ -0,0 +1,150 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#if USE_LEVELDB
+
+#include "database-leveldb.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+#include <iostream>
+
+Database_LevelDB::Database_LevelDB(const std::string &savedir):
+	m_database(NULL),
+	m_batch_started(false)
+{
+	fs::CreateAllDirs(savedir);
+
+	leveldb::Options options;
+	options.create_if_missing = true;
+	leveldb::Status status = leveldb::DB::Open(options,
+			savedir + DIR_DELIM + "map.db", &m_database);
+	if(!status.ok())
+	{
+		errorstream<<"Database_LevelDB: Failed to open map.db: "
+				<<status.ToString()<<std::endl;
+		throw FileNotGoodException("Cannot open database file");
+	}
+	infostream<<"Database_LevelDB: Database opened"<<std::endl;
+}
+
+Database_LevelDB::~Database_LevelDB()
+{
+	if(m_batch_started)
+		endSave();
+	delete m_database;
+}
+
+bool Database_LevelDB::beginSave()
+{
+	m_batch.Clear();
+	m_batch_started = true;
+	return true;
+}
+
+bool Database_LevelDB::endSave()
+{
+	m_batch_started = false;
+	leveldb::Status status = m_database->Write(leveldb::WriteOptions(), &m_batch);
+	m_batch.Clear();
+	if(!status.ok())
+	{
+		errorstream<<"Database_LevelDB: Batch write failed, map might not "
+				<<"have saved: "<<status.ToString()<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Database_LevelDB::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	std::string key = getBlockKey(blockpos);
+	if(m_batch_started)
+	{
+		m_batch.Put(key, data);
+		return true;
+	}
+
+	leveldb::Status status = m_database->Put(leveldb::WriteOptions(), key, data);
+	if(!status.ok())
+	{
+		errorstream<<"WARNING: Block failed to save ("<<blockpos.X<<", "
+				<<blockpos.Y<<", "<<blockpos.Z<<") "
+				<<status.ToString()<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Database_LevelDB::loadBlock(v3s16 blockpos, std::string *data)
+{
+	leveldb::Status status = m_database->Get(leveldb::ReadOptions(),
+			getBlockKey(blockpos), data);
+	if(status.IsNotFound())
+		return false;
+	if(!status.ok())
+	{
+		errorstream<<"Database_LevelDB: Failed to read block ("
+				<<blockpos.X<<", "<<blockpos.Y<<", "<<blockpos.Z<<") "
+				<<status.ToString()<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+void Database_LevelDB::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	leveldb::Iterator *it = m_database->NewIterator(leveldb::ReadOptions());
+	for(it->SeekToFirst(); it->Valid(); it->Next())
+		dst.push_back(getKeyBlock(it->key()));
+	delete it;
+}
+
+bool Database_LevelDB::exists()
+{
+	// Created when opened
+	return true;
+}
+
+void Database_LevelDB::compact()
+{
+	m_database->CompactRange(NULL, NULL);
+}
+
+std::string Database_LevelDB::getBlockKey(v3s16 blockpos)
+{
+	u64 i = (u64)getBlockAsInteger(blockpos) ^ ((u64)1 << 63);
+	char key[8];
+	for(u32 k = 0; k < 8; k++)
+		key[k] = (char)(i >> (56 - k * 8));
+	return std::string(key, 8);
+}
+
+v3s16 Database_LevelDB::getKeyBlock(const leveldb::Slice &key)
+{
+	u64 i = 0;
+	for(u32 k = 0; k < 8 && k < key.size(); k++)
+		i = (i << 8) | (u8)key[k];
+	return getIntegerAsBlock((s64)(i ^ ((u64)1 << 63)));
+}
+
+#endif // USE_LEVELDB
+
@@ -0,0 +1,66 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DATABASE_LEVELDB_HEADER
+#define DATABASE_LEVELDB_HEADER
+
+#include "config.h"
+
+#if USE_LEVELDB
+
+#include "database.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+/*
+	Stores blocks in the LevelDB database map.db in the world directory.
+
+	Keys are the block positions as big-endian integers with the sign
+	bit flipped (see getBlockKey()), so the key order is the order of
+	getBlockAsInteger() and blocks of a Z,Y row are adjacent on disk.
+	Saves between beginSave() and endSave() are written as one batch.
+*/
+class Database_LevelDB : public MapDatabase
+{
+public:
+	Database_LevelDB(const std::string &savedir);
+	~Database_LevelDB();
+
+	bool beginSave();
+	bool endSave();
+
+	bool saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string *data);
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	bool exists();
+	void compact();
+
+	static std::string getBlockKey(v3s16 blockpos);
+	static v3s16 getKeyBlock(const leveldb::Slice &key);
+
+private:
+	leveldb::DB *m_database;
+	leveldb::WriteBatch m_batch;
+	bool m_batch_started;
+};
+
+#endif // USE_LEVELDB
+
+#endif
+
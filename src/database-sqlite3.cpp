@@ -0,0 +1,218 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "database-sqlite3.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "debug.h"
+#include "log.h"
+
+Database_SQLite3::Database_SQLite3(const std::string &savedir):
+	m_savedir(savedir),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_write(NULL),
+	m_database_list(NULL)
+{
+}
+
+Database_SQLite3::~Database_SQLite3()
+{
+	/*
+		Close database if it was opened
+	*/
+	if(m_database_read)
+		sqlite3_finalize(m_database_read);
+	if(m_database_write)
+		sqlite3_finalize(m_database_write);
+	if(m_database_list)
+		sqlite3_finalize(m_database_list);
+	if(m_database)
+		sqlite3_close(m_database);
+}
+
+bool Database_SQLite3::beginSave()
+{
+	verifyDatabase();
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		errorstream<<"Database_SQLite3: beginSave() failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Database_SQLite3::endSave()
+{
+	verifyDatabase();
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		errorstream<<"Database_SQLite3: endSave() failed, map might not "
+				<<"have saved: "<<sqlite3_errmsg(m_database)<<std::endl;
+		// Don't leave the transaction open for the next batch
+		sqlite3_exec(m_database, "ROLLBACK;", NULL, NULL, NULL);
+		return false;
+	}
+	return true;
+}
+
+bool Database_SQLite3::exists()
+{
+	return m_database || fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite");
+}
+
+void Database_SQLite3::compact()
+{
+	verifyDatabase();
+	if(sqlite3_exec(m_database, "VACUUM;", NULL, NULL, NULL) != SQLITE_OK)
+		errorstream<<"Database_SQLite3: VACUUM failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+}
+
+void Database_SQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	verifyDatabase();
+
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		v3s16 p = getIntegerAsBlock(block_i);
+		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
+		dst.push_back(p);
+	}
+	sqlite3_reset(m_database_list);
+}
+
+void Database_SQLite3::createDatabase()
+{
+	int e;
+	assert(m_database);
+	e = sqlite3_exec(m_database,
+		"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+		");"
+	, NULL, NULL, NULL);
+	if(e == SQLITE_ABORT)
+		throw FileNotGoodException("Could not create database structure");
+	else
+		infostream<<"Database_SQLite3: Database structure was created";
+}
+
+void Database_SQLite3::verifyDatabase()
+{
+	if(m_database)
+		return;
+
+	std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
+	bool needs_create = false;
+	int d;
+
+	/*
+		Open the database connection
+	*/
+
+	fs::CreateAllDirs(m_savedir);
+
+	if(!fs::PathExists(dbp))
+		needs_create = true;
+
+	d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot open database file");
+	}
+
+	if(needs_create)
+		createDatabase();
+
+	d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+
+	d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare write statement");
+	}
+
+	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+
+	infostream<<"Database_SQLite3: Database opened"<<std::endl;
+}
+
+bool Database_SQLite3::loadBlock(v3s16 blockpos, std::string *data)
+{
+	// Don't create the database just to find it empty
+	if(!exists())
+		return false;
+
+	verifyDatabase();
+
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW)
+	{
+		const char *blob = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		data->assign(blob, len);
+		found = true;
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+
+	return found;
+}
+
+bool Database_SQLite3::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	verifyDatabase();
+
+	bool success = true;
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(blockpos)) != SQLITE_OK) {
+		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK) {
+		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	int written = sqlite3_step(m_database_write);
+	if(written != SQLITE_DONE) {
+		errorstream<<"WARNING: Block failed to save ("<<blockpos.X<<", "
+				<<blockpos.Y<<", "<<blockpos.Z<<") "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	// Make ready for later reuse
+	sqlite3_reset(m_database_write);
+
+	return success;
+}
+
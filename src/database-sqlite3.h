@@ -0,0 +1,71 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DATABASE_SQLITE3_HEADER
+#define DATABASE_SQLITE3_HEADER
+
+#include "database.h"
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+/*
+	Stores blocks in map.sqlite in the world directory.
+
+	Structure of map.sqlite:
+	Tables:
+		blocks
+			(PK) INT pos
+			BLOB data
+
+	The database is opened on first use and only created when
+	something is saved.
+*/
+class Database_SQLite3 : public MapDatabase
+{
+public:
+	Database_SQLite3(const std::string &savedir);
+	~Database_SQLite3();
+
+	bool beginSave();
+	bool endSave();
+
+	bool saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string *data);
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	bool exists();
+	void compact();
+
+private:
+	// Create the database structure
+	void createDatabase();
+	// Open the database if it isn't open yet
+	void verifyDatabase();
+
+	std::string m_savedir;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+};
+
+#endif
+
@@ -0,0 +1,73 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "database.h"
+#include "database-sqlite3.h"
+#include "database-leveldb.h"
+#include "exceptions.h"
+#include "log.h"
+#include "config.h"
+#include <iostream>
+
+MapDatabase *createMapDatabase(const std::string &backend,
+		const std::string &savedir)
+{
+	if(backend == "sqlite3")
+		return new Database_SQLite3(savedir);
+#if USE_LEVELDB
+	if(backend == "leveldb")
+		return new Database_LevelDB(savedir);
+#endif
+	errorstream<<"Map database backend \""<<backend<<"\" is not "
+			<<"supported by this build"<<std::endl;
+	throw NotImplementedException("Unsupported map database backend");
+}
+
+s64 MapDatabase::getBlockAsInteger(const v3s16 pos)
+{
+	return (s64)pos.Z*16777216 +
+		(s64)pos.Y*4096 + (s64)pos.X;
+}
+
+static s32 unsignedToSigned(s32 i, s32 max_positive)
+{
+	if(i < max_positive)
+		return i;
+	else
+		return i - 2*max_positive;
+}
+
+// modulo of a negative number does not work consistently in C
+static s64 pythonmodulo(s64 i, s64 mod)
+{
+	if(i >= 0)
+		return i % mod;
+	return mod - ((-i) % mod);
+}
+
+v3s16 MapDatabase::getIntegerAsBlock(s64 i)
+{
+	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - x) / 4096;
+	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - y) / 4096;
+	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	return v3s16(x,y,z);
+}
+
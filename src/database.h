@@ -0,0 +1,73 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DATABASE_HEADER
+#define DATABASE_HEADER
+
+#include <string>
+#include <list>
+#include "irr_v3d.h"
+#include "irrlichttypes.h"
+
+/*
+	Storage of serialized MapBlocks.
+
+	Implementations need not be thread-safe; MapDatabaseThread
+	serializes all access to them.
+*/
+class MapDatabase
+{
+public:
+	virtual ~MapDatabase() {}
+
+	// Call these before and after saving a batch of blocks. They return
+	// false on failure; if endSave() fails, none of the blocks saved
+	// since beginSave() can be counted on to be in the database.
+	virtual bool beginSave() = 0;
+	virtual bool endSave() = 0;
+
+	// Returns false on failure. Within a batch, a block that fails
+	// later in endSave() may still have returned true.
+	virtual bool saveBlock(v3s16 blockpos, const std::string &data) = 0;
+	// Returns false if the block is not in the database
+	virtual bool loadBlock(v3s16 blockpos, std::string *data) = 0;
+	virtual void listAllLoadableBlocks(std::list<v3s16> &dst) = 0;
+
+	// Returns true if the database has been created on disk. If it
+	// hasn't, the map may still be stored in the legacy sector folders.
+	virtual bool exists() = 0;
+
+	// Reclaim unused space. May take very long; only done offline.
+	virtual void compact() {}
+
+	// Get an integer suitable for a block
+	static s64 getBlockAsInteger(const v3s16 pos);
+	static v3s16 getIntegerAsBlock(s64 i);
+};
+
+/*
+	Create the database of a world by the backend named in its world.mt
+	("sqlite3" or "leveldb"). Throws NotImplementedException if the
+	backend is unknown or not compiled in.
+*/
+MapDatabase *createMapDatabase(const std::string &backend,
+		const std::string &savedir);
+
+#endif
+
@@ -94,6 +94,8 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("new_style_water", "false");
 	settings->setDefault("new_style_leaves", "true");
 	settings->setDefault("smooth_lighting", "true");
+	settings->setDefault("mesh_generation_threads", "");
+	settings->setDefault("greedy_meshing", "true");
 	settings->setDefault("enable_texture_atlas", "false");
 	settings->setDefault("texture_path", "");
 	settings->setDefault("shader_path", "");
@@ -168,6 +170,8 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("profiler_print_interval", "0");
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
+	settings->setDefault("active_object_update_full_range", "16");
+	settings->setDefault("active_object_update_far_interval", "1.0");
 	settings->setDefault("active_block_range", "2");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
@@ -191,7 +195,10 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_total", "256");
 	settings->setDefault("emergequeue_limit_diskonly", "");
 	settings->setDefault("emergequeue_limit_generate", "");
-	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("num_emerge_threads", "");
+	settings->setDefault("num_async_lua_threads", "");
+	settings->setDefault("num_abm_threads", "");
+	settings->setDefault("abm_time_budget", "0.05");
 	
 	// physics stuff
 	settings->setDefault("movement_acceleration_default", "3");
@@ -59,8 +59,9 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 	
 	mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
-	queuemutex.Init();
-	
+	queuecountmutex.Init();
+	queue_count_total = 0;
+
 	int nthreads;
 	if (g_settings->get("num_emerge_threads").empty()) {
 		int nprocs = porting::getNumberOfProcessors();
@@ -134,60 +135,121 @@ void EmergeManager::initMapgens(MapgenParams *mgparams) {
 }
 
 
-bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate) {
+bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate,
+										float priority) {
 	std::map<v3s16, BlockEmergeData *>::const_iterator iter;
 	BlockEmergeData *bedata;
 	u16 count;
 	u8 flags = 0;
-	int idx = 0;
+	u32 time_now = porting::getTimeMs();
 	
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
 
+	u16 qlimit_peer = allow_generate ? qlimit_generate : qlimit_diskonly;
+
+	EmergeThread *thread = getOptimalThread(p);
 	{
-		JMutexAutoLock queuelock(queuemutex);
-		
-		count = blocks_enqueued.size();
-		if (count >= qlimit_total)
-			return false;
-
-		count = peer_queue_count[peer_id];
-		u16 qlimit_peer = allow_generate ? qlimit_generate : qlimit_diskonly;
-		if (count >= qlimit_peer)
-			return false;
+		JMutexAutoLock queuelock(thread->queuemutex);
 		
-		iter = blocks_enqueued.find(p);
-		if (iter != blocks_enqueued.end()) {
+		/*
+			Already queued blocks are re-prioritized. The requesting
+			peer has moved since, so its latest priority is the one
+			that counts; requests of others can only raise it.
+		*/
+		iter = thread->blocks_enqueued.find(p);
+		if (iter != thread->blocks_enqueued.end()) {
 			bedata = iter->second;
 			bedata->flags |= flags;
+			bedata->time_requested = time_now;
+			if (bedata->peer_requested == peer_id ||
+					priority < bedata->priority) {
+				thread->blockqueue.erase(std::make_pair(bedata->priority, p));
+				thread->blockqueue.insert(std::make_pair(priority, p));
+				bedata->priority = priority;
+			}
 			return true;
 		}
 
+		{
+			JMutexAutoLock countlock(queuecountmutex);
+			if (queue_count_total >= qlimit_total)
+				return false;
+
+			count = peer_queue_count[peer_id];
+			if (count >= qlimit_peer)
+				return false;
+
+			queue_count_total++;
+			peer_queue_count[peer_id] = count + 1;
+		}
+
 		bedata = new BlockEmergeData;
 		bedata->flags = flags;
 		bedata->peer_requested = peer_id;
-		blocks_enqueued.insert(std::make_pair(p, bedata));
-		
-		peer_queue_count[peer_id] = count + 1;
+		bedata->priority = priority;
+		bedata->time_requested = time_now;
+		thread->blocks_enqueued.insert(std::make_pair(p, bedata));
 		
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
-			}
-		}
-		
-		emergethread[idx]->blockqueue.push(p);
+		thread->blockqueue.insert(std::make_pair(priority, p));
 	}
-	emergethread[idx]->qevent.signal();
+	thread->qevent.signal();
 	
 	return true;
 }
 
 
+void EmergeManager::cancelPeerEmerges(u16 peer_id) {
+	for (unsigned int i = 0; i != emergethread.size(); i++) {
+		EmergeThread *thread = emergethread[i];
+		JMutexAutoLock queuelock(thread->queuemutex);
+		u16 count = 0;
+
+		std::map<v3s16, BlockEmergeData *>::iterator iter;
+		for (iter = thread->blocks_enqueued.begin();
+				iter != thread->blocks_enqueued.end();) {
+			BlockEmergeData *bedata = iter->second;
+			if (bedata->peer_requested != peer_id) {
+				++iter;
+				continue;
+			}
+			thread->blockqueue.erase(std::make_pair(bedata->priority, iter->first));
+			delete bedata;
+			thread->blocks_enqueued.erase(iter++);
+			count++;
+		}
+
+		JMutexAutoLock countlock(queuecountmutex);
+		queue_count_total -= count;
+		peer_queue_count[peer_id] -= count;
+		if (peer_queue_count[peer_id] == 0)
+			peer_queue_count.erase(peer_id);
+	}
+}
+
+
+EmergeThread *EmergeManager::getOptimalThread(v3s16 blockpos) {
+	if (emergethread.size() == 1 || !params)
+		return emergethread[0];
+
+	/*
+		Pick the thread by the mapgen chunk containing the block, the
+		same way ServerMap::initBlockMake() does. This way a chunk is
+		never generated by two threads at the same time, and a block
+		is never queued on two threads.
+	*/
+	s16 chunksize = params->chunksize;
+	s16 coffset = -chunksize / 2;
+	v3s16 chunk_offset(coffset, coffset, coffset);
+	v3s16 chunkpos = getContainerPos(blockpos - chunk_offset, chunksize);
+
+	u32 hash = (u32)chunkpos.X * 73856093 ^
+			(u32)chunkpos.Y * 19349663 ^
+			(u32)chunkpos.Z * 83492791;
+	return emergethread[hash % emergethread.size()];
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 	if (mapgen.size() == 0 || !mapgen[0]) {
 		errorstream << "EmergeManager: getGroundLevelAtPoint() called"
@@ -289,30 +351,54 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 
 ////////////////////////////// Emerge Thread ////////////////////////////////// 
 
+EmergeThread::~EmergeThread() {
+	for (std::map<v3s16, BlockEmergeData *>::iterator
+			i = blocks_enqueued.begin();
+			i != blocks_enqueued.end(); ++i)
+		delete i->second;
+	blocks_enqueued.clear();
+}
+
+
 bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
 	std::map<v3s16, BlockEmergeData *>::iterator iter;
-	JMutexAutoLock queuelock(emerge->queuemutex);
+	JMutexAutoLock queuelock(queuemutex);
 
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-	
-	*pos = p;
-	
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end()) 
-		return false; //uh oh, queue and map out of sync!!
+	u32 time_now = porting::getTimeMs();
 
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-	
-	emerge->peer_queue_count[bedata->peer_requested]--;
+	while (!blockqueue.empty()) {
+		v3s16 p = blockqueue.begin()->second;
+		blockqueue.erase(blockqueue.begin());
 
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-	
-	return true;
+		iter = blocks_enqueued.find(p);
+		if (iter == blocks_enqueued.end())
+			continue; //uh oh, queue and map out of sync!!
+
+		BlockEmergeData *bedata = iter->second;
+		{
+			JMutexAutoLock countlock(emerge->queuecountmutex);
+			emerge->queue_count_total--;
+			emerge->peer_queue_count[bedata->peer_requested]--;
+		}
+
+		// Drop requests the peer has stopped renewing, it has moved away
+		bool stale = bedata->peer_requested != PEER_ID_INEXISTENT &&
+			time_now - bedata->time_requested > EMERGE_REQUEST_TIMEOUT_MS;
+
+		*pos   = p;
+		*flags = bedata->flags;
+
+		delete bedata;
+		blocks_enqueued.erase(iter);
+
+		if (stale) {
+			g_profiler->add("EmergeThread: stale requests dropped", 1);
+			continue;
+		}
+		return true;
+	}
+
+	return false;
 }
 
 
@@ -384,6 +470,7 @@ void *EmergeThread::Thread() {
 		std::map<v3s16, MapBlock *> modified_blocks;
 		
 		if (getBlockOrStartGen(p, &block, &data, allow_generate)) {
+			g_profiler->add("EmergeThread: chunks generated", 1);
 			{
 				ScopeProfiler sp(g_profiler, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 				TimeTaker t("mapgen::make_block()");
@@ -397,6 +484,8 @@ void *EmergeThread::Thread() {
 			{
 				//envlock: usually 0ms, but can take either 30 or 400ms to acquire
 				JMutexAutoLock envlock(m_server->m_env_mutex); 
+				// on_generated callbacks can reach the players
+				JMutexAutoLock playerslock(m_server->m_players_mutex);
 				ScopeProfiler sp(g_profiler, "EmergeThread: after "
 						"Mapgen::makeChunk (envlock)", SPT_AVG);
 
@@ -428,13 +517,15 @@ void *EmergeThread::Thread() {
 			}
 		}
 
+		if (block)
+			g_profiler->add("EmergeThread: blocks emerged", 1);
+
 		/*
 			Set sent status of modified blocks on clients
 		*/
 
-		// NOTE: Server's clients are also behind the connection mutex
-		//conlock: consistently takes 30-40ms to acquire
-		JMutexAutoLock lock(m_server->m_con_mutex);
+		// NOTE: Server's clients are behind their own mutex
+		JMutexAutoLock lock(m_server->m_clients_mutex);
 		// Add the originally fetched block to the modified list
 		if (block)
 			modified_blocks[p] = block;
@@ -449,6 +540,8 @@ void *EmergeThread::Thread() {
 				client->SetBlocksNotSent(modified_blocks);
 			}
 		}
+		if (modified_blocks.size() > 0)
+			m_server->m_block_send_thread.trigger();
 	}
 	catch (VersionMismatchException &e) {
 		std::ostringstream err;
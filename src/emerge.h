@@ -21,11 +21,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
-#include <queue>
+#include <set>
 #include "util/thread.h"
 
 #define BLOCK_EMERGE_ALLOWGEN (1<<0)
 
+// Requests of a peer that haven't been renewed for this long are dropped
+#define EMERGE_REQUEST_TIMEOUT_MS 10000
+
 #define EMERGE_DBG_OUT(x) \
 	{ if (enable_mapgen_debug_info) \
 	infostream << "EmergeThread: " x << std::endl; }
@@ -61,6 +64,8 @@ struct BlockMakeData {
 struct BlockEmergeData {
 	u16 peer_requested;
 	u8 flags;
+	float priority;      // lower is emerged first
+	u32 time_requested;  // porting::getTimeMs() of the latest request
 };
 
 class EmergeManager {
@@ -78,10 +83,15 @@ class EmergeManager {
 	u16 qlimit_total;
 	u16 qlimit_diskonly;
 	u16 qlimit_generate;
-	
-	//block emerge queue data structures
-	JMutex queuemutex;
-	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
+
+	/*
+		Number of blocks queued on all emerge threads, in total and by
+		requesting peer. The queue limits apply to these, whichever
+		threads the blocks are queued on. Protected by queuecountmutex,
+		which is locked after EmergeThread::queuemutex.
+	*/
+	JMutex queuecountmutex;
+	u32 queue_count_total;
 	std::map<u16, u16> peer_queue_count;
 
 	//Mapgen-related structures
@@ -95,7 +105,10 @@ class EmergeManager {
 	Mapgen *createMapgen(std::string mgname, int mgid,
 						MapgenParams *mgparams);
 	MapgenParams *createMapgenParams(std::string mgname);
-	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate,
+							float priority=0);
+	void cancelPeerEmerges(u16 peer_id);
+	EmergeThread *getOptimalThread(v3s16 blockpos);
 	
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	MapgenParams *getParamsFromSettings(Settings *settings);
@@ -119,7 +132,18 @@ class EmergeThread : public SimpleThread
 	
 public:
 	Event qevent;
-	std::queue<v3s16> blockqueue;
+
+	/*
+		Every thread has its own queue so that enqueueing and popping
+		blocks doesn't contend on a single mutex. Blocks of one mapgen
+		chunk always go to the same thread (see getOptimalThread()).
+
+		blockqueue is ordered by priority; an entry is always in both
+		blockqueue and blocks_enqueued.
+	*/
+	JMutex queuemutex;
+	std::set<std::pair<float, v3s16> > blockqueue;
+	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
 	
 	EmergeThread(Server *server, int ethreadid):
 		SimpleThread(),
@@ -129,8 +153,11 @@ class EmergeThread : public SimpleThread
 		mapgen(NULL),
 		id(ethreadid)
 	{
+		queuemutex.Init();
 	}
 
+	~EmergeThread();
+
 	void *Thread();
 
 	void trigger()
@@ -20,7 +20,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
 #include "environment.h"
+#include "abmhandler.h"
 #include "filesys.h"
 #include "porting.h"
 #include "collision.h"
@@ -317,6 +319,106 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 	}
 }
 
+/*
+	ActiveObjectIndex
+*/
+
+/*
+	Like getNodeBlockPos(floatToInt(p, BS)), but clamps instead of
+	overflowing s16 so that it can be used for query bounds too.
+*/
+static s16 getObjectIndexCoord(f32 f)
+{
+	f32 b = floor((f + BS/2) / (BS * MAP_BLOCKSIZE));
+	return rangelim(b, -32768.0, 32767.0);
+}
+
+static v3s16 getObjectIndexBlockPos(v3f p)
+{
+	return v3s16(getObjectIndexCoord(p.X),
+			getObjectIndexCoord(p.Y),
+			getObjectIndexCoord(p.Z));
+}
+
+void ActiveObjectIndex::insert(u16 id, v3f pos)
+{
+	v3s16 bp = getObjectIndexBlockPos(pos);
+	m_buckets[bp].insert(id);
+	m_object_buckets[id] = bp;
+}
+
+void ActiveObjectIndex::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator n = m_object_buckets.find(id);
+	if(n == m_object_buckets.end())
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_buckets.find(n->second);
+	if(b != m_buckets.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_buckets.erase(b);
+	}
+	m_object_buckets.erase(n);
+}
+
+void ActiveObjectIndex::update(u16 id, v3f pos)
+{
+	std::map<u16, v3s16>::iterator n = m_object_buckets.find(id);
+	if(n == m_object_buckets.end())
+		return;
+	v3s16 bp = getObjectIndexBlockPos(pos);
+	// Most movement happens inside a single block
+	if(bp == n->second)
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_buckets.find(n->second);
+	if(b != m_buckets.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_buckets.erase(b);
+	}
+	m_buckets[bp].insert(id);
+	n->second = bp;
+}
+
+void ActiveObjectIndex::getObjectsNear(v3f pos, f32 radius,
+		std::list<u16> &result)
+{
+	v3f r(radius, radius, radius);
+	v3s16 minp = getObjectIndexBlockPos(pos - r);
+	v3s16 maxp = getObjectIndexBlockPos(pos + r);
+	f32 volume = (f32)(maxp.X - minp.X + 1) * (f32)(maxp.Y - minp.Y + 1)
+			* (f32)(maxp.Z - minp.Z + 1);
+
+	/*
+		If the area has more blocks than there are occupied buckets,
+		walk the buckets instead of the area.
+	*/
+	if(volume > m_buckets.size())
+	{
+		for(std::map<v3s16, std::set<u16> >::iterator
+				i = m_buckets.begin(); i != m_buckets.end(); ++i)
+		{
+			v3s16 bp = i->first;
+			if(bp.X < minp.X || bp.Y < minp.Y || bp.Z < minp.Z ||
+					bp.X > maxp.X || bp.Y > maxp.Y || bp.Z > maxp.Z)
+				continue;
+			result.insert(result.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	for(s32 x = minp.X; x <= maxp.X; x++)
+	for(s32 y = minp.Y; y <= maxp.Y; y++)
+	for(s32 z = minp.Z; z <= maxp.Z; z++)
+	{
+		std::map<v3s16, std::set<u16> >::iterator i =
+				m_buckets.find(v3s16(x, y, z));
+		if(i == m_buckets.end())
+			continue;
+		result.insert(result.end(), i->second.begin(), i->second.end());
+	}
+}
+
 /*
 	ServerEnvironment
 */
@@ -329,11 +431,22 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, ScriptApi *scriptIface,
 	m_emerger(emerger),
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
-	m_active_block_interval_overload_skip(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
+	m_abm_handler(NULL),
+	m_abm_pass_due(false),
+	m_abm_round(0),
 	m_recommended_send_interval(0.1)
 {
+	int nthreads;
+	if(g_settings->get("num_abm_threads").empty()){
+		int nprocs = porting::getNumberOfProcessors();
+		// Leave some room for the emerge and other threads
+		nthreads = (nprocs > 2) ? nprocs - 2 : 1;
+	} else {
+		nthreads = g_settings->getU16("num_abm_threads");
+	}
+	m_abm_scan_pool = new ABMScanPool(MYMAX(nthreads, 1));
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -353,6 +466,20 @@ ServerEnvironment::~ServerEnvironment()
 			i = m_abms.begin(); i != m_abms.end(); ++i){
 		delete i->abm;
 	}
+
+	delete m_abm_handler;
+	delete m_abm_scan_pool;
+}
+
+u32 ServerEnvironment::getABMSeed(v3s16 blockpos)
+{
+	// Different for every block and every round, but the same
+	// whichever thread rolls the chances
+	u32 seed = m_abm_round * 2654435761U;
+	seed ^= (u32)blockpos.X * 73856093U;
+	seed ^= (u32)blockpos.Y * 19349663U;
+	seed ^= (u32)blockpos.Z * 83492791U;
+	return seed;
 }
 
 Map & ServerEnvironment::getMap()
@@ -636,166 +763,6 @@ void ServerEnvironment::loadMeta(const std::string &savedir)
 	}
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	std::set<content_t> required_neighbors;
-};
-
-class ABMHandler
-{
-private:
-	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
-public:
-	ABMHandler(std::list<ABMWithState> &abms,
-			float dtime_s, ServerEnvironment *env,
-			bool use_timers):
-		m_env(env)
-	{
-		if(dtime_s < 0.001)
-			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(std::list<ABMWithState>::iterator
-				i = abms.begin(); i != abms.end(); ++i){
-			ActiveBlockModifier *abm = i->abm;
-			float trigger_interval = abm->getTriggerInterval();
-			if(trigger_interval < 0.001)
-				trigger_interval = 0.001;
-			float actual_interval = dtime_s;
-			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
-					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
-			}
-			float intervals = actual_interval / trigger_interval;
-			if(intervals == 0)
-				continue;
-			float chance = abm->getTriggerChance();
-			if(chance == 0)
-				chance = 1;
-			ActiveABM aabm;
-			aabm.abm = abm;
-			aabm.chance = chance / intervals;
-			if(aabm.chance == 0)
-				aabm.chance = 1;
-			// Trigger neighbors
-			std::set<std::string> required_neighbors_s
-					= abm->getRequiredNeighbors();
-			for(std::set<std::string>::iterator
-					i = required_neighbors_s.begin();
-					i != required_neighbors_s.end(); i++)
-			{
-				ndef->getIds(*i, aabm.required_neighbors);
-			}
-			// Trigger contents
-			std::set<std::string> contents_s = abm->getTriggerContents();
-			for(std::set<std::string>::iterator
-					i = contents_s.begin(); i != contents_s.end(); i++)
-			{
-				std::set<content_t> ids;
-				ndef->getIds(*i, ids);
-				for(std::set<content_t>::const_iterator k = ids.begin();
-						k != ids.end(); k++)
-				{
-					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
-				}
-			}
-		}
-	}
-	void apply(MapBlock *block)
-	{
-		if(m_aabms.empty())
-			return;
-
-		ServerMap *map = &m_env->getServerMap();
-
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
-				continue;
-
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
-			{
-				if(myrand() % i->chance != 0)
-					continue;
-
-				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-neighbor_found:
-
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				u32 wider_unknown_count = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						wider_unknown_count = 0;
-						continue;
-					}
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
-				}
-				// Extrapolate
-				u32 wider_known_count = 3*3*3 - wider_unknown_count;
-				active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
-			}
-		}
-	}
-};
-
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Get time difference
@@ -834,7 +801,83 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 
 	/* Handle ActiveBlockModifiers */
 	ABMHandler abmhandler(m_abms, dtime_s, this, false);
-	abmhandler.apply(block);
+	m_abm_round++;
+	abmhandler.apply(block, getABMSeed(block->getPos()));
+	abmhandler.reportProfiling();
+}
+
+void ServerEnvironment::startABMPass(float abm_interval)
+{
+	m_abm_handler = new ABMHandler(m_abms, abm_interval, this, true);
+	m_abm_round++;
+	m_abm_queue.clear();
+	for(std::set<v3s16>::iterator
+			i = m_active_blocks.m_list.begin();
+			i != m_active_blocks.m_list.end(); ++i)
+		m_abm_queue.push_back(*i);
+}
+
+void ServerEnvironment::continueABMPass()
+{
+	u32 budget_us = g_settings->getFloat("abm_time_budget") * 1000000;
+	u32 time_start = porting::getTimeUs();
+	// Enough blocks at a time to keep all the scan threads busy
+	u32 batch_size = m_abm_scan_pool->getThreadCount() * 4;
+
+	/*
+		Handle the blocks in the order they were queued, continuing from
+		where the last step left off. Every due ABM is applied to every
+		block of the pass, so none of them is left behind.
+	*/
+	std::vector<ABMBlockJob> jobs;
+	while(!m_abm_queue.empty())
+	{
+		jobs.clear();
+		while(jobs.size() < batch_size && !m_abm_queue.empty())
+		{
+			v3s16 p = m_abm_queue.front();
+			m_abm_queue.pop_front();
+
+			// It may have been deactivated since the pass started
+			if(!m_active_blocks.contains(p))
+				continue;
+			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+			if(block==NULL)
+				continue;
+
+			// Set current time as timestamp
+			block->setTimestampNoChangedFlag(m_game_time);
+
+			if(!m_abm_handler->isActive() || block->isDummy())
+				continue;
+			jobs.push_back(ABMBlockJob());
+			m_abm_handler->prepareJob(jobs.back(), block, getABMSeed(p));
+		}
+
+		/*
+			Find the triggers in parallel. Nothing modifies the map
+			while this is done, as the environment is locked.
+		*/
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg", SPT_AVG);
+			m_abm_scan_pool->scan(m_abm_handler, jobs);
+		}
+
+		/* Handle ActiveBlockModifiers */
+		for(u32 i = 0; i < jobs.size(); i++)
+			m_abm_handler->runTriggers(jobs[i]);
+		g_profiler->add("SEnv: ABM blocks handled", jobs.size());
+
+		if(porting::getTimeUs() - time_start >= budget_us)
+			break;
+	}
+
+	if(m_abm_queue.empty())
+	{
+		m_abm_handler->reportProfiling();
+		delete m_abm_handler;
+		m_abm_handler = NULL;
+	}
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
@@ -884,12 +927,15 @@ bool ServerEnvironment::removeNode(v3s16 p)
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::list<u16> nearby;
+	m_active_object_index.getObjectsNear(pos, radius, nearby);
+	for(std::list<u16>::iterator i = nearby.begin();
+			i != nearby.end(); ++i)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = *i;
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -944,6 +990,7 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1206,55 +1253,42 @@ void ServerEnvironment::step(float dtime)
 		}
 	}
 	
+	/*
+		Active block modifiers. A pass over the active blocks is started
+		every abm_interval and spread over as many steps as it takes to
+		stay within abm_time_budget per step.
+	*/
 	const float abm_interval = 1.0;
 	if(m_active_block_modifier_interval.step(dtime, abm_interval))
-	do{ // breakable
-		if(m_active_block_interval_overload_skip > 0){
-			ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
-			m_active_block_interval_overload_skip--;
-			break;
-		}
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
-		TimeTaker timer("modify in active blocks");
-		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-		{
-			v3s16 p = *i;
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
-
-		u32 time_ms = timer.stop(true);
-		u32 max_time_ms = 200;
-		if(time_ms > max_time_ms){
-			infostream<<"WARNING: active block modifiers took "
-					<<time_ms<<"ms (longer than "
-					<<max_time_ms<<"ms)"<<std::endl;
-			m_active_block_interval_overload_skip = (time_ms / max_time_ms) + 1;
+	{
+		if(m_abm_handler == NULL){
+			startABMPass(abm_interval);
+		} else {
+			// Start the next one as soon as this one is done
+			g_profiler->add("SEnv: ABM passes late", 1);
+			m_abm_pass_due = true;
 		}
-	}while(0);
+	}
+	if(m_abm_handler == NULL && m_abm_pass_due){
+		m_abm_pass_due = false;
+		startABMPass(abm_interval);
+	}
+	if(m_abm_handler != NULL)
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: ABM time avg", SPT_AVG);
+		continueABMPass();
+	}
 	
 	/*
 		Step script environment (run global on_step())
 	*/
 	m_script->environment_Step(dtime);
 
+	/*
+		Run the callbacks of finished async jobs
+	*/
+	m_script->stepAsync();
+
 	/*
 		Step active objects
 	*/
@@ -1319,6 +1353,13 @@ ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
 	return n->second;
 }
 
+void ServerEnvironment::activeObjectMoved(ServerActiveObject *object)
+{
+	if(getActiveObject(object->getId()) != object)
+		return;
+	m_active_object_index.update(object->getId(), object->getBasePosition());
+}
+
 bool isFreeServerActiveObjectId(u16 id,
 		std::map<u16, ServerActiveObject*> &objects)
 {
@@ -1407,20 +1448,37 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 {
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
+
 	/*
-		Go through the object list,
+		Candidates are the objects in the blocks around pos, plus the
+		objects of connected players if those are sent at any distance
+	*/
+	std::list<u16> candidates;
+	m_active_object_index.getObjectsNear(pos_f, radius_f, candidates);
+	for(std::list<Player*>::iterator i = m_players.begin();
+			i != m_players.end(); ++i)
+	{
+		PlayerSAO *playersao = (*i)->getPlayerSAO();
+		if(playersao == NULL || playersao->getId() == 0)
+			continue;
+		if(playersao->unlimitedTransferDistance())
+			candidates.push_back(playersao->getId());
+	}
+
+	/*
+		Go through the candidates,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::list<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		u16 id = i->first;
+		u16 id = *i;
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed
@@ -1540,6 +1598,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object->getId(), object->getBasePosition());
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1648,6 +1707,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -1955,6 +2015,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
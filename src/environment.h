@@ -51,6 +51,8 @@ class Map;
 class ServerMap;
 class ClientMap;
 class ScriptApi;
+class ABMHandler;
+class ABMScanPool;
 
 class Environment
 {
@@ -140,7 +142,9 @@ class ActiveBlockModifier
 	// This is called usually at interval for 1/chance of the nodes
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n){};
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
-			u32 active_object_count, u32 active_object_count_wider){};
+			u32 active_object_count, u32 active_object_count_wider){};	// Name shown in the profiler
+	virtual std::string getName()
+	{ return "unnamed"; }
 };
 
 struct ABMWithState
@@ -176,6 +180,44 @@ class ActiveBlockList
 private:
 };
 
+/*
+	Spatial index of active objects, used by ServerEnvironment.
+
+	Objects are bucketed by the MapBlock their base position is in, so
+	that radius queries only have to look at the buckets around the
+	query position instead of at every active object.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	void insert(u16 id, v3f pos);
+	void remove(u16 id);
+	// Moves the object to the bucket of pos. Unknown ids are ignored.
+	void update(u16 id, v3f pos);
+	/*
+		Adds to result the ids of all objects in the buckets touched by
+		the given sphere. This is a superset of the objects inside the
+		sphere; the caller does the exact distance check.
+	*/
+	void getObjectsNear(v3f pos, f32 radius, std::list<u16> &result);
+
+	void clear(){
+		m_buckets.clear();
+		m_object_buckets.clear();
+	}
+
+	u32 size(){
+		return m_object_buckets.size();
+	}
+
+private:
+	// Objects by block position
+	std::map<v3s16, std::set<u16> > m_buckets;
+	// Block position by object id
+	std::map<u16, v3s16> m_object_buckets;
+};
+
 class IBackgroundBlockEmerger
 {
 public:
@@ -228,6 +270,13 @@ class ServerEnvironment : public Environment
 
 	ServerActiveObject* getActiveObject(u16 id);
 
+	/*
+		Called when the base position of an object changes, to keep the
+		spatial index of active objects up to date.
+		Objects that are not in the environment are ignored.
+	*/
+	void activeObjectMoved(ServerActiveObject *object);
+
 	/*
 		Add an active object to the environment.
 		Environment handles deletion of object.
@@ -305,6 +354,13 @@ class ServerEnvironment : public Environment
 
 private:
 
+	// Seed of the ABM chance rolls of a block in the current round
+	u32 getABMSeed(v3s16 blockpos);
+	// Start a pass of ABMs over the active blocks
+	void startABMPass(float abm_interval);
+	// Continue the pass in progress until abm_time_budget is used up
+	void continueABMPass();
+
 	/*
 		Internal ActiveObject interface
 		-------------------------------------------
@@ -357,6 +413,8 @@ class ServerEnvironment : public Environment
 	IBackgroundBlockEmerger *m_emerger;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Active objects by position
+	ActiveObjectIndex m_active_object_index;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -368,13 +426,21 @@ class ServerEnvironment : public Environment
 	IntervalLimiter m_active_blocks_management_interval;
 	IntervalLimiter m_active_block_modifier_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
-	int m_active_block_interval_overload_skip;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
 	std::list<ABMWithState> m_abms;
+	// Finds the triggers of ABMs in active blocks
+	ABMScanPool *m_abm_scan_pool;
+	// The ABM pass in progress and the blocks it has left, or NULL
+	ABMHandler *m_abm_handler;
+	std::list<v3s16> m_abm_queue;
+	// Whether the next pass was due before the last one was finished
+	bool m_abm_pass_due;
+	// Counts ABM runs, for seeding the chance rolls
+	u32 m_abm_round;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval;
 };
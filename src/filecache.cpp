@@ -117,3 +117,26 @@ bool FileCache::load_sha1(const std::string &sha1_raw, std::ostream &os)
 	os<<tmp_os.str();
 	return true;
 }
+bool FileCache::append(const std::string &name, const std::string &data)
+{
+	std::string path = m_dir + DIR_DELIM + name;
+	std::ofstream file(path.c_str(), std::ios_base::binary |
+			std::ios_base::app);
+
+	if(!file.good())
+	{
+		errorstream<<"FileCache: Can't write to file at "
+				<<path<<std::endl;
+		return false;
+	}
+
+	file.write(data.c_str(), data.length());
+	file.close();
+
+	return !file.fail();
+}
+bool FileCache::remove(const std::string &name)
+{
+	std::string path = m_dir + DIR_DELIM + name;
+	return fs::DeleteSingleFileOrEmptyDirectory(path);
+}
@@ -39,6 +39,9 @@ class FileCache
 	bool update_sha1(const std::string &data);
 	bool load(const std::string &name, std::ostream &os);
 	bool load_sha1(const std::string &sha1_raw, std::ostream &os);
+	// Add data to the end of a file, creating it if needed
+	bool append(const std::string &name, const std::string &data);
+	bool remove(const std::string &name);
 private:
 	std::string m_dir;
 
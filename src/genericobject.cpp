@@ -19,7 +19,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "genericobject.h"
 #include <sstream>
+#include <cmath>
 #include "util/serialize.h"
+#include "constants.h" // BS
 
 std::string gob_cmd_set_properties(const ObjectProperties &prop)
 {
@@ -65,6 +67,177 @@ std::string gob_cmd_update_position(
 	return os.str();
 }
 
+static void writeUpdatePosition(std::ostream &os, const ObjectPosition &p)
+{
+	writeV3F1000(os, p.position);
+	writeV3F1000(os, p.velocity);
+	writeV3F1000(os, p.acceleration);
+	writeF1000(os, p.yaw);
+	writeU8(os, p.do_interpolate);
+	writeU8(os, p.is_movement_end);
+	writeF1000(os, p.update_interval);
+}
+
+std::string gob_cmd_update_position(const ObjectPosition &p)
+{
+	std::ostringstream os(std::ios::binary);
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION);
+	writeUpdatePosition(os, p);
+	return os.str();
+}
+
+ObjectPosition gob_read_update_position(std::istream &is)
+{
+	ObjectPosition p;
+	p.position = readV3F1000(is);
+	p.velocity = readV3F1000(is);
+	p.acceleration = readV3F1000(is);
+	p.yaw = readF1000(is);
+	p.do_interpolate = readU8(is);
+	p.is_movement_end = readU8(is);
+	p.update_interval = readF1000(is);
+	return p;
+}
+
+std::string gob_cmd_update_position_baseline(u8 baseline_id,
+		const ObjectPosition &p)
+{
+	std::ostringstream os(std::ios::binary);
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_BASELINE);
+	writeU8(os, baseline_id);
+	writeUpdatePosition(os, p);
+	return os.str();
+}
+
+/*
+	GENERIC_CMD_UPDATE_POSITION_DELTA:
+	u8 command
+	u8 baseline id
+	u8 flags; fields that are not included are those of the baseline
+	[GOB_DELTA_POSITION] v3s16 offset from the baseline position
+	[GOB_DELTA_VELOCITY] v3s16 velocity
+	[GOB_DELTA_ACCELERATION] v3s16 acceleration
+	[GOB_DELTA_YAW] u16 yaw in 1/65536 turns
+	[GOB_DELTA_UPDATE_INTERVAL] u16 update interval in milliseconds
+	Vectors are in units of GOB_DELTA_QUANTUM.
+*/
+#define GOB_DELTA_POSITION (1<<0)
+#define GOB_DELTA_VELOCITY (1<<1)
+#define GOB_DELTA_ACCELERATION (1<<2)
+#define GOB_DELTA_YAW (1<<3)
+#define GOB_DELTA_UPDATE_INTERVAL (1<<4)
+#define GOB_DELTA_DO_INTERPOLATE (1<<5)
+#define GOB_DELTA_IS_MOVEMENT_END (1<<6)
+
+#define GOB_DELTA_QUANTUM (BS/100)
+
+static bool quantizeDelta(v3f v, v3s16 *result)
+{
+	f32 x = floor(v.X / GOB_DELTA_QUANTUM + 0.5);
+	f32 y = floor(v.Y / GOB_DELTA_QUANTUM + 0.5);
+	f32 z = floor(v.Z / GOB_DELTA_QUANTUM + 0.5);
+	if(fabs(x) > 32767 || fabs(y) > 32767 || fabs(z) > 32767)
+		return false;
+	*result = v3s16(x, y, z);
+	return true;
+}
+
+static v3f unquantizeDelta(v3s16 v)
+{
+	return v3f(v.X, v.Y, v.Z) * GOB_DELTA_QUANTUM;
+}
+
+static u16 quantizeYaw(f32 yaw)
+{
+	f32 turns = yaw / 360.0;
+	turns -= floor(turns);
+	// 1.0 wraps around to 0
+	return (u16)(u32)floor(turns * 65536.0 + 0.5);
+}
+
+static u16 quantizeInterval(f32 interval)
+{
+	f32 ms = floor(interval * 1000.0 + 0.5);
+	if(ms < 0)
+		return 0;
+	if(ms > 65535)
+		return 65535;
+	return ms;
+}
+
+std::string gob_cmd_update_position_delta(u8 baseline_id,
+		const ObjectPosition &baseline, const ObjectPosition &p)
+{
+	u8 flags = 0;
+	v3s16 position, velocity, acceleration, baseline_q;
+
+	if(!quantizeDelta(p.position - baseline.position, &position))
+		return "";
+	if(position != v3s16(0,0,0))
+		flags |= GOB_DELTA_POSITION;
+
+	if(!quantizeDelta(p.velocity, &velocity))
+		return "";
+	if(!quantizeDelta(baseline.velocity, &baseline_q) ||
+			velocity != baseline_q)
+		flags |= GOB_DELTA_VELOCITY;
+
+	if(!quantizeDelta(p.acceleration, &acceleration))
+		return "";
+	if(!quantizeDelta(baseline.acceleration, &baseline_q) ||
+			acceleration != baseline_q)
+		flags |= GOB_DELTA_ACCELERATION;
+
+	u16 yaw = quantizeYaw(p.yaw);
+	if(yaw != quantizeYaw(baseline.yaw))
+		flags |= GOB_DELTA_YAW;
+
+	u16 interval = quantizeInterval(p.update_interval);
+	if(interval != quantizeInterval(baseline.update_interval))
+		flags |= GOB_DELTA_UPDATE_INTERVAL;
+
+	if(p.do_interpolate)
+		flags |= GOB_DELTA_DO_INTERPOLATE;
+	if(p.is_movement_end)
+		flags |= GOB_DELTA_IS_MOVEMENT_END;
+
+	std::ostringstream os(std::ios::binary);
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_DELTA);
+	writeU8(os, baseline_id);
+	writeU8(os, flags);
+	if(flags & GOB_DELTA_POSITION)
+		writeV3S16(os, position);
+	if(flags & GOB_DELTA_VELOCITY)
+		writeV3S16(os, velocity);
+	if(flags & GOB_DELTA_ACCELERATION)
+		writeV3S16(os, acceleration);
+	if(flags & GOB_DELTA_YAW)
+		writeU16(os, yaw);
+	if(flags & GOB_DELTA_UPDATE_INTERVAL)
+		writeU16(os, interval);
+	return os.str();
+}
+
+ObjectPosition gob_read_update_position_delta(std::istream &is,
+		const ObjectPosition &baseline)
+{
+	ObjectPosition p = baseline;
+	u8 flags = readU8(is);
+	if(flags & GOB_DELTA_POSITION)
+		p.position += unquantizeDelta(readV3S16(is));
+	if(flags & GOB_DELTA_VELOCITY)
+		p.velocity = unquantizeDelta(readV3S16(is));
+	if(flags & GOB_DELTA_ACCELERATION)
+		p.acceleration = unquantizeDelta(readV3S16(is));
+	if(flags & GOB_DELTA_YAW)
+		p.yaw = (f32)readU16(is) * 360.0 / 65536.0;
+	if(flags & GOB_DELTA_UPDATE_INTERVAL)
+		p.update_interval = (f32)readU16(is) / 1000.0;
+	p.do_interpolate = (flags & GOB_DELTA_DO_INTERPOLATE);
+	p.is_movement_end = (flags & GOB_DELTA_IS_MOVEMENT_END);
+	return p;
+}
+
 std::string gob_cmd_set_texture_mod(const std::string &mod)
 {
 	std::ostringstream os(std::ios::binary);
@@ -34,6 +34,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define GENERIC_CMD_SET_BONE_POSITION 7
 #define GENERIC_CMD_SET_ATTACHMENT 8
 #define GENERIC_CMD_SET_PHYSICS_OVERRIDE 9
+#define GENERIC_CMD_UPDATE_POSITION_BASELINE 10
+#define GENERIC_CMD_UPDATE_POSITION_DELTA 11
 
 #include "object_properties.h"
 std::string gob_cmd_set_properties(const ObjectProperties &prop);
@@ -49,6 +51,45 @@ std::string gob_cmd_update_position(
 	f32 update_interval
 );
 
+/*
+	Contents of a GENERIC_CMD_UPDATE_POSITION
+*/
+struct ObjectPosition
+{
+	v3f position;
+	v3f velocity;
+	v3f acceleration;
+	f32 yaw;
+	bool do_interpolate;
+	bool is_movement_end;
+	f32 update_interval;
+
+	ObjectPosition():
+		yaw(0),
+		do_interpolate(false),
+		is_movement_end(false),
+		update_interval(0)
+	{}
+};
+
+std::string gob_cmd_update_position(const ObjectPosition &p);
+// Reads what follows the command byte
+ObjectPosition gob_read_update_position(std::istream &is);
+
+/*
+	Position updates sent to clients as a reliable baseline followed by
+	unreliable deltas against it. A delta is only applied if the client
+	has the baseline it refers to; lost deltas therefore don't matter.
+*/
+std::string gob_cmd_update_position_baseline(u8 baseline_id,
+		const ObjectPosition &p);
+// Returns an empty string if p is too far from the baseline to be encoded
+std::string gob_cmd_update_position_delta(u8 baseline_id,
+		const ObjectPosition &baseline, const ObjectPosition &p);
+// Reads what follows the baseline id
+ObjectPosition gob_read_update_position_delta(std::istream &is,
+		const ObjectPosition &baseline);
+
 std::string gob_cmd_set_texture_mod(const std::string &mod);
 
 std::string gob_cmd_set_sprite(
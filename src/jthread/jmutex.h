@@ -96,6 +96,11 @@ class Event {
 	void wait() {
 		WaitForSingleObject(hEvent, INFINITE); 
 	}
+
+	// Returns false if timeout_ms passed without a signal
+	bool wait(unsigned int timeout_ms) {
+		return WaitForSingleObject(hEvent, timeout_ms) == WAIT_OBJECT_0;
+	}
 	
 	void signal() {
 		SetEvent(hEvent);
@@ -105,6 +110,8 @@ class Event {
 #else
 
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
 
 class Event {
 	sem_t sem;
@@ -121,6 +128,23 @@ class Event {
 	void wait() {
 		sem_wait(&sem);
 	}
+
+	// Returns false if timeout_ms passed without a signal
+	bool wait(unsigned int timeout_ms) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (sem_timedwait(&sem, &ts) != 0) {
+			if (errno != EINTR)
+				return false;
+		}
+		return true;
+	}
 	
 	void signal() {
 		sem_post(&sem);
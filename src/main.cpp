@@ -1006,6 +1006,10 @@ int main(int argc, char *argv[])
 			_("Set logfile path ('' = no logging)"))));
 	allowed_options.insert(std::make_pair("gameid", ValueSpec(VALUETYPE_STRING,
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
+	allowed_options.insert(std::make_pair("migrate", ValueSpec(VALUETYPE_STRING,
+			_("Migrate the map of the world to a database backend and exit"))));
+	allowed_options.insert(std::make_pair("compact", ValueSpec(VALUETYPE_FLAG,
+			_("Rewrite the map at the latest format, compact it and exit"))));
 #ifndef SERVER
 	allowed_options.insert(std::make_pair("videomodes", ValueSpec(VALUETYPE_FLAG,
 			_("Show available video modes"))));
@@ -1296,7 +1300,8 @@ int main(int argc, char *argv[])
 #ifdef SERVER
 	bool run_dedicated_server = true;
 #else
-	bool run_dedicated_server = cmd_args.getFlag("server");
+	bool run_dedicated_server = cmd_args.getFlag("server") ||
+			cmd_args.exists("migrate") || cmd_args.getFlag("compact");
 #endif
 	g_settings->set("server_dedicated", run_dedicated_server ? "true" : "false");
 	if(run_dedicated_server)
@@ -1412,6 +1417,17 @@ int main(int argc, char *argv[])
 
 		// Create server
 		Server server(world_path, configpath, gamespec, false);
+
+		// Offline map database maintenance
+		if(cmd_args.exists("migrate") || cmd_args.getFlag("compact"))
+		{
+			std::string backend = cmd_args.exists("migrate") ?
+					cmd_args.get("migrate") : "";
+			bool success = server.migrateMapDatabase(backend,
+					cmd_args.getFlag("compact"));
+			return success ? 0 : 1;
+		}
+
 		server.start(port);
 		
 		// Run server
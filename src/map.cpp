@@ -36,6 +36,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 #include "mapgen_v6.h"
 #include "mapgen_indev.h"
+#include "mapdbthread.h"
+#include "database.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -63,7 +65,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_modified_counter(0)
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -2281,6 +2284,7 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeMetadata");
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -2295,6 +2299,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->raiseModified(MOD_STATE_WRITE_NEEDED, "removeNodeMetadata");
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -2357,9 +2362,7 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	Map(dout_server, gamedef),
 	m_seed(0),
 	m_map_metadata_changed(true),
-	m_database(NULL),
-	m_database_read(NULL),
-	m_database_write(NULL)
+	m_database(NULL)
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
@@ -2393,6 +2396,21 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
+	/*
+		Open the map database with the backend set in world.mt
+	*/
+	{
+		m_database_backend = "sqlite3";
+		Settings conf;
+		std::string conf_path = m_savedir + DIR_DELIM + "world.mt";
+		if(conf.readConfigFile(conf_path.c_str()) && conf.exists("backend"))
+			m_database_backend = conf.get("backend");
+		infostream<<"ServerMap: Using map database backend \""
+				<<m_database_backend<<"\""<<std::endl;
+		m_database = new MapDatabaseThread(
+				createMapDatabase(m_database_backend, m_savedir));
+	}
+
 	try
 	{
 		// If directory exists, check contents and load if possible
@@ -2479,14 +2497,9 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write out what is still queued and close the database
 	*/
-	if(m_database_read)
-		sqlite3_finalize(m_database_read);
-	if(m_database_write)
-		sqlite3_finalize(m_database_write);
-	if(m_database)
-		sqlite3_close(m_database);
+	delete m_database;
 
 #if 0
 	/*
@@ -3122,79 +3135,8 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	//return (s16)level;
 }
 
-void ServerMap::createDatabase() {
-	int e;
-	assert(m_database);
-	e = sqlite3_exec(m_database,
-		"CREATE TABLE IF NOT EXISTS `blocks` ("
-			"`pos` INT NOT NULL PRIMARY KEY,"
-			"`data` BLOB"
-		");"
-	, NULL, NULL, NULL);
-	if(e == SQLITE_ABORT)
-		throw FileNotGoodException("Could not create database structure");
-	else
-		infostream<<"ServerMap: Database structure was created";
-}
-
-void ServerMap::verifyDatabase() {
-	if(m_database)
-		return;
-
-	{
-		std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
-		bool needs_create = false;
-		int d;
-
-		/*
-			Open the database connection
-		*/
-
-		createDirs(m_savedir);
-
-		if(!fs::PathExists(dbp))
-			needs_create = true;
-
-		d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot open database file");
-		}
-
-		if(needs_create)
-			createDatabase();
-
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare write statement");
-		}
-
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-
-		infostream<<"ServerMap: Database opened"<<std::endl;
-	}
-}
-
 bool ServerMap::loadFromFolders() {
-	if(!m_database && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite"))
-		return true;
-	return false;
-}
-
-sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos) {
-	return (sqlite3_int64)pos.Z*16777216 +
-		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+	return !m_database->exists();
 }
 
 void ServerMap::createDirs(std::string path)
@@ -3303,9 +3245,6 @@ void ServerMap::save(ModifiedState save_level)
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
 
-	// Don't do anything with sqlite unless something is really saved
-	bool save_started = false;
-
 	for(std::map<v2s16, MapSector*>::iterator i = m_sectors.begin();
 		i != m_sectors.end(); ++i)
 	{
@@ -3329,12 +3268,6 @@ void ServerMap::save(ModifiedState save_level)
 
 			if(block->getModified() >= (u32)save_level)
 			{
-				// Lazy beginSave()
-				if(!save_started){
-					beginSave();
-					save_started = true;
-				}
-
 				modprofiler.add(block->getModifiedReason(), 1);
 
 				saveBlock(block);
@@ -3348,8 +3281,13 @@ void ServerMap::save(ModifiedState save_level)
 			}
 		}
 	}
-	if(save_started)
-		endSave();
+	// Saving the whole map is expected to be on disk when done
+	if(save_level == MOD_STATE_CLEAN && !m_database->flush())
+	{
+		errorstream<<"ServerMap: Writing to the map database keeps "
+				<<"failing; "<<m_database->getQueuedCount()<<" blocks are "
+				<<"not saved yet"<<std::endl;
+	}
 
 	/*
 		Only print if something happened or saved whole map
@@ -3368,50 +3306,161 @@ void ServerMap::save(ModifiedState save_level)
 	}
 }
 
-static s32 unsignedToSigned(s32 i, s32 max_positive)
+void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 {
-	if(i < max_positive)
-		return i;
-	else
-		return i - 2*max_positive;
-}
+	if(loadFromFolders()){
+		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
+				<<"all blocks that are stored in flat files"<<std::endl;
+	}
 
-// modulo of a negative number does not work consistently in C
-static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
-{
-	if(i >= 0)
-		return i % mod;
-	return mod - ((-i) % mod);
+	m_database->listAllLoadableBlocks(dst);
 }
 
-v3s16 ServerMap::getIntegerAsBlock(sqlite3_int64 i)
+bool ServerMap::migrateDatabase(const std::string &target_backend,
+		bool recompress)
 {
-	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - x) / 4096;
-	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - y) / 4096;
-	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	return v3s16(x,y,z);
-}
+	DSTACK(__FUNCTION_NAME);
 
-void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
-{
-	if(loadFromFolders()){
-		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
-				<<"all blocks that are stored in flat files"<<std::endl;
+	bool in_place = target_backend.empty() ||
+			target_backend == m_database_backend;
+	if(in_place && !recompress)
+	{
+		// Nothing to copy
+		return m_database->compact();
 	}
 
+	MapDatabaseThread *target = m_database;
+	if(!in_place)
 	{
-		verifyDatabase();
+		try{
+			target = new MapDatabaseThread(
+					createMapDatabase(target_backend, m_savedir));
+		}
+		catch(BaseException &e)
+		{
+			errorstream<<"Could not open target database: "<<e.what()
+					<<std::endl;
+			return false;
+		}
+	}
+
+	std::list<v3s16> blocks;
+	listAllLoadableBlocks(blocks);
+	u32 block_count = blocks.size();
+	actionstream<<"Migrating "<<block_count<<" blocks from "
+			<<m_database_backend<<" to "
+			<<(in_place ? m_database_backend : target_backend)
+			<<(recompress ? ", recompressing" : "")<<std::endl;
 
-		while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	u32 done = 0;
+	u32 failed = 0;
+	u64 bytes_in = 0;
+	u64 bytes_out = 0;
+	u32 time_start = porting::getTimeMs();
+	u32 time_last_report = time_start;
+
+	for(std::list<v3s16>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		v3s16 p = *i;
+		std::string data;
+		if(!m_database->loadBlock(p, &data))
 		{
-			sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-			v3s16 p = getIntegerAsBlock(block_i);
-			//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-			dst.push_back(p);
+			errorstream<<"Block "<<PP(p)<<" is listed but could not be "
+					<<"read"<<std::endl;
+			failed++;
+			continue;
+		}
+		bytes_in += data.size();
+
+		if(recompress)
+		{
+			try{
+				std::istringstream is(data, std::ios_base::binary);
+				u8 version = SER_FMT_VER_INVALID;
+				is.read((char*)&version, 1);
+				if(is.fail())
+					throw SerializationError("Failed to read MapBlock version");
+
+				MapBlock block(this, p, m_gamedef);
+				block.deSerialize(is, version, true);
+
+				std::ostringstream os(std::ios_base::binary);
+				version = SER_FMT_VER_HIGHEST;
+				os.write((char*)&version, 1);
+				block.serialize(os, version, true);
+				data = os.str();
+			}
+			catch(SerializationError &e)
+			{
+				// Copy it as it is, it's no worse off than before
+				errorstream<<"Invalid block data in database "<<PP(p)
+						<<", not recompressed: "<<e.what()<<std::endl;
+			}
+		}
+
+		bytes_out += data.size();
+		target->saveBlock(p, data);
+		done++;
+
+		// Don't let the writer fall too far behind
+		if(target->getQueuedCount() > 4096 && !target->flush())
+			break;
+
+		u32 time_now = porting::getTimeMs();
+		if(time_now - time_last_report >= 5000 || done == block_count)
+		{
+			float seconds = (float)(time_now - time_start) / 1000.0;
+			actionstream<<"Migrated "<<done<<"/"<<block_count<<" blocks ("
+					<<(seconds > 0 ? done / seconds : 0)<<" blocks/s, "
+					<<(bytes_in >> 20)<<" MiB read, "
+					<<(bytes_out >> 20)<<" MiB written)"<<std::endl;
+			time_last_report = time_now;
+		}
+	}
+
+	actionstream<<"Compacting database"<<std::endl;
+	if(!target->compact())
+	{
+		errorstream<<"Writing to the database failed, "
+				<<target->getQueuedCount()<<" blocks were not written"
+				<<std::endl;
+		failed += target->getQueuedCount();
+	}
+
+	if(!in_place)
+	{
+		if(failed != 0)
+		{
+			delete target;
+			errorstream<<failed<<" blocks could not be copied; not switching "
+					<<"the world to "<<target_backend<<std::endl;
+			return false;
 		}
+
+		Settings conf;
+		std::string conf_path = m_savedir + DIR_DELIM + "world.mt";
+		conf.readConfigFile(conf_path.c_str());
+		conf.set("backend", target_backend);
+		if(!conf.updateConfigFile(conf_path.c_str()))
+		{
+			delete target;
+			errorstream<<"Failed to update "<<conf_path<<"; set backend = "
+					<<target_backend<<" in it to use the new database"
+					<<std::endl;
+			return false;
+		}
+		actionstream<<"World now uses the "<<target_backend<<" backend. "
+				<<"The old "<<m_database_backend<<" database was left in "
+				<<"place and can be removed."<<std::endl;
+
+		// Blocks saved from now on, like at shutdown, go to the new one
+		delete m_database;
+		m_database = target;
+		m_database_backend = target_backend;
 	}
+
+	return failed == 0;
 }
 
 void ServerMap::listAllLoadedBlocks(std::list<v3s16> &dst)
@@ -3694,18 +3743,6 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 }
 #endif
 
-void ServerMap::beginSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
-}
-
-void ServerMap::endSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
-}
-
 void ServerMap::saveBlock(MapBlock *block)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3742,8 +3779,6 @@ void ServerMap::saveBlock(MapBlock *block)
 		[1] data
 	*/
 
-	verifyDatabase();
-
 	std::ostringstream o(std::ios_base::binary);
 
 	o.write((char*)&version, 1);
@@ -3751,32 +3786,12 @@ void ServerMap::saveBlock(MapBlock *block)
 	// Write basic data
 	block->serialize(o, version, true);
 
-	// Write block to database
-
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
+	// Queue block to be written to the database
+	m_database->saveBlock(p3d, o.str());
 
-	bool success = true;
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK) {
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
-	}
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) { // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
-	}
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE) {
-		errorstream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		success = false;
-	}
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
-
-	// We just wrote it to the disk so clear modified flag
-	if (success)
-		block->resetModified();
+	// The database thread keeps its copy until it has been written,
+	// retrying if it fails, so clear modified flag
+	block->resetModified();
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
@@ -3924,19 +3939,20 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 	}
 }
 
+void ServerMap::prefetchBlock(v3s16 blockpos)
+{
+	m_database->prefetchBlock(blockpos);
+}
+
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
 	DSTACK(__FUNCTION_NAME);
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
-	if(!loadFromFolders()) {
-		verifyDatabase();
-
-		if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
-			infostream<<"WARNING: Could not bind block position for load: "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+	{
+		std::string datastr;
+		if(m_database->loadBlock(blockpos, &datastr)) {
 			/*
 				Make sure sector is loaded
 			*/
@@ -3945,20 +3961,10 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 			/*
 				Load block
 			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
-			size_t len = sqlite3_column_bytes(m_database_read, 0);
-
-			std::string datastr(data, len);
-
 			loadBlock(&datastr, blockpos, sector, false);
 
-			sqlite3_step(m_database_read);
-			// We should never get more than 1 row, so ok to reset
-			sqlite3_reset(m_database_read);
-
 			return getBlockNoCreateNoEx(blockpos);
 		}
-		sqlite3_reset(m_database_read);
 
 		// Not found in database, try the files
 	}
@@ -38,14 +38,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/container.h"
 #include "nodetimer.h"
 
-extern "C" {
-	#include "sqlite3.h"
-}
-
 class ClientMap;
 class MapSector;
 class ServerMapSector;
 class MapBlock;
+class MapDatabaseThread;
 class NodeMetadata;
 class IGameDef;
 class IRollbackReportSink;
@@ -329,6 +326,12 @@ class Map /*: public NodeContainer*/
 	*/
 	std::map<v2s16, MapSector*> *getSectorsPtr(){return &m_sectors;}
 
+	// Gives a value for MapBlock::getModifiedCounter()
+	u32 nextModifiedCounter()
+	{
+		return ++m_modified_counter;
+	}
+
 	/*
 		Variables
 	*/
@@ -352,6 +355,9 @@ class Map /*: public NodeContainer*/
 
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+
+	// Last value given by nextModifiedCounter()
+	u32 m_modified_counter;
 };
 
 /*
@@ -420,26 +426,21 @@ class ServerMap : public Map
 	v3s16 getBlockPos(std::string sectordir, std::string blockfile);
 	static std::string getBlockFilename(v3s16 p);
 
-	/*
-		Database functions
-	*/
-	// Create the database structure
-	void createDatabase();
-	// Verify we can read/write to the database
-	void verifyDatabase();
-	// Get an integer suitable for a block
-	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
-	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
-
 	// Returns true if the database file does not exist
 	bool loadFromFolders();
 
-	// Call these before and after saving of blocks
-	void beginSave();
-	void endSave();
-
 	void save(ModifiedState save_level);
 	void listAllLoadableBlocks(std::list<v3s16> &dst);
+
+	/*
+		Offline maintenance of the map database; the server must not be
+		running. Copies every block to a database of target_backend and
+		makes it the backend of the world and of this map, or rewrites
+		the blocks in place if target_backend is empty. With recompress,
+		blocks are written at the latest serialization format. The
+		database is compacted afterwards. Returns false on failure.
+	*/
+	bool migrateDatabase(const std::string &target_backend, bool recompress);
 	void listAllLoadedBlocks(std::list<v3s16> &dst);
 	// Saves map seed and possibly other stuff
 	void saveMapMeta();
@@ -470,6 +471,9 @@ class ServerMap : public Map
 	MapBlock* loadBlock(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
+	// Start reading a block from the database in the background
+	// if it will probably be needed soon
+	void prefetchBlock(v3s16 p);
 
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
@@ -507,12 +511,10 @@ class ServerMap : public Map
 	bool m_map_metadata_changed;
 
 	/*
-		SQLite database and statements
+		Database, written and read by its own thread
 	*/
-	sqlite3 *m_database;
-	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
-	sqlite3_stmt *m_database_list;
+	MapDatabaseThread *m_database;
+	std::string m_database_backend;
 };
 
 #define VMANIP_BLOCK_DATA_INEXIST     1
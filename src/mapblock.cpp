@@ -50,10 +50,13 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_modified_counter(0),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_contents_counter(0),
+		m_contents_valid(false),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
@@ -63,6 +66,7 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 	data = NULL;
 	if(dummy == false)
 		reallocate();
+	bumpModifiedCounter();
 	
 #ifndef SERVER
 	//mesh_mutex.Init();
@@ -124,6 +128,7 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		bumpModifiedCounter();
 	}
 }
 
@@ -357,6 +362,16 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	bumpModifiedCounter();
+}
+
+void MapBlock::bumpModifiedCounter()
+{
+	if(m_parent)
+		m_modified_counter = m_parent->nextModifiedCounter();
+	else
+		m_modified_counter++;
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -423,6 +438,43 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+bool MapBlock::containsAnyContent(const std::set<content_t> &ids)
+{
+	if(data == NULL)
+		return ids.count(CONTENT_IGNORE) != 0;
+
+	if(!m_contents_valid || m_contents_counter != m_modified_counter)
+	{
+		m_contents.clear();
+		content_t last = CONTENT_IGNORE;
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			content_t c = data[i].getContent();
+			// Neighbouring nodes are usually the same
+			if(i != 0 && c == last)
+				continue;
+			m_contents.insert(c);
+			last = c;
+		}
+		m_contents_counter = m_modified_counter;
+		m_contents_valid = true;
+	}
+
+	// Look the smaller set up in the larger one
+	const std::set<content_t> &a = ids.size() < m_contents.size() ?
+			ids : m_contents;
+	const std::set<content_t> &b = ids.size() < m_contents.size() ?
+			m_contents : ids;
+	for(std::set<content_t>::const_iterator i = a.begin();
+			i != a.end(); ++i)
+	{
+		if(b.count(*i) != 0)
+			return true;
+	}
+	return false;
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -642,6 +694,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
+	bumpModifiedCounter();
+
 	m_day_night_differs_expired = false;
 
 	if(version <= 21)
@@ -978,6 +1032,58 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 /*
 	Get a quick string to describe what a block actually contains
 */
+/*
+	MapBlockSnapshot
+*/
+
+void MapBlockSnapshot::take(MapBlock *block, u8 version_)
+{
+	if(!ser_ver_supported(version_))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	if(block->data == NULL)
+		throw SerializationError("ERROR: Not writing dummy block.");
+	if(version_ < 24)
+		throw SerializationError("MapBlockSnapshot::take: serialization to "
+				"version < 24 not possible");
+
+	pos = block->getPos();
+	version = version_;
+	modified_counter = block->getModifiedCounter();
+
+	// Same as in MapBlock::serialize()
+	m_flags = 0;
+	if(block->is_underground)
+		m_flags |= 0x01;
+	if(block->getDayNightDiff())
+		m_flags |= 0x02;
+	if(block->m_lighting_expired)
+		m_flags |= 0x04;
+	if(block->m_generated == false)
+		m_flags |= 0x08;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	m_nodes.assign(block->data, block->data + nodecount);
+
+	std::ostringstream oss(std::ios_base::binary);
+	block->m_node_metadata.serialize(oss);
+	m_node_metadata = oss.str();
+}
+
+void MapBlockSnapshot::serialize(std::ostream &os)
+{
+	// The network part of MapBlock::serialize()
+	writeU8(os, m_flags);
+
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	MapNode::serializeBulk(os, version, &m_nodes[0], m_nodes.size(),
+			content_width, params_width, true);
+
+	compressZlib(m_node_metadata, os);
+}
+
 std::string analyze_block(MapBlock *block)
 {
 	if(block == NULL)
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutexautolock.h>
 #include <exception>
 #include <set>
+#include <vector>
 #include "debug.h"
 #include "irrlichttypes.h"
 #include "irr_v3d.h"
@@ -109,6 +110,7 @@ class NodeContainer
 
 class MapBlock /*: public NodeContainer*/
 {
+	friend class MapBlockSnapshot;
 public:
 	MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy=false);
 	~MapBlock();
@@ -153,6 +155,10 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		// Lesser states are for data that isn't sent to clients
+		if(mod >= MOD_STATE_WRITE_NEEDED)
+			bumpModifiedCounter();
+
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -186,6 +192,16 @@ class MapBlock /*: public NodeContainer*/
 		m_modified_reason = "none";
 		m_modified_reason_too_long = false;
 	}
+	/*
+		Changes every time the data sent to clients is modified.
+		The values are given by the parent map and never reused, so
+		they stay unique when a block is unloaded and loaded again.
+	*/
+	u32 getModifiedCounter()
+	{
+		return m_modified_counter;
+	}
+	void bumpModifiedCounter();
 	
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -380,6 +396,14 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Returns true if a node with any of the given content ids is in
+		the block. A dummy block only contains CONTENT_IGNORE.
+		The set of content ids in the block is kept for this, and
+		rebuilt when the block has been modified since.
+	*/
+	bool containsAnyContent(const std::set<content_t> &ids);
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -545,6 +569,9 @@ class MapBlock /*: public NodeContainer*/
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
 
+	// See getModifiedCounter()
+	u32 m_modified_counter;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -568,6 +595,12 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	// Content ids in the block, valid if m_contents_counter equals
+	// m_modified_counter. See containsAnyContent().
+	std::set<content_t> m_contents;
+	u32 m_contents_counter;
+	bool m_contents_valid;
+
 	bool m_generated;
 	
 	/*
@@ -591,6 +624,34 @@ class MapBlock /*: public NodeContainer*/
 	int m_refcount;
 };
 
+/*
+	A copy of the data of a MapBlock that is sent to clients.
+
+	It is taken while holding the map and can be serialized and
+	compressed afterwards without it.
+*/
+class MapBlockSnapshot
+{
+public:
+	// Throws like MapBlock::serialize()
+	void take(MapBlock *block, u8 version);
+
+	// Writes what block->serialize(os, version, false) would have
+	// written when the snapshot was taken
+	void serialize(std::ostream &os);
+
+	v3s16 pos;
+	u8 version;
+	// MapBlock::getModifiedCounter() of the block
+	u32 modified_counter;
+
+private:
+	u8 m_flags;
+	std::vector<MapNode> m_nodes;
+	// Uncompressed
+	std::string m_node_metadata;
+};
+
 inline bool blockpos_over_limit(v3s16 p)
 {
 	return
@@ -546,10 +546,16 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 		vertex_pos[i] += pos;
 	}
 
-	f32 abs_scale = 1.;
-	if     (scale.X < 0.999 || scale.X > 1.001) abs_scale = scale.X;
-	else if(scale.Y < 0.999 || scale.Y > 1.001) abs_scale = scale.Y;
-	else if(scale.Z < 0.999 || scale.Z > 1.001) abs_scale = scale.Z;
+	/*
+		Repeat the texture over a scaled face. Horizontally it goes from
+		corner 1 to corner 0, vertically from corner 1 to corner 2.
+	*/
+	v3s16 u_dir = vertex_dirs[0] - vertex_dirs[1];
+	v3s16 v_dir = vertex_dirs[2] - vertex_dirs[1];
+	f32 u_scale = (abs(u_dir.X) * scale.X + abs(u_dir.Y) * scale.Y
+			+ abs(u_dir.Z) * scale.Z) / 2.;
+	f32 v_scale = (abs(v_dir.X) * scale.X + abs(v_dir.Y) * scale.Y
+			+ abs(v_dir.Z) * scale.Z) / 2.;
 
 	v3f normal(dir.X, dir.Y, dir.Z);
 
@@ -562,16 +568,16 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 
 	face.vertices[0] = video::S3DVertex(vertex_pos[0], normal,
 			MapBlock_LightColor(alpha, li0, light_source),
-			core::vector2d<f32>(x0+w*abs_scale, y0+h));
+			core::vector2d<f32>(x0+w*u_scale, y0+h*v_scale));
 	face.vertices[1] = video::S3DVertex(vertex_pos[1], normal,
 			MapBlock_LightColor(alpha, li1, light_source),
-			core::vector2d<f32>(x0, y0+h));
+			core::vector2d<f32>(x0, y0+h*v_scale));
 	face.vertices[2] = video::S3DVertex(vertex_pos[2], normal,
 			MapBlock_LightColor(alpha, li2, light_source),
 			core::vector2d<f32>(x0, y0));
 	face.vertices[3] = video::S3DVertex(vertex_pos[3], normal,
 			MapBlock_LightColor(alpha, li3, light_source),
-			core::vector2d<f32>(x0+w*abs_scale, y0));
+			core::vector2d<f32>(x0+w*u_scale, y0));
 
 	face.tile = tile;
 	
@@ -796,6 +802,22 @@ static void getTileInfo(
 	return;
 }
 
+/*
+	A run of equal faces along a row. With greedy meshing, equal runs of
+	the following rows of the same layer are merged into it, making it
+	a rectangle of width rows.
+*/
+struct FaceRun
+{
+	TileSpec tile;
+	u16 lights[4];
+	u8 light_source;
+	v3s16 p; // Corrected position of the first face
+	v3s16 face_dir; // Corrected face direction
+	u16 length; // Number of faces along the row
+	u16 width; // Number of rows
+};
+
 /*
 	startpos:
 	translate_dir: unit vector with only one of x, y or z
@@ -805,10 +827,8 @@ static void updateFastFaceRow(
 		MeshMakeData *data,
 		v3s16 startpos,
 		v3s16 translate_dir,
-		v3f translate_dir_f,
 		v3s16 face_dir,
-		v3f face_dir_f,
-		std::vector<FastFace> &dest)
+		std::vector<FaceRun> &dest)
 {
 	v3s16 p = startpos;
 	
@@ -824,6 +844,9 @@ static void updateFastFaceRow(
 			makes_face, p_corrected, face_dir_corrected,
 			lights, tile, light_source);
 
+	// Corrected position of the first face of the current run
+	v3s16 run_start = p_corrected;
+
 	for(u16 j=0; j<MAP_BLOCKSIZE; j++)
 	{
 		// If tiling can be done, this is set to false in the next step
@@ -862,29 +885,6 @@ static void updateFastFaceRow(
 			{
 				next_is_different = false;
 			}
-			else{
-				/*if(makes_face){
-					g_profiler->add("Meshgen: diff: next_makes_face != makes_face",
-							next_makes_face != makes_face ? 1 : 0);
-					g_profiler->add("Meshgen: diff: n_p_corr != p_corr + t_dir",
-							(next_p_corrected != p_corrected + translate_dir) ? 1 : 0);
-					g_profiler->add("Meshgen: diff: next_f_dir_corr != f_dir_corr",
-							next_face_dir_corrected != face_dir_corrected ? 1 : 0);
-					g_profiler->add("Meshgen: diff: next_lights[] != lights[]",
-							(next_lights[0] != lights[0] ||
-							next_lights[0] != lights[0] ||
-							next_lights[0] != lights[0] ||
-							next_lights[0] != lights[0]) ? 1 : 0);
-					g_profiler->add("Meshgen: diff: !(next_tile == tile)",
-							!(next_tile == tile) ? 1 : 0);
-				}*/
-			}
-			/*g_profiler->add("Meshgen: Total faces checked", 1);
-			if(makes_face)
-				g_profiler->add("Meshgen: Total makes_face checked", 1);*/
-		} else {
-			/*if(makes_face)
-				g_profiler->add("Meshgen: diff: last position", 1);*/
 		}
 
 		continuous_tiles_count++;
@@ -908,45 +908,27 @@ static void updateFastFaceRow(
 		if(next_is_different || end_of_texture)
 		{
 			/*
-				Create a face if there should be one
+				Create a run if there should be one
 			*/
 			if(makes_face)
 			{
-				// Floating point conversion of the position vector
-				v3f pf(p_corrected.X, p_corrected.Y, p_corrected.Z);
-				// Center point of face (kind of)
-				v3f sp = pf - ((f32)continuous_tiles_count / 2. - 0.5) * translate_dir_f;
-				if(continuous_tiles_count != 1)
-					sp += translate_dir_f;
-				v3f scale(1,1,1);
-
-				if(translate_dir.X != 0)
-				{
-					scale.X = continuous_tiles_count;
-				}
-				if(translate_dir.Y != 0)
-				{
-					scale.Y = continuous_tiles_count;
-				}
-				if(translate_dir.Z != 0)
-				{
-					scale.Z = continuous_tiles_count;
-				}
-				
-				makeFastFace(tile, lights[0], lights[1], lights[2], lights[3],
-						sp, face_dir_corrected, scale, light_source,
-						dest);
-				
-				g_profiler->avg("Meshgen: faces drawn by tiling", 0);
-				for(int i=1; i<continuous_tiles_count; i++){
-					g_profiler->avg("Meshgen: faces drawn by tiling", 1);
-				}
+				FaceRun run;
+				run.tile = tile;
+				run.lights[0] = lights[0];
+				run.lights[1] = lights[1];
+				run.lights[2] = lights[2];
+				run.lights[3] = lights[3];
+				run.light_source = light_source;
+				run.p = run_start;
+				run.face_dir = face_dir_corrected;
+				run.length = continuous_tiles_count;
+				run.width = 1;
+				dest.push_back(run);
 			}
 
 			continuous_tiles_count = 0;
 			
 			makes_face = next_makes_face;
-			p_corrected = next_p_corrected;
 			face_dir_corrected = next_face_dir_corrected;
 			lights[0] = next_lights[0];
 			lights[1] = next_lights[1];
@@ -954,58 +936,173 @@ static void updateFastFaceRow(
 			lights[3] = next_lights[3];
 			tile = next_tile;
 			light_source = next_light_source;
+			run_start = next_p_corrected;
 		}
 		
+		p_corrected = next_p_corrected;
 		p = p_next;
 	}
 }
 
+/*
+	Whether run b, found on the row after run a, continues it
+*/
+static bool faceRunContinues(const FaceRun &a, const FaceRun &b,
+		v3s16 row_dir)
+{
+	return (b.p == a.p + row_dir * a.width
+			&& b.face_dir == a.face_dir
+			&& b.length == a.length
+			&& b.lights[0] == a.lights[0]
+			&& b.lights[1] == a.lights[1]
+			&& b.lights[2] == a.lights[2]
+			&& b.lights[3] == a.lights[3]
+			&& b.light_source == a.light_source
+			&& b.tile == a.tile
+			&& b.tile.rotation == 0
+			// The texture has to repeat in both directions, which
+			// textures in the texture atlas don't do.
+			&& b.tile.texture.tiled == 0);
+}
+
+static void makeFaceRunFace(const FaceRun &run, v3s16 translate_dir,
+		v3s16 row_dir, std::vector<FastFace> &dest)
+{
+	v3f translate_dir_f(translate_dir.X, translate_dir.Y, translate_dir.Z);
+	v3f row_dir_f(row_dir.X, row_dir.Y, row_dir.Z);
+
+	// Center point of the face
+	v3f sp(run.p.X, run.p.Y, run.p.Z);
+	sp += translate_dir_f * ((f32)(run.length - 1) / 2.);
+	sp += row_dir_f * ((f32)(run.width - 1) / 2.);
+
+	v3f scale(1,1,1);
+	if(translate_dir.X != 0)
+		scale.X = run.length;
+	if(translate_dir.Y != 0)
+		scale.Y = run.length;
+	if(translate_dir.Z != 0)
+		scale.Z = run.length;
+	if(row_dir.X != 0)
+		scale.X = run.width;
+	if(row_dir.Y != 0)
+		scale.Y = run.width;
+	if(row_dir.Z != 0)
+		scale.Z = run.width;
+
+	makeFastFace(run.tile, run.lights[0], run.lights[1], run.lights[2],
+			run.lights[3], sp, run.face_dir, scale, run.light_source,
+			dest);
+
+	g_profiler->avg("Meshgen: faces drawn by tiling", 0);
+	for(int i=1; i<run.length * run.width; i++){
+		g_profiler->avg("Meshgen: faces drawn by tiling", 1);
+	}
+}
+
+/*
+	Makes the faces of the MAP_BLOCKSIZE rows starting at startpos and
+	following each other in row_dir.
+	If merge_rows is set, equal runs of faces on consecutive rows are
+	made into one face.
+*/
+static void updateFastFaceLayer(
+		MeshMakeData *data,
+		v3s16 startpos,
+		v3s16 translate_dir,
+		v3s16 row_dir,
+		v3s16 face_dir,
+		bool merge_rows,
+		std::vector<FastFace> &dest)
+{
+	// Runs that can still be continued by the next row
+	std::vector<FaceRun> open_runs;
+	std::vector<FaceRun> row_runs;
+	std::vector<FaceRun> next_open_runs;
+
+	for(s16 k=0; k<MAP_BLOCKSIZE; k++)
+	{
+		row_runs.clear();
+		updateFastFaceRow(data, startpos + row_dir * k,
+				translate_dir, face_dir, row_runs);
+
+		next_open_runs.clear();
+		for(u32 i=0; i<row_runs.size(); i++)
+		{
+			FaceRun &run = row_runs[i];
+			bool continued = false;
+			if(merge_rows)
+			{
+				for(std::vector<FaceRun>::iterator
+						j = open_runs.begin();
+						j != open_runs.end(); ++j)
+				{
+					if(!faceRunContinues(*j, run, row_dir))
+						continue;
+					j->width++;
+					next_open_runs.push_back(*j);
+					open_runs.erase(j);
+					continued = true;
+					break;
+				}
+			}
+			if(!continued)
+				next_open_runs.push_back(run);
+		}
+
+		// Whatever was not continued is finished
+		for(u32 i=0; i<open_runs.size(); i++)
+			makeFaceRunFace(open_runs[i], translate_dir, row_dir, dest);
+
+		open_runs.swap(next_open_runs);
+	}
+
+	for(u32 i=0; i<open_runs.size(); i++)
+		makeFaceRunFace(open_runs[i], translate_dir, row_dir, dest);
+}
+
 static void updateAllFastFaceRows(MeshMakeData *data,
 		std::vector<FastFace> &dest)
 {
+	bool merge_rows = g_settings->getBool("greedy_meshing");
+
 	/*
 		Go through every y,z and get top(y+) faces in rows of x+
 	*/
 	for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-		for(s16 z=0; z<MAP_BLOCKSIZE; z++){
-			updateFastFaceRow(data,
-					v3s16(0,y,z),
-					v3s16(1,0,0), //dir
-					v3f  (1,0,0),
-					v3s16(0,1,0), //face dir
-					v3f  (0,1,0),
-					dest);
-		}
+		updateFastFaceLayer(data,
+				v3s16(0,y,0),
+				v3s16(1,0,0), //dir
+				v3s16(0,0,1), //row dir
+				v3s16(0,1,0), //face dir
+				merge_rows,
+				dest);
 	}
 
 	/*
 		Go through every x,y and get right(x+) faces in rows of z+
 	*/
 	for(s16 x=0; x<MAP_BLOCKSIZE; x++){
-		for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-			updateFastFaceRow(data,
-					v3s16(x,y,0),
-					v3s16(0,0,1), //dir
-					v3f  (0,0,1),
-					v3s16(1,0,0), //face dir
-					v3f  (1,0,0),
-					dest);
-		}
+		updateFastFaceLayer(data,
+				v3s16(x,0,0),
+				v3s16(0,0,1), //dir
+				v3s16(0,1,0), //row dir
+				v3s16(1,0,0), //face dir
+				merge_rows,
+				dest);
 	}
 
 	/*
 		Go through every y,z and get back(z+) faces in rows of x+
 	*/
 	for(s16 z=0; z<MAP_BLOCKSIZE; z++){
-		for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-			updateFastFaceRow(data,
-					v3s16(0,y,z),
-					v3s16(1,0,0), //dir
-					v3f  (1,0,0),
-					v3s16(0,0,1), //face dir
-					v3f  (0,0,1),
-					dest);
-		}
+		updateFastFaceLayer(data,
+				v3s16(0,0,z),
+				v3s16(1,0,0), //dir
+				v3s16(0,1,0), //row dir
+				v3s16(0,0,1), //face dir
+				merge_rows,
+				dest);
 	}
 }
 
@@ -0,0 +1,380 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdbthread.h"
+#include "database.h"
+#include "debug.h"
+#include "log.h"
+#include "main.h" // for g_profiler
+#include "profiler.h"
+
+// Maximum number of blocks written in one transaction. The database is
+// locked for the whole transaction, so this bounds how long a block load
+// can be held up by the writer.
+#define MAPDB_WRITE_BATCH_SIZE 256
+// Time to wait before writing again after a batch has failed
+#define MAPDB_WRITE_RETRY_INTERVAL_MS 1000
+// Number of failed batches after which flush() gives up
+#define MAPDB_FLUSH_MAX_FAILURES 3
+// Maximum number of blocks waiting to be read ahead. The oldest requests
+// are dropped first; whoever asked for them has probably moved on.
+#define MAPDB_PREFETCH_QUEUE_SIZE 512
+// Maximum number of blocks kept in the read-ahead cache
+#define MAPDB_READ_CACHE_SIZE 512
+// Blocks read ahead that haven't been loaded in this time are dropped
+#define MAPDB_READ_CACHE_TIMEOUT_MS 30000
+
+MapDatabaseThread::MapDatabaseThread(MapDatabase *database):
+	SimpleThread(),
+	m_write_failing(false),
+	m_write_fail_time(0),
+	m_failed_batch_count(0),
+	m_triggered(false),
+	m_flush_waiters(0),
+	m_database(database)
+{
+	m_queue_mutex.Init();
+	m_db_mutex.Init();
+}
+
+MapDatabaseThread::~MapDatabaseThread()
+{
+	if(!flush())
+	{
+		errorstream<<"MapDatabaseThread: "<<getQueuedCount()
+				<<" blocks could not be saved"<<std::endl;
+	}
+
+	setRun(false);
+	m_event.signal();
+	stop();
+
+	delete m_database;
+}
+
+void MapDatabaseThread::trigger()
+{
+	if(m_triggered)
+		return;
+	m_triggered = true;
+	if(IsRunning() == false)
+	{
+		setRun(true);
+		Start();
+	}
+	m_event.signal();
+}
+
+void *MapDatabaseThread::Thread()
+{
+	ThreadStarted();
+	log_register_thread("MapDatabaseThread");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		// Wake up to retry failed writes even if nothing else happens
+		if(m_write_failing)
+			m_event.wait(MAPDB_WRITE_RETRY_INTERVAL_MS);
+		else
+			m_event.wait();
+		{
+			// Whatever is queued from now on needs a new signal
+			JMutexAutoLock lock(m_queue_mutex);
+			m_triggered = false;
+		}
+
+		// Reads go first, somebody is probably going to need them soon
+		readAhead();
+
+		if(m_write_failing && porting::getTimeMs() - m_write_fail_time
+				< MAPDB_WRITE_RETRY_INTERVAL_MS)
+			continue;
+		while(writeBatch())
+			;
+
+		JMutexAutoLock lock(m_queue_mutex);
+		for(; m_flush_waiters > 0; m_flush_waiters--)
+			m_flushed_event.signal();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	log_deregister_thread();
+	return NULL;
+}
+
+void MapDatabaseThread::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	m_writes_queued[blockpos] = data;
+	// Whatever was read ahead is outdated now
+	m_read_cache.erase(blockpos);
+	trigger();
+}
+
+bool MapDatabaseThread::loadBlock(v3s16 blockpos, std::string *data)
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		std::map<v3s16, std::string>::iterator i;
+
+		i = m_writes_queued.find(blockpos);
+		if(i != m_writes_queued.end())
+		{
+			*data = i->second;
+			return true;
+		}
+		i = m_writes_in_flight.find(blockpos);
+		if(i != m_writes_in_flight.end())
+		{
+			*data = i->second;
+			return true;
+		}
+		std::map<v3s16, ReadCacheEntry>::iterator j =
+				m_read_cache.find(blockpos);
+		if(j != m_read_cache.end())
+		{
+			// The block will be in memory from now on
+			data->swap(j->second.data);
+			m_read_cache.erase(j);
+			g_profiler->add("MapDatabaseThread: read-ahead hits", 1);
+			return true;
+		}
+		// No use reading it ahead anymore
+		m_prefetch_queued.erase(blockpos);
+	}
+
+	JMutexAutoLock dblock(m_db_mutex);
+	return m_database->loadBlock(blockpos, data);
+}
+
+void MapDatabaseThread::prefetchBlock(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	if(m_prefetch_queued.find(blockpos) != m_prefetch_queued.end() ||
+			m_read_cache.find(blockpos) != m_read_cache.end())
+		return;
+	if(m_prefetch_queue.size() >= MAPDB_PREFETCH_QUEUE_SIZE)
+	{
+		m_prefetch_queued.erase(m_prefetch_queue.front());
+		m_prefetch_queue.pop_front();
+	}
+	m_prefetch_queue.push_back(blockpos);
+	m_prefetch_queued.insert(blockpos);
+	trigger();
+}
+
+bool MapDatabaseThread::flush()
+{
+	u32 failed_batch_count_start;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		failed_batch_count_start = m_failed_batch_count;
+	}
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_writes_queued.empty() && m_writes_in_flight.empty())
+				return true;
+			if(m_failed_batch_count - failed_batch_count_start
+					>= MAPDB_FLUSH_MAX_FAILURES)
+				return false;
+			// Have the thread write it all and wait until it has tried
+			m_flush_waiters++;
+			trigger();
+		}
+		m_flushed_event.wait();
+	}
+}
+
+u32 MapDatabaseThread::getQueuedCount()
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	return m_writes_queued.size() + m_writes_in_flight.size();
+}
+
+bool MapDatabaseThread::compact()
+{
+	if(!flush())
+		return false;
+
+	JMutexAutoLock dblock(m_db_mutex);
+	m_database->compact();
+	return true;
+}
+
+void MapDatabaseThread::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	flush();
+
+	JMutexAutoLock dblock(m_db_mutex);
+	m_database->listAllLoadableBlocks(dst);
+}
+
+bool MapDatabaseThread::exists()
+{
+	JMutexAutoLock dblock(m_db_mutex);
+	return m_database->exists();
+}
+
+void MapDatabaseThread::readAhead()
+{
+	for(;;)
+	{
+		v3s16 p;
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_prefetch_queue.empty())
+				return;
+			p = m_prefetch_queue.front();
+			m_prefetch_queue.pop_front();
+			// Skip it if it has been loaded already
+			if(m_prefetch_queued.erase(p) == 0)
+				continue;
+			if(m_read_cache.find(p) != m_read_cache.end() ||
+					m_writes_queued.find(p) != m_writes_queued.end() ||
+					m_writes_in_flight.find(p) != m_writes_in_flight.end())
+				continue;
+		}
+
+		std::string data;
+		{
+			JMutexAutoLock dblock(m_db_mutex);
+			if(!m_database->loadBlock(p, &data))
+				continue;
+		}
+
+		/*
+			Writes are only done by this thread, so no write of this
+			block can have been committed since. A newly queued one
+			takes precedence over what was read.
+		*/
+		JMutexAutoLock lock(m_queue_mutex);
+		if(m_writes_queued.find(p) == m_writes_queued.end())
+		{
+			expireReadCache();
+			ReadCacheEntry &entry = m_read_cache[p];
+			entry.data.swap(data);
+			entry.time = porting::getTimeMs();
+		}
+	}
+}
+
+void MapDatabaseThread::expireReadCache()
+{
+	u32 time_now = porting::getTimeMs();
+	std::map<v3s16, ReadCacheEntry>::iterator oldest = m_read_cache.end();
+	for(std::map<v3s16, ReadCacheEntry>::iterator
+			i = m_read_cache.begin(); i != m_read_cache.end();)
+	{
+		if(time_now - i->second.time >= MAPDB_READ_CACHE_TIMEOUT_MS)
+		{
+			m_read_cache.erase(i++);
+			g_profiler->add("MapDatabaseThread: read-ahead expired", 1);
+			continue;
+		}
+		if(oldest == m_read_cache.end() ||
+				time_now - i->second.time > time_now - oldest->second.time)
+			oldest = i;
+		++i;
+	}
+	if(m_read_cache.size() >= MAPDB_READ_CACHE_SIZE)
+	{
+		m_read_cache.erase(oldest);
+		g_profiler->add("MapDatabaseThread: read-ahead expired", 1);
+	}
+}
+
+bool MapDatabaseThread::writeBatch()
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		if(m_writes_queued.empty())
+			return false;
+
+		std::map<v3s16, std::string>::iterator i = m_writes_queued.begin();
+		for(u32 n = 0; n < MAPDB_WRITE_BATCH_SIZE &&
+				i != m_writes_queued.end(); n++)
+		{
+			m_writes_in_flight[i->first].swap(i->second);
+			m_writes_queued.erase(i++);
+		}
+	}
+
+	/*
+		m_writes_in_flight is only modified by this thread, so it can
+		be read without the queue lock.
+	*/
+	u32 count = 0;
+	std::set<v3s16> failed;
+	bool committed;
+	{
+		ScopeProfiler sp(g_profiler, "MapDatabaseThread: write batch", SPT_AVG);
+		JMutexAutoLock dblock(m_db_mutex);
+
+		committed = m_database->beginSave();
+		if(committed)
+		{
+			for(std::map<v3s16, std::string>::iterator
+					i = m_writes_in_flight.begin();
+					i != m_writes_in_flight.end(); ++i)
+			{
+				if(m_database->saveBlock(i->first, i->second))
+					count++;
+				else
+					failed.insert(i->first);
+			}
+			committed = m_database->endSave();
+		}
+	}
+
+	JMutexAutoLock lock(m_queue_mutex);
+	if(committed)
+		g_profiler->add("MapDatabaseThread: blocks written", count);
+
+	/*
+		Put back what didn't make it into the database. A version queued
+		while this one was being written is newer, so it is kept instead.
+	*/
+	for(std::map<v3s16, std::string>::iterator
+			i = m_writes_in_flight.begin();
+			i != m_writes_in_flight.end(); ++i)
+	{
+		if(committed && failed.find(i->first) == failed.end())
+			continue;
+		if(m_writes_queued.find(i->first) == m_writes_queued.end())
+			m_writes_queued[i->first].swap(i->second);
+	}
+	m_writes_in_flight.clear();
+
+	if(!committed || !failed.empty())
+	{
+		m_failed_batch_count++;
+		m_write_failing = true;
+		m_write_fail_time = porting::getTimeMs();
+		errorstream<<"MapDatabaseThread: Failed to write blocks, "
+				<<m_writes_queued.size()<<" blocks waiting to be "
+				<<"written; retrying"<<std::endl;
+		return false;
+	}
+	m_write_failing = false;
+	return true;
+}
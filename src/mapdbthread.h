@@ -0,0 +1,134 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDBTHREAD_HEADER
+#define MAPDBTHREAD_HEADER
+
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include "irr_v3d.h"
+#include "porting.h"
+#include "util/container.h"
+#include "util/thread.h"
+
+class MapDatabase;
+
+/*
+	Does the MapDatabase I/O of a ServerMap in its own thread.
+
+	Saved blocks are queued as serialized data and written behind in
+	batched transactions, so saving doesn't stall whoever holds the
+	environment lock. Blocks that will probably be loaded soon can be
+	read ahead into a cache.
+
+	Queued and in-flight writes are visible to loadBlock(), so the map
+	always reads back what it has saved. Blocks that fail to be written
+	go back to the queue and are retried, so the data isn't lost while
+	the server is running.
+*/
+class MapDatabaseThread : public SimpleThread
+{
+public:
+	// Takes ownership of the database
+	MapDatabaseThread(MapDatabase *database);
+	~MapDatabaseThread();
+
+	void *Thread();
+
+	// Queue a serialized block to be written. Replaces an older
+	// queued version of the same block.
+	void saveBlock(v3s16 blockpos, const std::string &data);
+	// Get a serialized block. Returns false if it is not in the database.
+	bool loadBlock(v3s16 blockpos, std::string *data);
+	// Read a block into the cache in the background
+	void prefetchBlock(v3s16 blockpos);
+	// Wait until all queued writes have been committed. Returns false
+	// if writing keeps failing; the blocks stay queued then.
+	bool flush();
+	// Number of blocks waiting to be written
+	u32 getQueuedCount();
+	// Flush and compact the database, see MapDatabase::compact().
+	// Returns false if flushing failed.
+	bool compact();
+
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	// See MapDatabase::exists()
+	bool exists();
+
+private:
+	// Wake up the thread unless it has been woken up already and hasn't
+	// looked at the queues yet. Call with m_queue_mutex locked.
+	void trigger();
+	// Write out a batch of queued blocks in one transaction. Returns
+	// false if there was nothing to write or the batch failed.
+	bool writeBatch();
+	void readAhead();
+	// Make room in m_read_cache for one more block
+	void expireReadCache();
+
+	Event m_event;
+	// Signaled once for each flush() waiting when the thread has
+	// written what it could
+	Event m_flushed_event;
+
+	// Whether the last batch failed, and when; only used by the thread,
+	// which does all the writing
+	bool m_write_failing;
+	u32 m_write_fail_time;
+
+	struct ReadCacheEntry
+	{
+		std::string data;
+		// porting::getTimeMs() when it was read
+		u32 time;
+	};
+
+	/*
+		Queues; protected by m_queue_mutex.
+		A block being written is moved from m_writes_queued to
+		m_writes_in_flight until its transaction has been committed.
+		If it fails, it is moved back unless a newer version has been
+		queued meanwhile.
+	*/
+	JMutex m_queue_mutex;
+	std::map<v3s16, std::string> m_writes_queued;
+	std::map<v3s16, std::string> m_writes_in_flight;
+	// Number of batches that have failed
+	u32 m_failed_batch_count;
+	// Whether m_event has been signaled since the thread last woke up
+	bool m_triggered;
+	// Number of flush() calls waiting for m_flushed_event
+	u32 m_flush_waiters;
+	// Blocks to read ahead, oldest first. A block that is loaded before
+	// it has been read ahead is removed from m_prefetch_queued only.
+	std::list<v3s16> m_prefetch_queue;
+	std::set<v3s16> m_prefetch_queued;
+	std::map<v3s16, ReadCacheEntry> m_read_cache;
+
+	/*
+		The database; protected by m_db_mutex
+	*/
+	JMutex m_db_mutex;
+	MapDatabase *m_database;
+};
+
+#endif
+
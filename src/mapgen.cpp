@@ -73,7 +73,6 @@ Ore *createOre(OreType type) {
 
 Ore::~Ore() {
 	delete np;
-	delete noise;
 }
 
 
@@ -171,18 +170,17 @@ void OreSheet::generate(ManualMapVoxelManipulator *vm, int seed,
 	int max_height = clust_size;
 	int y_start = pr.range(nmin.Y, nmax.Y - max_height);
 	
-	if (!noise) {
-		int sx = nmax.X - nmin.X + 1;
-		int sz = nmax.Z - nmin.Z + 1;
-		noise = new Noise(np, 0, sx, sz);
-	}
-	noise->seed = seed + y_start;
-	noise->perlinMap2D(nmin.X, nmin.Z);
+	// Ores are shared between all emerge threads, so the noise buffer
+	// can't be cached on the ore itself
+	int sx = nmax.X - nmin.X + 1;
+	int sz = nmax.Z - nmin.Z + 1;
+	Noise noise(np, seed + y_start, sx, sz);
+	noise.perlinMap2D(nmin.X, nmin.Z);
 	
 	int index = 0;
 	for (int z = nmin.Z; z <= nmax.Z; z++)
 	for (int x = nmin.X; x <= nmax.X; x++) {
-		float noiseval = noise->result[index++];
+		float noiseval = noise.result[index++];
 		if (noiseval < nthresh)
 			continue;
 			
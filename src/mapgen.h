@@ -135,13 +135,11 @@ class Ore {
 	u32 flags;          // attributes for this ore
 	float nthresh;      // threshhold for noise at which an ore is placed 
 	NoiseParams *np;    // noise for distribution of clusters (NULL for uniform scattering)
-	Noise *noise;
 	
 	Ore() {
 		ore     = CONTENT_IGNORE;
 		wherein = CONTENT_IGNORE;
 		np      = NULL;
-		noise   = NULL;
 	}
 	
 	virtual ~Ore();
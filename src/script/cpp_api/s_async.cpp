@@ -0,0 +1,315 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+}
+
+#include "cpp_api/s_async.h"
+#include "common/c_types.h"
+#include "debug.h"
+#include "filesys.h"
+#include "log.h"
+#include "porting.h"
+#include "main.h" // for g_profiler
+#include "profiler.h"
+
+// How long an idle worker sleeps before checking whether it should quit
+#define ASYNC_WORKER_IDLE_WAIT_MS 500
+
+static int async_ErrorHandler(lua_State *L)
+{
+	lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+	if(!lua_istable(L, -1)){
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_getfield(L, -1, "traceback");
+	if(!lua_isfunction(L, -1)){
+		lua_pop(L, 2);
+		return 1;
+	}
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 2);
+	lua_call(L, 2, 1);
+	return 1;
+}
+
+/*
+	AsyncWorkerThread
+*/
+
+AsyncWorkerThread::AsyncWorkerThread(AsyncEngine *engine,
+		const std::string &builtinpath, u32 index):
+	SimpleThread(),
+	m_engine(engine),
+	m_builtinpath(builtinpath),
+	m_index(index),
+	m_luastack(NULL)
+{
+}
+
+AsyncWorkerThread::~AsyncWorkerThread()
+{
+	setRun(false);
+	stop();
+	if(m_luastack)
+		lua_close(m_luastack);
+}
+
+bool AsyncWorkerThread::initializeState()
+{
+	m_luastack = luaL_newstate();
+	if(m_luastack == NULL)
+		return false;
+	lua_State *L = m_luastack;
+
+	luaL_openlibs(L);
+
+	lua_newtable(L);
+	lua_setglobal(L, "minetest");
+
+	const char *files[] = {"serialize.lua", "async_env.lua"};
+	for(u32 i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+	{
+		std::string path = m_builtinpath + DIR_DELIM + files[i];
+		if(luaL_loadfile(L, path.c_str()) || lua_pcall(L, 0, 0, 0))
+		{
+			errorstream<<"AsyncWorkerThread: Failed to load "<<path
+					<<": "<<lua_tostring(L, -1)<<std::endl;
+			lua_close(L);
+			m_luastack = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+void *AsyncWorkerThread::Thread()
+{
+	ThreadStarted();
+	log_register_thread("AsyncWorkerThread");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	if(m_luastack == NULL && !initializeState())
+	{
+		errorstream<<"AsyncWorkerThread "<<m_index
+				<<": Lua environment not available, quitting"<<std::endl;
+		setRun(false);
+	}
+
+	while(getRun())
+	{
+		AsyncJob job;
+		if(!m_engine->getJob(&job))
+		{
+			m_engine->m_job_event.wait(ASYNC_WORKER_IDLE_WAIT_MS);
+			continue;
+		}
+		runJob(job);
+		m_engine->putResult(job);
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	log_deregister_thread();
+	return NULL;
+}
+
+void AsyncWorkerThread::runJob(AsyncJob &job)
+{
+	ScopeProfiler sp(g_profiler, "Scriptapi: async job", SPT_AVG);
+	lua_State *L = m_luastack;
+	int top = lua_gettop(L);
+
+	lua_pushcfunction(L, async_ErrorHandler);
+	int errorhandler = lua_gettop(L);
+
+	lua_getglobal(L, "minetest");
+	lua_getfield(L, -1, "async_job_handler");
+	lua_remove(L, -2);
+	lua_pushlstring(L, job.function.c_str(), job.function.size());
+	lua_pushlstring(L, job.params.c_str(), job.params.size());
+	if(lua_pcall(L, 2, 1, errorhandler))
+	{
+		const char *msg = lua_tostring(L, -1);
+		job.failed = true;
+		job.result = msg ? msg : "(error object is not a string)";
+	}
+	else
+	{
+		size_t len = 0;
+		const char *s = lua_tolstring(L, -1, &len);
+		if(s)
+		{
+			job.result.assign(s, len);
+		}
+		else
+		{
+			job.failed = true;
+			job.result = "async_job_handler didn't return a string";
+		}
+	}
+	job.function.clear();
+	job.params.clear();
+
+	lua_settop(L, top);
+	// Jobs produce a lot of short-lived garbage; don't let it pile up
+	// while the worker is idle
+	lua_gc(L, LUA_GCSTEP, 0);
+}
+
+/*
+	AsyncEngine
+*/
+
+AsyncEngine::AsyncEngine():
+	m_next_job_id(1),
+	m_jobs_running(0)
+{
+	m_jobs_mutex.Init();
+	m_results_mutex.Init();
+}
+
+AsyncEngine::~AsyncEngine()
+{
+	stop();
+}
+
+void AsyncEngine::initialize(const std::string &builtinpath, u32 num_threads)
+{
+	if(num_threads == 0)
+		num_threads = 1;
+	infostream<<"AsyncEngine: Starting "<<num_threads
+			<<" Lua worker threads"<<std::endl;
+	for(u32 i = 0; i < num_threads; i++)
+	{
+		AsyncWorkerThread *worker =
+				new AsyncWorkerThread(this, builtinpath, i);
+		m_workers.push_back(worker);
+		worker->setRun(true);
+		worker->Start();
+	}
+}
+
+void AsyncEngine::stop()
+{
+	for(u32 i = 0; i < m_workers.size(); i++)
+		m_workers[i]->setRun(false);
+	for(u32 i = 0; i < m_workers.size(); i++)
+		m_job_event.signal();
+	for(u32 i = 0; i < m_workers.size(); i++)
+		delete m_workers[i];
+	m_workers.clear();
+
+	JMutexAutoLock lock(m_jobs_mutex);
+	m_jobs.clear();
+}
+
+u32 AsyncEngine::queueJob(const std::string &function,
+		const std::string &params)
+{
+	u32 id;
+	{
+		JMutexAutoLock lock(m_jobs_mutex);
+		AsyncJob job;
+		job.id = m_next_job_id++;
+		job.function = function;
+		job.params = params;
+		m_jobs.push_back(job);
+		id = job.id;
+	}
+	m_job_event.signal();
+	return id;
+}
+
+bool AsyncEngine::getJob(AsyncJob *job)
+{
+	JMutexAutoLock lock(m_jobs_mutex);
+	if(m_jobs.empty())
+		return false;
+	*job = m_jobs.front();
+	m_jobs.pop_front();
+	m_jobs_running++;
+	/*
+		On Windows the event doesn't count its signals, so pass one on
+		in case several jobs were queued while the workers were busy.
+	*/
+	if(!m_jobs.empty())
+		m_job_event.signal();
+	return true;
+}
+
+void AsyncEngine::putResult(const AsyncJob &job)
+{
+	{
+		JMutexAutoLock lock(m_results_mutex);
+		m_results.push_back(job);
+	}
+	JMutexAutoLock lock(m_jobs_mutex);
+	m_jobs_running--;
+}
+
+u32 AsyncEngine::getPendingCount()
+{
+	JMutexAutoLock lock(m_jobs_mutex);
+	return m_jobs.size() + m_jobs_running;
+}
+
+void AsyncEngine::step(lua_State *L)
+{
+	for(;;)
+	{
+		AsyncJob job;
+		{
+			JMutexAutoLock lock(m_results_mutex);
+			if(m_results.empty())
+				return;
+			job = m_results.front();
+			m_results.pop_front();
+		}
+
+		// minetest.async_event_handler(jobid, serialized_retval, error)
+		lua_getglobal(L, "minetest");
+		lua_getfield(L, -1, "async_event_handler");
+		lua_remove(L, -2);
+		if(lua_type(L, -1) != LUA_TFUNCTION)
+		{
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_pushnumber(L, job.id);
+		if(job.failed)
+		{
+			lua_pushnil(L);
+			lua_pushlstring(L, job.result.c_str(), job.result.size());
+		}
+		else
+		{
+			lua_pushlstring(L, job.result.c_str(), job.result.size());
+			lua_pushnil(L);
+		}
+		if(lua_pcall(L, 3, 0, 0))
+			throw LuaError(L, std::string("error: ")
+					+ lua_tostring(L, -1));
+	}
+}
@@ -0,0 +1,129 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef S_ASYNC_H_
+#define S_ASYNC_H_
+
+#include <string>
+#include <list>
+#include <vector>
+
+#include "irrlichttypes.h"
+#include "jmutex.h"
+#include "jmutexautolock.h"
+#include "porting.h"
+#include "util/container.h"
+#include "util/thread.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+class AsyncEngine;
+
+struct AsyncJob
+{
+	AsyncJob():
+		id(0),
+		failed(false)
+	{}
+
+	u32 id;
+	// Function dumped with string.dump()
+	std::string function;
+	// Arguments serialized with minetest.serialize()
+	std::string params;
+	// Serialized return values, or the error message if failed
+	std::string result;
+	bool failed;
+};
+
+/*
+	A worker with its own lua_State. It only has the standard libraries
+	and builtin/async_env.lua loaded, so the jobs can't touch the server.
+*/
+class AsyncWorkerThread : public SimpleThread
+{
+public:
+	AsyncWorkerThread(AsyncEngine *engine, const std::string &builtinpath,
+			u32 index);
+	~AsyncWorkerThread();
+
+	void *Thread();
+
+private:
+	bool initializeState();
+	void runJob(AsyncJob &job);
+
+	AsyncEngine *m_engine;
+	std::string m_builtinpath;
+	u32 m_index;
+	lua_State *m_luastack;
+};
+
+/*
+	Runs pure Lua functions on a pool of worker threads.
+
+	Jobs are queued from the main Lua state by minetest.handle_async().
+	The results are collected and passed to the callbacks from step(),
+	which is called on the server thread like any other script callback.
+*/
+class AsyncEngine
+{
+public:
+	AsyncEngine();
+	~AsyncEngine();
+
+	// Start num_threads workers loading their environment from builtinpath
+	void initialize(const std::string &builtinpath, u32 num_threads);
+	// Stop the workers. Jobs that haven't been run are dropped.
+	void stop();
+
+	// Queue a job and return its id
+	u32 queueJob(const std::string &function, const std::string &params);
+
+	// Pass the finished jobs to minetest.async_event_handler
+	void step(lua_State *L);
+
+	// Number of jobs queued or being run
+	u32 getPendingCount();
+
+private:
+	friend class AsyncWorkerThread;
+
+	// Called by the workers
+	bool getJob(AsyncJob *job);
+	void putResult(const AsyncJob &job);
+
+	std::vector<AsyncWorkerThread*> m_workers;
+	Event m_job_event;
+
+	// Protected by m_jobs_mutex
+	JMutex m_jobs_mutex;
+	u32 m_next_job_id;
+	std::list<AsyncJob> m_jobs;
+	u32 m_jobs_running;
+
+	// Protected by m_results_mutex
+	JMutex m_results_mutex;
+	std::list<AsyncJob> m_results;
+};
+
+#endif /* S_ASYNC_H_ */
@@ -41,6 +41,19 @@ ScriptApiBase::ScriptApiBase() :
 
 }
 
+void ScriptApiBase::initializeAsync(const std::string &builtinpath,
+		u32 num_threads)
+{
+	m_async.initialize(builtinpath, num_threads);
+}
+
+void ScriptApiBase::stepAsync()
+{
+	SCRIPTAPI_PRECHECKHEADER
+
+	m_async.step(L);
+}
+
 
 void ScriptApiBase::realityCheck()
 {
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "jmutex.h"
 #include "jmutexautolock.h"
 #include "common/c_types.h"
+#include "cpp_api/s_async.h"
 #include "debug.h"
 
 #define LOCK_DEBUG
@@ -82,6 +83,12 @@ class ScriptApiBase {
 
 	ScriptApiBase();
 
+	/* async jobs */
+	// Start the worker threads of minetest.handle_async()
+	void initializeAsync(const std::string &builtinpath, u32 num_threads);
+	// Run the callbacks of finished async jobs
+	void stepAsync();
+
 protected:
 	friend class LuaABM;
 	friend class InvRef;
@@ -116,6 +123,8 @@ class ScriptApiBase {
 	void objectrefGetOrCreate(ServerActiveObject *cobj);
 	void objectrefGet(u16 id);
 
+	AsyncEngine		m_async;
+
 	JMutex			m_luastackmutex;
 #ifdef LOCK_DEBUG
 	bool            m_locked;
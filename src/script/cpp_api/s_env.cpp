@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include "environment.h"
 #include "lua_api/l_env.h"
+#include <sstream>
 
 extern "C" {
 #include "lauxlib.h"
@@ -119,7 +120,15 @@ void ScriptApiEnv::initializeEnvironment(ServerEnvironment *env)
 			int trigger_chance = 50;
 			getintfield(L, current_abm, "chance", trigger_chance);
 
-			LuaABM *abm = new LuaABM(L, id, trigger_contents,
+			// Name shown in the profiler
+			std::ostringstream os(std::ios::binary);
+			os<<"#"<<id;
+			if(!trigger_contents.empty())
+				os<<" ("<<*trigger_contents.begin()<<")";
+			std::string name = os.str();
+			getstringfield(L, current_abm, "label", name);
+
+			LuaABM *abm = new LuaABM(L, id, name, trigger_contents,
 					required_neighbors, trigger_interval, trigger_chance);
 
 			env->addActiveBlockModifier(abm);
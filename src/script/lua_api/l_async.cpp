@@ -0,0 +1,58 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "cpp_api/scriptapi.h"
+#include "lua_api/l_base.h"
+#include "lua_api/l_async.h"
+#include "common/c_internal.h"
+
+bool ModApiAsync::Initialize(lua_State *L, int top) {
+	bool retval = true;
+
+	retval &= API_FCT(do_async_callback);
+	retval &= API_FCT(get_async_pending_count);
+
+	return retval;
+}
+
+// do_async_callback(dumped_function, serialized_params) -> jobid
+int ModApiAsync::l_do_async_callback(lua_State *L)
+{
+	size_t function_len = 0;
+	size_t params_len = 0;
+	const char *function = luaL_checklstring(L, 1, &function_len);
+	const char *params = luaL_checklstring(L, 2, &params_len);
+
+	u32 jobid = getAsyncEngine(L)->queueJob(
+			std::string(function, function_len),
+			std::string(params, params_len));
+
+	lua_pushnumber(L, jobid);
+	return 1;
+}
+
+// get_async_pending_count()
+int ModApiAsync::l_get_async_pending_count(lua_State *L)
+{
+	lua_pushnumber(L, getAsyncEngine(L)->getPendingCount());
+	return 1;
+}
+
+ModApiAsync modapiasync_prototype;
@@ -0,0 +1,43 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef L_ASYNC_H_
+#define L_ASYNC_H_
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+#include "lua_api/l_base.h"
+
+class ModApiAsync : public ModApiBase {
+public:
+	bool Initialize(lua_State *L, int top);
+private:
+	// do_async_callback(dumped_function, serialized_params) -> jobid
+	// Use minetest.handle_async() instead of calling this directly
+	static int l_do_async_callback(lua_State *L);
+
+	// get_async_pending_count() -> number of jobs not finished yet
+	static int l_get_async_pending_count(lua_State *L);
+};
+
+#endif /* L_ASYNC_H_ */
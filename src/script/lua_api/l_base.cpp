@@ -38,6 +38,10 @@ Environment* ModApiBase::getEnv(lua_State* L) {
 	return get_scriptapi(L)->getEnv();
 }
 
+AsyncEngine* ModApiBase::getAsyncEngine(lua_State* L) {
+	return &get_scriptapi(L)->m_async;
+}
+
 bool ModApiBase::registerFunction(	lua_State* L,
 								const char* name,
 								lua_CFunction fct,
@@ -32,6 +32,7 @@ extern struct EnumString es_BiomeTerrainType[];
 class ScriptApi;
 class Server;
 class Environment;
+class AsyncEngine;
 
 typedef class ModApiBase {
 
@@ -44,6 +45,7 @@ typedef class ModApiBase {
 protected:
 	static Server* getServer(      lua_State* L);
 	static Environment* getEnv(    lua_State* L);
+	static AsyncEngine* getAsyncEngine(lua_State* L);
 	static bool registerFunction(	lua_State* L,
 									const char* name,
 									lua_CFunction fct,
@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "lua_api/l_nodemeta.h"
 #include "lua_api/l_nodetimer.h"
 #include "lua_api/l_noise.h"
+#include "lua_api/l_vmanip.h"
 #include "treegen.h"
 #include "pathfinder.h"
 
@@ -472,25 +473,55 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 		ndef->getIds(lua_tostring(L, 3), filter);
 	}
 
-	// Get the table insert function
-	lua_getglobal(L, "table");
-	lua_getfield(L, -1, "insert");
-	int table_insert = lua_gettop(L);
-
 	lua_newtable(L);
 	int table = lua_gettop(L);
-	for(s16 x=minp.X; x<=maxp.X; x++)
-	for(s16 y=minp.Y; y<=maxp.Y; y++)
-	for(s16 z=minp.Z; z<=maxp.Z; z++)
+	int i = 0;
+	if(filter.empty())
+		return 1;
+
+	/*
+		Go through the area one MapBlock at a time, skipping the blocks
+		that don't contain any of the wanted nodes.
+		Nonexistent blocks read as CONTENT_IGNORE.
+	*/
+	Map &map = env->getMap();
+	bool want_ignore = (filter.count(CONTENT_IGNORE) != 0);
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	for(s16 bz=bpmin.Z; bz<=bpmax.Z; bz++)
+	for(s16 by=bpmin.Y; by<=bpmax.Y; by++)
+	for(s16 bx=bpmin.X; bx<=bpmax.X; bx++)
 	{
-		v3s16 p(x,y,z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0){
-			lua_pushvalue(L, table_insert);
-			lua_pushvalue(L, table);
-			push_v3s16(L, p);
-			if(lua_pcall(L, 2, 0, 0))
-				script_error(L, "error: %s", lua_tostring(L, -1));
+		v3s16 bp(bx,by,bz);
+		MapBlock *block = map.getBlockNoCreateNoEx(bp);
+		if(block && block->isDummy())
+			block = NULL;
+		if(block == NULL && !want_ignore)
+			continue;
+		if(block && !block->containsAnyContent(filter))
+			continue;
+
+		// Part of the area inside this block
+		v3s16 blockmin = bp * MAP_BLOCKSIZE;
+		v3s16 pmin(MYMAX(minp.X, blockmin.X), MYMAX(minp.Y, blockmin.Y),
+				MYMAX(minp.Z, blockmin.Z));
+		v3s16 pmax(
+				MYMIN(maxp.X, blockmin.X + MAP_BLOCKSIZE - 1),
+				MYMIN(maxp.Y, blockmin.Y + MAP_BLOCKSIZE - 1),
+				MYMIN(maxp.Z, blockmin.Z + MAP_BLOCKSIZE - 1));
+
+		for(s16 x=pmin.X; x<=pmax.X; x++)
+		for(s16 y=pmin.Y; y<=pmax.Y; y++)
+		for(s16 z=pmin.Z; z<=pmax.Z; z++)
+		{
+			v3s16 p(x,y,z);
+			content_t c = CONTENT_IGNORE;
+			if(block)
+				c = block->getNodeNoCheck(p - blockmin).getContent();
+			if(filter.count(c) != 0){
+				push_v3s16(L, p);
+				lua_rawseti(L, table, ++i);
+			}
 		}
 	}
 	return 1;
@@ -533,6 +564,16 @@ int ModApiEnvMod::l_get_perlin_map(lua_State *L)
 	return 1;
 }
 
+// minetest.get_voxel_manip()
+// returns a VoxelManip for bulk reads and writes of the map
+int ModApiEnvMod::l_get_voxel_manip(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	return LuaVoxelManip::create_object(L, &env->getServerMap(),
+			env->getGameDef()->ndef());
+}
+
 // minetest.clear_objects()
 // clear all objects in the environment
 int ModApiEnvMod::l_clear_objects(lua_State *L)
@@ -678,6 +719,7 @@ bool ModApiEnvMod::Initialize(lua_State *L,int top)
 	retval &= API_FCT(find_nodes_in_area);
 	retval &= API_FCT(get_perlin);
 	retval &= API_FCT(get_perlin_map);
+	retval &= API_FCT(get_voxel_manip);
 	retval &= API_FCT(clear_objects);
 	retval &= API_FCT(spawn_tree);
 	retval &= API_FCT(find_path);
@@ -110,6 +110,10 @@ class ModApiEnvMod
 	// returns world-specific PerlinNoiseMap
 	static int l_get_perlin_map(lua_State *L);
 
+	// minetest.get_voxel_manip()
+	// returns a VoxelManip for bulk reads and writes of the map
+	static int l_get_voxel_manip(lua_State *L);
+
 	// minetest.clear_objects()
 	// clear all objects in the environment
 	static int l_clear_objects(lua_State *L);
@@ -132,17 +136,19 @@ class LuaABM : public ActiveBlockModifier
 {
 private:
 	int m_id;
+	std::string m_name;
 
 	std::set<std::string> m_trigger_contents;
 	std::set<std::string> m_required_neighbors;
 	float m_trigger_interval;
 	u32 m_trigger_chance;
 public:
-	LuaABM(lua_State *L, int id,
+	LuaABM(lua_State *L, int id, const std::string &name,
 			const std::set<std::string> &trigger_contents,
 			const std::set<std::string> &required_neighbors,
 			float trigger_interval, u32 trigger_chance):
 		m_id(id),
+		m_name(name),
 		m_trigger_contents(trigger_contents),
 		m_required_neighbors(required_neighbors),
 		m_trigger_interval(trigger_interval),
@@ -165,6 +171,10 @@ class LuaABM : public ActiveBlockModifier
 	{
 		return m_trigger_chance;
 	}
+	virtual std::string getName()
+	{
+		return m_name;
+	}
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 			u32 active_object_count, u32 active_object_count_wider);
 };
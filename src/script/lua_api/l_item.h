@@ -144,6 +144,11 @@ class ModApiItemMod
 
 	static int l_register_item_raw(lua_State *L);
 	static int l_register_alias_raw(lua_State *L);
+
+	// get_content_id(name) -> content id of the node
+	static int l_get_content_id(lua_State *L);
+	// get_name_from_content_id(content id) -> node name
+	static int l_get_name_from_content_id(lua_State *L);
 };
 
 
@@ -0,0 +1,291 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "lua_api/l_base.h"
+#include "lua_api/l_vmanip.h"
+#include "common/c_internal.h"
+#include "common/c_converter.h"
+#include "nodedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "main.h" // for g_profiler
+#include "profiler.h"
+
+// garbage collector
+int LuaVoxelManip::gc_object(lua_State *L)
+{
+	LuaVoxelManip *o = *(LuaVoxelManip **)(lua_touserdata(L, 1));
+	delete o;
+	return 0;
+}
+
+int LuaVoxelManip::l_read_from_map(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	v3s16 p1 = read_v3s16(L, 2);
+	v3s16 p2 = read_v3s16(L, 3);
+
+	v3s16 bpmin = getNodeBlockPos(v3s16(MYMIN(p1.X, p2.X),
+			MYMIN(p1.Y, p2.Y), MYMIN(p1.Z, p2.Z)));
+	v3s16 bpmax = getNodeBlockPos(v3s16(MYMAX(p1.X, p2.X),
+			MYMAX(p1.Y, p2.Y), MYMAX(p1.Z, p2.Z)));
+
+	// initialEmerge() only takes what is in memory; load the rest from
+	// disk. Blocks that haven't been generated are left out.
+	for(s16 z = bpmin.Z; z <= bpmax.Z; z++)
+	for(s16 y = bpmin.Y; y <= bpmax.Y; y++)
+	for(s16 x = bpmin.X; x <= bpmax.X; x++)
+		o->map->emergeBlock(v3s16(x, y, z), false);
+
+	o->vm->initialEmerge(bpmin, bpmax);
+
+	push_v3s16(L, o->vm->m_area.MinEdge);
+	push_v3s16(L, o->vm->m_area.MaxEdge);
+	return 2;
+}
+
+int LuaVoxelManip::l_get_emerged_area(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	push_v3s16(L, o->vm->m_area.MinEdge);
+	push_v3s16(L, o->vm->m_area.MaxEdge);
+	return 2;
+}
+
+int LuaVoxelManip::l_get_data(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	ManualMapVoxelManipulator *vm = o->vm;
+
+	s32 volume = vm->m_area.getVolume();
+	lua_createtable(L, volume, 0);
+	for(s32 i = 0; i < volume; i++)
+	{
+		content_t c = CONTENT_IGNORE;
+		if(!(vm->m_flags[i] & VOXELFLAG_INEXISTENT))
+			c = vm->m_data[i].getContent();
+		lua_pushinteger(L, c);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+int LuaVoxelManip::l_set_data(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	o->setDataFromTable(L, 2, false);
+	return 0;
+}
+
+int LuaVoxelManip::l_get_param2_data(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	ManualMapVoxelManipulator *vm = o->vm;
+
+	s32 volume = vm->m_area.getVolume();
+	lua_createtable(L, volume, 0);
+	for(s32 i = 0; i < volume; i++)
+	{
+		lua_pushinteger(L, vm->m_data[i].param2);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+int LuaVoxelManip::l_set_param2_data(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	o->setDataFromTable(L, 2, true);
+	return 0;
+}
+
+int LuaVoxelManip::l_write_to_map(lua_State *L)
+{
+	LuaVoxelManip *o = checkobject(L, 1);
+	ManualMapVoxelManipulator *vm = o->vm;
+	ScopeProfiler sp(g_profiler, "LuaVoxelManip: write_to_map", SPT_AVG);
+
+	std::map<v3s16, MapBlock*> written_blocks;
+	for(std::set<v3s16>::iterator i = o->modified_blocks.begin();
+			i != o->modified_blocks.end(); ++i)
+	{
+		v3s16 p = *i;
+		MapBlock *block = o->map->getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			continue;
+		block->copyFrom(*vm);
+		block->raiseModified(MOD_STATE_WRITE_NEEDED, "LuaVoxelManip");
+		written_blocks[p] = block;
+	}
+	o->modified_blocks.clear();
+
+	if(!written_blocks.empty())
+	{
+		// Relight everything at once
+		std::map<v3s16, MapBlock*> lighting_blocks = written_blocks;
+		std::map<v3s16, MapBlock*> modified_blocks = written_blocks;
+		o->map->updateLighting(lighting_blocks, modified_blocks);
+
+		MapEditEvent event;
+		event.type = MEET_OTHER;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = modified_blocks.begin();
+				i != modified_blocks.end(); ++i)
+			event.modified_blocks.insert(i->first);
+		o->map->dispatchEvent(&event);
+	}
+
+	g_profiler->add("LuaVoxelManip: blocks written", written_blocks.size());
+	lua_pushinteger(L, written_blocks.size());
+	return 1;
+}
+
+void LuaVoxelManip::setDataFromTable(lua_State *L, int table, bool param2)
+{
+	luaL_checktype(L, table, LUA_TTABLE);
+	VoxelArea area = vm->m_area;
+	// The last content id found to be registered
+	lua_Integer valid_c = CONTENT_AIR;
+
+	/*
+		Only the blocks where something actually changes are marked to be
+		written. Nil entries leave the node alone, and nodes of blocks that
+		don't exist can't be set.
+	*/
+	v3s16 last_blockpos(-32768, -32768, -32768);
+	s32 i = 0;
+	for(s32 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for(s32 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for(s32 x = area.MinEdge.X; x <= area.MaxEdge.X; x++, i++)
+	{
+		lua_rawgeti(L, table, i + 1);
+		if(lua_isnumber(L, -1) && !(vm->m_flags[i] & VOXELFLAG_INEXISTENT))
+		{
+			MapNode &n = vm->m_data[i];
+			bool changed = false;
+			if(param2)
+			{
+				u8 value = lua_tointeger(L, -1);
+				changed = (n.param2 != value);
+				n.param2 = value;
+			}
+			else
+			{
+				// Anything else would end up in the map and crash the
+				// server when looked up
+				lua_Integer value = lua_tointeger(L, -1);
+				if(value != valid_c)
+				{
+					if(value < 0 || value > MAX_CONTENT ||
+							ndef->get(value).name.empty())
+						luaL_error(L, "Invalid content id %d at index %d",
+								(int)value, i + 1);
+					valid_c = value;
+				}
+				content_t c = value;
+				changed = (n.getContent() != c);
+				n.setContent(c);
+			}
+			if(changed)
+			{
+				v3s16 blockpos = getNodeBlockPos(v3s16(x, y, z));
+				if(blockpos != last_blockpos)
+				{
+					modified_blocks.insert(blockpos);
+					last_blockpos = blockpos;
+				}
+			}
+		}
+		lua_pop(L, 1);
+	}
+}
+
+LuaVoxelManip::LuaVoxelManip(ServerMap *map, INodeDefManager *ndef):
+	vm(new ManualMapVoxelManipulator(map)),
+	map(map),
+	ndef(ndef)
+{
+}
+
+LuaVoxelManip::~LuaVoxelManip()
+{
+	delete vm;
+}
+
+// Creates a LuaVoxelManip and leaves it on top of stack
+int LuaVoxelManip::create_object(lua_State *L, ServerMap *map,
+		INodeDefManager *ndef)
+{
+	LuaVoxelManip *o = new LuaVoxelManip(map, ndef);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+LuaVoxelManip* LuaVoxelManip::checkobject(lua_State *L, int narg)
+{
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+	void *ud = luaL_checkudata(L, narg, className);
+	if(!ud) luaL_typerror(L, narg, className);
+	return *(LuaVoxelManip **)ud;  // unbox pointer
+}
+
+void LuaVoxelManip::Register(lua_State *L)
+{
+	lua_newtable(L);
+	int methodtable = lua_gettop(L);
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+
+	luaL_openlib(L, 0, methods, 0);  // fill methodtable
+	lua_pop(L, 1);  // drop methodtable
+
+	// Created with minetest.get_voxel_manip()
+}
+
+const char LuaVoxelManip::className[] = "VoxelManip";
+const luaL_reg LuaVoxelManip::methods[] = {
+	luamethod(LuaVoxelManip, read_from_map),
+	luamethod(LuaVoxelManip, get_emerged_area),
+	luamethod(LuaVoxelManip, get_data),
+	luamethod(LuaVoxelManip, set_data),
+	luamethod(LuaVoxelManip, get_param2_data),
+	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, write_to_map),
+	{0,0}
+};
+
+REGISTER_LUA_REF(LuaVoxelManip);
@@ -0,0 +1,97 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef L_VMANIP_H_
+#define L_VMANIP_H_
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+#include <set>
+
+#include "irr_v3d.h"
+
+class ServerMap;
+class ManualMapVoxelManipulator;
+class INodeDefManager;
+
+/*
+	VoxelManip
+
+	Reads an area of the map into flat arrays that mods can edit as a
+	whole, and writes the changes back in one go: the modified MapBlocks
+	are relit together and sent out in a single map edit event, instead
+	of doing a lighting update and an event for every node.
+*/
+class LuaVoxelManip
+{
+private:
+	ManualMapVoxelManipulator *vm;
+	ServerMap *map;
+	// For checking the content ids set by mods
+	INodeDefManager *ndef;
+	// Blocks with changed nodes, written by write_to_map()
+	std::set<v3s16> modified_blocks;
+
+	static const char className[];
+	static const luaL_reg methods[];
+
+	static int gc_object(lua_State *L);
+
+	// read_from_map(self, p1, p2) -> emin, emax
+	// Loads the MapBlocks containing the area p1...p2
+	static int l_read_from_map(lua_State *L);
+
+	// get_emerged_area(self) -> emin, emax
+	static int l_get_emerged_area(lua_State *L);
+
+	// get_data(self) -> {content id, ...}
+	static int l_get_data(lua_State *L);
+
+	// set_data(self, {content id, ...})
+	static int l_set_data(lua_State *L);
+
+	// get_param2_data(self) -> {param2, ...}
+	static int l_get_param2_data(lua_State *L);
+
+	// set_param2_data(self, {param2, ...})
+	static int l_set_param2_data(lua_State *L);
+
+	// write_to_map(self) -> number of MapBlocks written
+	static int l_write_to_map(lua_State *L);
+
+	void setDataFromTable(lua_State *L, int table, bool param2);
+
+public:
+	LuaVoxelManip(ServerMap *map, INodeDefManager *ndef);
+	~LuaVoxelManip();
+
+	// Creates a LuaVoxelManip and leaves it on top of stack
+	static int create_object(lua_State *L, ServerMap *map,
+			INodeDefManager *ndef);
+
+	static LuaVoxelManip *checkobject(lua_State *L, int narg);
+
+	static void Register(lua_State *L);
+};
+
+#endif /* L_VMANIP_H_ */
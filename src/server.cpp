@@ -57,6 +57,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/pointedthing.h"
 #include "util/mathconstants.h"
 #include "rollback.h"
+#include "filecache.h"
 #include "util/serialize.h"
 #include "defaultsettings.h"
 
@@ -105,6 +106,46 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+void * BlockSendThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("BlockSendThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	u32 last_time = porting::getTimeMs();
+	u32 interval = BLOCK_SEND_INTERVAL_MS;
+
+	while(getRun())
+	{
+		u32 time = porting::getTimeMs();
+		float dtime = (float)(time - last_time) / 1000.0;
+		last_time = time;
+
+		/*
+			Back off while nothing is being sent. Things that can give
+			clients something new to send, like emerged or modified
+			blocks and acknowledged sends, trigger a round right away.
+		*/
+		if(m_server->SendBlocks(dtime) != 0)
+			interval = BLOCK_SEND_INTERVAL_MS;
+		else
+			interval = MYMIN(interval * 2, BLOCK_SEND_MAX_INTERVAL_MS);
+
+		m_event.wait(interval);
+
+		JMutexAutoLock lock(m_triggered_mutex);
+		m_triggered = false;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
 v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 {
 	if(pos_exists) *pos_exists = false;
@@ -126,33 +167,42 @@ v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 	return v3f(0,0,0);
 }
 
-void RemoteClient::GetNextBlocks(Server *server, float dtime,
-		std::vector<PrioritySortedBlockTransfer> &dest)
+bool RemoteClient::isReadyToSendBlocks(float dtime)
 {
-	DSTACK(__FUNCTION_NAME);
-
-	/*u32 timer_result;
-	TimeTaker timer("RemoteClient::GetNextBlocks", &timer_result);*/
+	// If definitions and textures have not been sent, don't
+	// send MapBlocks either
+	if(!definitions_sent || serialization_version == SER_FMT_VER_INVALID)
+		return false;
 
 	// Increment timers
 	m_nothing_to_send_pause_timer -= dtime;
 	m_nearest_unsent_reset_timer += dtime;
 
 	if(m_nothing_to_send_pause_timer >= 0)
-		return;
-
-	Player *player = server->m_env->getPlayer(peer_id);
-	// This can happen sometimes; clients and players are not in perfect sync.
-	if(player == NULL)
-		return;
+		return false;
 
 	// Won't send anything if already sending
 	if(m_blocks_sending.size() >= g_settings->getU16
 			("max_simultaneous_block_sends_per_client"))
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
-		return;
+		return false;
 	}
+	return true;
+}
+
+void RemoteClient::GetNextBlocks(Server *server, float dtime,
+		std::vector<PrioritySortedBlockTransfer> &dest)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	/*u32 timer_result;
+	TimeTaker timer("RemoteClient::GetNextBlocks", &timer_result);*/
+
+	Player *player = server->m_env->getPlayer(peer_id);
+	// This can happen sometimes; clients and players are not in perfect sync.
+	if(player == NULL)
+		return;
 
 	//TimeTaker timer("RemoteClient::GetNextBlocks");
 
@@ -490,7 +540,22 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				}
 			*/
 
-				if (server->m_emerge->enqueueBlockEmerge(peer_id, p, generate)) {
+				/*
+					Emerge closer blocks first, and of the ones at the
+					same distance those straight ahead of the camera
+				*/
+				v3f blockpos_center = intToFloat(p * MAP_BLOCKSIZE, BS)
+						+ v3f(1,1,1) * (MAP_BLOCKSIZE * BS / 2);
+				v3f block_dir = blockpos_center - camera_pos;
+				block_dir.normalize();
+				float priority = d - 0.5 * block_dir.dotProduct(camera_dir);
+
+				if (server->m_emerge->enqueueBlockEmerge(peer_id, p,
+						generate, priority)) {
+					// Have the database thread read it while the block
+					// waits in the emerge queue
+					if (block == NULL)
+						server->m_env->getServerMap().prefetchBlock(p);
 					if (nearest_emerged_d == -1)
 						nearest_emerged_d = d;
 				} else {
@@ -623,6 +688,61 @@ void PlayerInfo::PrintLine(std::ostream *s)
 	(*s)<<std::endl;
 }
 
+/*
+	SerializedBlockCache
+*/
+
+SerializedBlockCache::SerializedBlockCache(u32 max_size):
+	m_max_size(max_size)
+{
+	m_mutex.Init();
+}
+
+bool SerializedBlockCache::get(v3s16 pos, u8 version, u32 modified_counter,
+		std::string *data)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<Key, Entry>::iterator i = m_entries.find(Key(pos, version));
+	if(i == m_entries.end())
+		return false;
+	if(i->second.modified_counter != modified_counter)
+	{
+		remove(i);
+		return false;
+	}
+
+	m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+	*data = i->second.data;
+	return true;
+}
+
+void SerializedBlockCache::set(v3s16 pos, u8 version, u32 modified_counter,
+		const std::string &data)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	Key key(pos, version);
+	std::map<Key, Entry>::iterator i = m_entries.find(key);
+	if(i != m_entries.end())
+		remove(i);
+
+	m_lru.push_front(key);
+	Entry &entry = m_entries[key];
+	entry.modified_counter = modified_counter;
+	entry.data = data;
+	entry.lru = m_lru.begin();
+
+	while(m_entries.size() > m_max_size)
+		remove(m_entries.find(m_lru.back()));
+}
+
+void SerializedBlockCache::remove(std::map<Key, Entry>::iterator i)
+{
+	m_lru.erase(i->second.lru);
+	m_entries.erase(i);
+}
+
 /*
 	Server
 */
@@ -645,12 +765,14 @@ Server::Server(
 	m_rollback_sink_enabled(true),
 	m_enable_rollback_recording(false),
 	m_emerge(NULL),
+	m_block_cache(SERIALIZED_BLOCK_CACHE_SIZE),
 	m_script(NULL),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
 	m_craftdef(createCraftDefManager()),
 	m_event(new EventManager()),
 	m_thread(this),
+	m_block_send_thread(this),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
 	m_shutdown_requested(false),
@@ -667,7 +789,8 @@ Server::Server(
 	m_clients_number = 0;
 
 	m_env_mutex.Init();
-	m_con_mutex.Init();
+	m_players_mutex.Init();
+	m_clients_mutex.Init();
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 
@@ -755,7 +878,8 @@ Server::Server(
 
 	// Lock environment
 	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	JMutexAutoLock playerslock(m_players_mutex);
+	JMutexAutoLock clientslock(m_clients_mutex);
 
 	// Initialize scripting
 
@@ -763,6 +887,17 @@ Server::Server(
 
 	m_script = new ScriptApi(this);
 
+	{
+		int nthreads;
+		if(g_settings->get("num_async_lua_threads").empty()){
+			int nprocs = porting::getNumberOfProcessors();
+			// Leave some room for the server and emerge threads
+			nthreads = (nprocs > 2) ? nprocs - 2 : 1;
+		} else {
+			nthreads = g_settings->getU16("num_async_lua_threads");
+		}
+		m_script->initializeAsync(getBuiltinLuaPath(), MYMAX(nthreads, 1));
+	}
 
 	// Load and run builtin.lua
 	infostream<<"Server: Loading builtin.lua [\""
@@ -802,6 +937,9 @@ Server::Server(
 	// Apply item aliases in the node definition manager
 	m_nodedef->updateAliases(m_itemdef);
 
+	// Compress the definitions for the clients to come
+	getCompressedDefinitions(LATEST_PROTOCOL_VERSION);
+
 	// Initialize Environment
 	ServerMap *servermap = new ServerMap(path_world, this, m_emerge);
 	m_env = new ServerEnvironment(servermap, m_script, this, this);
@@ -841,7 +979,7 @@ Server::~Server()
 		Send shutdown message
 	*/
 	{
-		JMutexAutoLock conlock(m_con_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		std::wstring line = L"*** Server shutting down";
 
@@ -868,7 +1006,8 @@ Server::~Server()
 
 	{
 		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		JMutexAutoLock playerslock(m_players_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		/*
 			Execute script shutdown hooks
@@ -877,13 +1016,17 @@ Server::~Server()
 	}
 
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		JMutexAutoLock playerslock(m_players_mutex);
 
 		/*
 			Save players
 		*/
 		infostream<<"Server: Saving players"<<std::endl;
 		m_env->serializePlayers(m_path_world);
+	}
+
+	{
+		JMutexAutoLock envlock(m_env_mutex);
 
 		/*
 			Save environment metadata
@@ -904,7 +1047,7 @@ Server::~Server()
 		Delete clients
 	*/
 	{
-		JMutexAutoLock clientslock(m_con_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
@@ -943,8 +1086,9 @@ void Server::start(unsigned short port)
 	DSTACK(__FUNCTION_NAME);
 	infostream<<"Starting server on port "<<port<<"..."<<std::endl;
 
-	// Stop thread if already running
+	// Stop threads if already running
 	m_thread.stop();
+	m_block_send_thread.stop();
 
 	// Initialize connection
 	m_con.SetTimeoutMs(30);
@@ -953,6 +1097,8 @@ void Server::start(unsigned short port)
 	// Start thread
 	m_thread.setRun(true);
 	m_thread.Start();
+	m_block_send_thread.setRun(true);
+	m_block_send_thread.Start();
 
 	// ASCII art for the win!
 	actionstream
@@ -975,8 +1121,10 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread.setRun(false);
+	m_block_send_thread.setRun(false);
 	//m_emergethread.setRun(false);
 	m_thread.stop();
+	m_block_send_thread.stop();
 	//m_emergethread.stop();
 
 	infostream<<"Server: Threads stopped"<<std::endl;
@@ -999,6 +1147,16 @@ void Server::step(float dtime)
 	}
 }
 
+// Add an object id and message to TOCLIENT_ACTIVE_OBJECT_MESSAGES data
+static void appendObjectMessage(std::string &data, u16 id,
+		const std::string &message)
+{
+	char buf[2];
+	writeU16((u8*)&buf[0], id);
+	data.append(buf, 2);
+	data += serializeString(message);
+}
+
 void Server::AsyncRunStep()
 {
 	DSTACK(__FUNCTION_NAME);
@@ -1011,11 +1169,6 @@ void Server::AsyncRunStep()
 		dtime = m_step_dtime;
 	}
 
-	{
-		// Send blocks to clients
-		SendBlocks(dtime);
-	}
-
 	if(dtime < 0.001)
 		return;
 
@@ -1038,7 +1191,6 @@ void Server::AsyncRunStep()
 
 	{
 		// Process connection's timeouts
-		JMutexAutoLock lock2(m_con_mutex);
 		ScopeProfiler sp(g_profiler, "Server: connection timeout processing");
 		m_con.RunTimeouts(dtime);
 	}
@@ -1067,7 +1219,7 @@ void Server::AsyncRunStep()
 			m_time_of_day_send_timer = g_settings->getFloat("time_send_interval");
 
 			//JMutexAutoLock envlock(m_env_mutex);
-			JMutexAutoLock conlock(m_con_mutex);
+			JMutexAutoLock clientslock(m_clients_mutex);
 
 			for(std::map<u16, RemoteClient*>::iterator
 				i = m_clients.begin();
@@ -1084,6 +1236,7 @@ void Server::AsyncRunStep()
 
 	{
 		JMutexAutoLock lock(m_env_mutex);
+		JMutexAutoLock playerslock(m_players_mutex);
 		// Step environment
 		ScopeProfiler sp(g_profiler, "SEnv step");
 		ScopeProfiler sp2(g_profiler, "SEnv step avg", SPT_AVG);
@@ -1109,7 +1262,8 @@ void Server::AsyncRunStep()
 	*/
 	{
 		JMutexAutoLock lock(m_env_mutex);
-		JMutexAutoLock lock2(m_con_mutex);
+		JMutexAutoLock playerslock(m_players_mutex);
+		JMutexAutoLock lock2(m_clients_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: handle players");
 
@@ -1180,7 +1334,7 @@ void Server::AsyncRunStep()
 			Set the modified blocks unsent for all the clients
 		*/
 
-		JMutexAutoLock lock2(m_con_mutex);
+		JMutexAutoLock lock2(m_clients_mutex);
 
 		for(std::map<u16, RemoteClient*>::iterator
 				i = m_clients.begin();
@@ -1194,6 +1348,8 @@ void Server::AsyncRunStep()
 				client->SetBlocksNotSent(modified_blocks);
 			}
 		}
+		if(modified_blocks.size() > 0)
+			m_block_send_thread.trigger();
 	}
 
 	// Periodically print some info
@@ -1204,7 +1360,7 @@ void Server::AsyncRunStep()
 		{
 			counter = 0.0;
 
-			JMutexAutoLock lock2(m_con_mutex);
+			JMutexAutoLock lock2(m_clients_mutex);
 			m_clients_number = 0;
 			if(m_clients.size() != 0)
 				infostream<<"Players:"<<std::endl;
@@ -1247,7 +1403,7 @@ void Server::AsyncRunStep()
 	{
 		//infostream<<"Server: Checking added and deleted active objects"<<std::endl;
 		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
@@ -1312,6 +1468,7 @@ void Server::AsyncRunStep()
 
 				// Remove from known objects
 				client->m_known_objects.erase(id);
+				client->m_object_send_states.erase(id);
 
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
@@ -1356,7 +1513,8 @@ void Server::AsyncRunStep()
 			}
 
 			// Send packet
-			SharedBuffer<u8> reply(2 + data_buffer.size());
+			SharedBuffer<u8> reply = SharedBuffer<u8>::withHeadroom(
+					PACKET_HEADROOM, 2 + data_buffer.size());
 			writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_REMOVE_ADD);
 			memcpy((char*)&reply[2], data_buffer.c_str(),
 					data_buffer.size());
@@ -1402,7 +1560,7 @@ void Server::AsyncRunStep()
 	*/
 	{
 		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
@@ -1432,12 +1590,30 @@ void Server::AsyncRunStep()
 			message_list->push_back(aom);
 		}
 
+		/*
+			Position updates of objects far away from the player are
+			sent less often. Of the updates in between, only the latest
+			one is sent.
+		*/
+		f32 radius = g_settings->getS16("active_object_send_range_blocks")
+				* MAP_BLOCKSIZE;
+		f32 full_range = g_settings->getFloat(
+				"active_object_update_full_range");
+		f32 far_interval = g_settings->getFloat(
+				"active_object_update_far_interval");
+		u32 updates_sent = 0;
+		u32 deltas_sent = 0;
+
 		// Route data to every client
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
 			i != m_clients.end(); ++i)
 		{
 			RemoteClient *client = i->second;
+			Player *player = m_env->getPlayer(client->peer_id);
+			if(player == NULL)
+				continue;
+			v3f player_pos = player->getPosition();
 			std::string reliable_data;
 			std::string unreliable_data;
 			// Go through all objects in message buffer
@@ -1455,21 +1631,84 @@ void Server::AsyncRunStep()
 				for(std::list<ActiveObjectMessage>::iterator
 						k = list->begin(); k != list->end(); ++k)
 				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
+					ActiveObjectMessage &aom = *k;
+					// Position updates are held back until it is
+					// time to send them
+					if(!aom.reliable && !aom.datastring.empty() &&
+							aom.datastring[0] == GENERIC_CMD_UPDATE_POSITION)
+					{
+						std::istringstream is(aom.datastring.substr(1),
+								std::ios::binary);
+						ObjectSendState &state =
+								client->m_object_send_states[id];
+						state.pending_position =
+								gob_read_update_position(is);
+						state.pending = true;
+						continue;
+					}
 					// Add data to buffer
 					if(aom.reliable)
-						reliable_data += new_data;
+						appendObjectMessage(reliable_data, aom.id,
+								aom.datastring);
 					else
-						unreliable_data += new_data;
+						appendObjectMessage(unreliable_data, aom.id,
+								aom.datastring);
+				}
+			}
+
+			// Send the position updates that are due
+			for(std::map<u16, ObjectSendState>::iterator
+					j = client->m_object_send_states.begin();
+					j != client->m_object_send_states.end(); ++j)
+			{
+				u16 id = j->first;
+				ObjectSendState &state = j->second;
+				state.timer -= dtime;
+				if(!state.pending || state.timer > 0)
+					continue;
+				state.pending = false;
+
+				ObjectPosition p = state.pending_position;
+				f32 d = (p.position - player_pos).getLength() / BS;
+				f32 interval = 0;
+				if(far_interval > 0 && d > full_range)
+				{
+					if(radius > full_range)
+						interval = far_interval * (d - full_range)
+								/ (radius - full_range);
+					if(interval > far_interval)
+						interval = far_interval;
+				}
+				state.timer = interval;
+				// Let the client interpolate over the whole interval
+				if(p.update_interval < interval)
+					p.update_interval = interval;
+				updates_sent++;
+
+				if(client->net_proto_version < 21)
+				{
+					appendObjectMessage(unreliable_data, id,
+							gob_cmd_update_position(p));
+					continue;
+				}
+				std::string delta;
+				if(state.has_baseline && !p.is_movement_end)
+					delta = gob_cmd_update_position_delta(
+							state.baseline_id, state.baseline, p);
+				if(!delta.empty())
+				{
+					appendObjectMessage(unreliable_data, id, delta);
+					deltas_sent++;
+					continue;
 				}
+				// Send a new baseline. These are reliable so that the
+				// position the object stops at is never lost.
+				state.has_baseline = true;
+				state.baseline_id++;
+				state.baseline = p;
+				appendObjectMessage(reliable_data, id,
+						gob_cmd_update_position_baseline(
+						state.baseline_id, p));
 			}
 			/*
 				reliable_data and unreliable_data are now ready.
@@ -1477,7 +1716,8 @@ void Server::AsyncRunStep()
 			*/
 			if(reliable_data.size() > 0)
 			{
-				SharedBuffer<u8> reply(2 + reliable_data.size());
+				SharedBuffer<u8> reply = SharedBuffer<u8>::withHeadroom(
+						PACKET_HEADROOM, 2 + reliable_data.size());
 				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
 				memcpy((char*)&reply[2], reliable_data.c_str(),
 						reliable_data.size());
@@ -1486,7 +1726,8 @@ void Server::AsyncRunStep()
 			}
 			if(unreliable_data.size() > 0)
 			{
-				SharedBuffer<u8> reply(2 + unreliable_data.size());
+				SharedBuffer<u8> reply = SharedBuffer<u8>::withHeadroom(
+						PACKET_HEADROOM, 2 + unreliable_data.size());
 				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
 				memcpy((char*)&reply[2], unreliable_data.c_str(),
 						unreliable_data.size());
@@ -1510,6 +1751,9 @@ void Server::AsyncRunStep()
 		{
 			delete i->second;
 		}
+
+		g_profiler->avg("Server: object position updates sent", updates_sent);
+		g_profiler->avg("Server: object position deltas sent", deltas_sent);
 	}
 
 	} // enable_experimental
@@ -1520,7 +1764,7 @@ void Server::AsyncRunStep()
 	{
 		// We will be accessing the environment and the connection
 		JMutexAutoLock lock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		// Don't send too many at a time
 		//u32 count = 0;
@@ -1615,6 +1859,7 @@ void Server::AsyncRunStep()
 						continue;
 					client->SetBlocksNotSent(modified_blocks2);
 				}
+				m_block_send_thread.trigger();
 			}
 
 			delete event;
@@ -1662,22 +1907,25 @@ void Server::AsyncRunStep()
 		if(counter >= g_settings->getFloat("server_map_save_interval"))
 		{
 			counter = 0.0;
-			JMutexAutoLock lock(m_env_mutex);
-
 			ScopeProfiler sp(g_profiler, "Server: saving stuff");
 
 			//Ban stuff
 			if(m_banmanager.isModified())
 				m_banmanager.save();
 
-			// Save changed parts of map
-			m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
+			{
+				JMutexAutoLock lock(m_env_mutex);
+
+				// Save changed parts of map
+				m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
 
-			// Save players
-			m_env->serializePlayers(m_path_world);
+				// Save environment metadata
+				m_env->saveMeta(m_path_world);
+			}
 
-			// Save environment metadata
-			m_env->saveMeta(m_path_world);
+			// Save players; blocks can be loaded and generated meanwhile
+			JMutexAutoLock playerslock(m_players_mutex);
+			m_env->serializePlayers(m_path_world);
 		}
 	}
 }
@@ -1689,10 +1937,9 @@ void Server::Receive()
 	u16 peer_id;
 	u32 datasize;
 	try{
-		{
-			JMutexAutoLock conlock(m_con_mutex);
-			datasize = m_con.Receive(peer_id, data);
-		}
+		// The connection is thread-safe by itself. Don't hold any of our
+		// locks here, as this waits for incoming data.
+		datasize = m_con.Receive(peer_id, data);
 
 		// This has to be called so that the client list gets synced
 		// with the peer list of the connection
@@ -1723,12 +1970,130 @@ void Server::Receive()
 	}
 }
 
+bool Server::ProcessClientData(u8 *data, u32 datasize, u16 peer_id)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	if(datasize < 2)
+		return false;
+
+	ToServerCommand command = (ToServerCommand)readU16(&data[0]);
+	if(command != TOSERVER_GOTBLOCKS && command != TOSERVER_DELETEDBLOCKS
+			&& command != TOSERVER_RECEIVED_MEDIA)
+		return false;
+
+	// Banned peers are handled by ProcessData
+	try{
+		Address address = m_con.GetPeerAddress(peer_id);
+		if(m_banmanager.isIpBanned(address.serializeString()))
+			return false;
+	}
+	catch(con::PeerNotFoundException &e)
+	{
+		infostream<<"Server::ProcessClientData(): Cancelling: peer "
+				<<peer_id<<" not found"<<std::endl;
+		return true;
+	}
+
+	JMutexAutoLock clientslock(m_clients_mutex);
+
+	ScopeProfiler sp(g_profiler, "Server::ProcessClientData");
+
+	std::map<u16, RemoteClient*>::iterator n = m_clients.find(peer_id);
+	if(n == m_clients.end())
+		return true;
+	RemoteClient *client = n->second;
+
+	if(client->serialization_version == SER_FMT_VER_INVALID)
+	{
+		infostream<<"Server::ProcessClientData(): Cancelling: Peer"
+				" serialization format invalid or not initialized."
+				" Skipping incoming command="<<command<<std::endl;
+		return true;
+	}
+
+	// ProcessData requires a player with a PlayerSAO for these
+	if(!client->joined)
+	{
+		infostream<<"Server::ProcessClientData(): Cancelling: "
+				"No player for peer_id="<<peer_id
+				<<std::endl;
+		return true;
+	}
+
+	if(command == TOSERVER_GOTBLOCKS)
+	{
+		if(datasize < 2+1)
+			return true;
+
+		/*
+			[0] u16 command
+			[2] u8 count
+			[3] v3s16 pos_0
+			[3+6] v3s16 pos_1
+			...
+		*/
+
+		u16 count = data[2];
+		for(u16 i=0; i<count; i++)
+		{
+			if((s16)datasize < 2+1+(i+1)*6)
+				throw con::InvalidIncomingDataException
+					("GOTBLOCKS length is too short");
+			v3s16 p = readV3S16(&data[2+1+i*6]);
+			/*infostream<<"Server: GOTBLOCKS ("
+					<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
+			client->GotBlock(p);
+		}
+	}
+	else if(command == TOSERVER_DELETEDBLOCKS)
+	{
+		if(datasize < 2+1)
+			return true;
+
+		/*
+			[0] u16 command
+			[2] u8 count
+			[3] v3s16 pos_0
+			[3+6] v3s16 pos_1
+			...
+		*/
+
+		u16 count = data[2];
+		for(u16 i=0; i<count; i++)
+		{
+			if((s16)datasize < 2+1+(i+1)*6)
+				throw con::InvalidIncomingDataException
+					("DELETEDBLOCKS length is too short");
+			v3s16 p = readV3S16(&data[2+1+i*6]);
+			/*infostream<<"Server: DELETEDBLOCKS ("
+					<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
+			client->SetBlockNotSent(p);
+		}
+	}
+	else if(command == TOSERVER_RECEIVED_MEDIA)
+	{
+		client->definitions_sent = true;
+	}
+
+	// Either way the client may have something new to be sent
+	m_block_send_thread.trigger();
+	return true;
+}
+
 void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
+
+	// Block acknowledgements and such don't need to wait for the
+	// environment
+	if(ProcessClientData(data, datasize, peer_id))
+		return;
+
 	// Environment is locked first.
 	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	JMutexAutoLock playerslock(m_players_mutex);
+	JMutexAutoLock clientslock(m_clients_mutex);
 
 	ScopeProfiler sp(g_profiler, "Server::ProcessData");
 
@@ -2056,6 +2421,18 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		RemoteClient *client = getClient(peer_id);
 		client->serialization_version =
 				getClient(peer_id)->pending_serialization_version;
+		client->joined = (player->getPlayerSAO() != NULL);
+
+		// Definitions the client has cached from an earlier visit
+		std::string client_itemdef_sha1;
+		std::string client_nodedef_sha1;
+		if(datasize > 2)
+		{
+			std::string datastring((char*)&data[2], datasize-2);
+			std::istringstream is(datastring, std::ios_base::binary);
+			client_itemdef_sha1 = deSerializeString(is);
+			client_nodedef_sha1 = deSerializeString(is);
+		}
 
 		/*
 			Send some initialization data
@@ -2068,10 +2445,10 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		SendMovement(m_con, peer_id);
 
 		// Send item definitions
-		SendItemDef(m_con, peer_id, m_itemdef, client->net_proto_version);
+		SendItemDef(peer_id, client->net_proto_version, client_itemdef_sha1);
 
 		// Send node definitions
-		SendNodeDef(m_con, peer_id, m_nodedef, client->net_proto_version);
+		SendNodeDef(peer_id, client->net_proto_version, client_nodedef_sha1);
 
 		// Send media announcement
 		sendMediaAnnouncement(peer_id);
@@ -2221,58 +2598,6 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 				<<"("<<position.X<<","<<position.Y<<","<<position.Z<<")"
 				<<" pitch="<<pitch<<" yaw="<<yaw<<std::endl;*/
 	}
-	else if(command == TOSERVER_GOTBLOCKS)
-	{
-		if(datasize < 2+1)
-			return;
-
-		/*
-			[0] u16 command
-			[2] u8 count
-			[3] v3s16 pos_0
-			[3+6] v3s16 pos_1
-			...
-		*/
-
-		u16 count = data[2];
-		for(u16 i=0; i<count; i++)
-		{
-			if((s16)datasize < 2+1+(i+1)*6)
-				throw con::InvalidIncomingDataException
-					("GOTBLOCKS length is too short");
-			v3s16 p = readV3S16(&data[2+1+i*6]);
-			/*infostream<<"Server: GOTBLOCKS ("
-					<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
-			RemoteClient *client = getClient(peer_id);
-			client->GotBlock(p);
-		}
-	}
-	else if(command == TOSERVER_DELETEDBLOCKS)
-	{
-		if(datasize < 2+1)
-			return;
-
-		/*
-			[0] u16 command
-			[2] u8 count
-			[3] v3s16 pos_0
-			[3+6] v3s16 pos_1
-			...
-		*/
-
-		u16 count = data[2];
-		for(u16 i=0; i<count; i++)
-		{
-			if((s16)datasize < 2+1+(i+1)*6)
-				throw con::InvalidIncomingDataException
-					("DELETEDBLOCKS length is too short");
-			v3s16 p = readV3S16(&data[2+1+i*6]);
-			/*infostream<<"Server: DELETEDBLOCKS ("
-					<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
-			RemoteClient *client = getClient(peer_id);
-			client->SetBlockNotSent(p);
-		}
-	}
 	else if(command == TOSERVER_CLICK_OBJECT)
 	{
 		infostream<<"Server: CLICK_OBJECT not supported anymore"<<std::endl;
@@ -2671,15 +2996,22 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 					<<name<<std::endl;
 		}
 
-		sendRequestedMedia(peer_id, tosend);
+		if(getClient(peer_id)->net_proto_version >= 22)
+		{
+			for(std::list<MediaRequest>::iterator i = tosend.begin();
+					i != tosend.end(); ++i)
+				i->offset = readU32(is);
+			sendRequestedMediaChunks(peer_id, tosend);
+		}
+		else
+		{
+			sendRequestedMedia(peer_id, tosend);
+		}
 
 		// Now the client should know about everything
 		// (definitions and files)
 		getClient(peer_id)->definitions_sent = true;
 	}
-	else if(command == TOSERVER_RECEIVED_MEDIA) {
-		getClient(peer_id)->definitions_sent = true;
-	}
 	else if(command == TOSERVER_INTERACT)
 	{
 		std::string datastring((char*)&data[2], datasize-2);
@@ -3202,7 +3534,7 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 //{
 //	DSTACK(__FUNCTION_NAME);
 //	JMutexAutoLock envlock(m_env_mutex);
-//	JMutexAutoLock conlock(m_con_mutex);
+//	JMutexAutoLock clientslock(m_clients_mutex);
 //
 //	std::list<PlayerInfo> list;
 //
@@ -3344,64 +3676,76 @@ void Server::SendDeathscreen(con::Connection &con, u16 peer_id,
 	con.Send(peer_id, 0, data, true);
 }
 
-void Server::SendItemDef(con::Connection &con, u16 peer_id,
-		IItemDefManager *itemdef, u16 protocol_version)
+/*
+	Non-static send methods
+*/
+
+void Server::SendItemDef(u16 peer_id, u16 protocol_version,
+		const std::string &client_sha1)
 {
 	DSTACK(__FUNCTION_NAME);
+	const CompressedDefinitions &defs =
+			getCompressedDefinitions(protocol_version);
+	// Skip the definitions if the client has them already
+	bool cached = protocol_version >= 23 &&
+			client_sha1 == defs.itemdef_sha1;
+
 	std::ostringstream os(std::ios_base::binary);
 
 	/*
 		u16 command
 		u32 length of the next item
 		zlib-compressed serialized ItemDefManager
+		u16 length of the next item (new as of 23)
+		SHA1 of the compressed definitions
 	*/
 	writeU16(os, TOCLIENT_ITEMDEF);
-	std::ostringstream tmp_os(std::ios::binary);
-	itemdef->serialize(tmp_os, protocol_version);
-	std::ostringstream tmp_os2(std::ios::binary);
-	compressZlib(tmp_os.str(), tmp_os2);
-	os<<serializeLongString(tmp_os2.str());
+	os<<serializeLongString(cached ? "" : defs.itemdef);
+	if(protocol_version >= 23)
+		os<<serializeString(defs.itemdef_sha1);
 
 	// Make data buffer
 	std::string s = os.str();
 	verbosestream<<"Server: Sending item definitions to id("<<peer_id
-			<<"): size="<<s.size()<<std::endl;
+			<<"): size="<<s.size()<<(cached ? " (cached)" : "")<<std::endl;
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	con.Send(peer_id, 0, data, true);
+	m_con.Send(peer_id, 0, data, true);
 }
 
-void Server::SendNodeDef(con::Connection &con, u16 peer_id,
-		INodeDefManager *nodedef, u16 protocol_version)
+void Server::SendNodeDef(u16 peer_id, u16 protocol_version,
+		const std::string &client_sha1)
 {
 	DSTACK(__FUNCTION_NAME);
+	const CompressedDefinitions &defs =
+			getCompressedDefinitions(protocol_version);
+	// Skip the definitions if the client has them already
+	bool cached = protocol_version >= 23 &&
+			client_sha1 == defs.nodedef_sha1;
+
 	std::ostringstream os(std::ios_base::binary);
 
 	/*
 		u16 command
 		u32 length of the next item
 		zlib-compressed serialized NodeDefManager
+		u16 length of the next item (new as of 23)
+		SHA1 of the compressed definitions
 	*/
 	writeU16(os, TOCLIENT_NODEDEF);
-	std::ostringstream tmp_os(std::ios::binary);
-	nodedef->serialize(tmp_os, protocol_version);
-	std::ostringstream tmp_os2(std::ios::binary);
-	compressZlib(tmp_os.str(), tmp_os2);
-	os<<serializeLongString(tmp_os2.str());
+	os<<serializeLongString(cached ? "" : defs.nodedef);
+	if(protocol_version >= 23)
+		os<<serializeString(defs.nodedef_sha1);
 
 	// Make data buffer
 	std::string s = os.str();
 	verbosestream<<"Server: Sending node definitions to id("<<peer_id
-			<<"): size="<<s.size()<<std::endl;
+			<<"): size="<<s.size()<<(cached ? " (cached)" : "")<<std::endl;
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	con.Send(peer_id, 0, data, true);
+	m_con.Send(peer_id, 0, data, true);
 }
 
-/*
-	Non-static send methods
-*/
-
 void Server::SendInventory(u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -4024,49 +4368,22 @@ void Server::setBlockNotSent(v3s16 p)
 	}
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
+void Server::SendBlockData(u16 peer_id, v3s16 p, const std::string &data)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	v3s16 p = block->getPos();
-
-#if 0
-	// Analyze it a bit
-	bool completely_air = true;
-	for(s16 z0=0; z0<MAP_BLOCKSIZE; z0++)
-	for(s16 x0=0; x0<MAP_BLOCKSIZE; x0++)
-	for(s16 y0=0; y0<MAP_BLOCKSIZE; y0++)
-	{
-		if(block->getNodeNoEx(v3s16(x0,y0,z0)).d != CONTENT_AIR)
-		{
-			completely_air = false;
-			x0 = y0 = z0 = MAP_BLOCKSIZE; // Break out
-		}
-	}
-
-	// Print result
-	infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<"): ";
-	if(completely_air)
-		infostream<<"[completely air] ";
-	infostream<<std::endl;
-#endif
-
 	/*
 		Create a packet with the block in the right format
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
-
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
+	u32 replysize = 8 + data.size();
+	SharedBuffer<u8> reply = SharedBuffer<u8>::withHeadroom(
+			PACKET_HEADROOM, replysize);
 	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
 	writeS16(&reply[2], p.X);
 	writeS16(&reply[4], p.Y);
 	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	memcpy(&reply[8], data.c_str(), data.size());
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 			<<":  \tpacket size: "<<replysize<<std::endl;*/
@@ -4077,75 +4394,222 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 	m_con.Send(peer_id, 1, reply, true);
 }
 
-void Server::SendBlocks(float dtime)
+/*
+	A block selected for sending by Server::SendBlocks()
+*/
+struct QueuedBlockSend
 {
-	DSTACK(__FUNCTION_NAME);
+	u16 peer_id;
+	v3s16 pos;
+	// True if data was found in the block cache
+	bool cached;
+	std::string data;
+	// Taken if the data was not cached
+	MapBlockSnapshot snapshot;
+};
 
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+u32 Server::SendBlocks(float dtime)
+{
+	DSTACK(__FUNCTION_NAME);
 
 	ScopeProfiler sp(g_profiler, "Server: sel and send blocks to clients");
 
-	std::vector<PrioritySortedBlockTransfer> queue;
-
-	s32 total_sending = 0;
-
+	/*
+		Find the clients that can be sent something without locking
+		the environment. Usually none can, as they are waiting for
+		the blocks in flight to be acknowledged or have been sent
+		everything in range.
+	*/
+	std::set<u16> ready_clients;
 	{
-		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
+		JMutexAutoLock clientslock(m_clients_mutex);
 
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
 			i != m_clients.end(); ++i)
 		{
-			RemoteClient *client = i->second;
-			assert(client->peer_id == i->first);
+			if(i->second->isReadyToSendBlocks(dtime))
+				ready_clients.insert(i->first);
+		}
+	}
+	if(ready_clients.empty())
+		return 0;
 
-			// If definitions and textures have not been sent, don't
-			// send MapBlocks either
-			if(!client->definitions_sent)
-				continue;
+	std::list<QueuedBlockSend> sends;
 
-			total_sending += client->SendingCount();
+	/*
+		Select the blocks and take what is needed for sending them.
+		The environment is locked only for this part.
+	*/
+	{
+		JMutexAutoLock envlock(m_env_mutex);
+		JMutexAutoLock clientslock(m_clients_mutex);
+		ScopeProfiler sp(g_profiler, "Server: block send env lock avg",
+				SPT_AVG);
 
-			if(client->serialization_version == SER_FMT_VER_INVALID)
+		std::vector<PrioritySortedBlockTransfer> queue;
+
+		s32 total_sending = 0;
+
+		{
+			ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
+
+			for(std::map<u16, RemoteClient*>::iterator
+				i = m_clients.begin();
+				i != m_clients.end(); ++i)
+			{
+				RemoteClient *client = i->second;
+				assert(client->peer_id == i->first);
+
+				// If definitions and textures have not been sent, don't
+				// send MapBlocks either
+				if(!client->definitions_sent)
+					continue;
+
+				total_sending += client->SendingCount();
+
+				if(ready_clients.find(i->first) == ready_clients.end())
+					continue;
+
+				client->GetNextBlocks(this, dtime, queue);
+			}
+		}
+
+		// Sort.
+		// Lowest priority number comes first.
+		// Lowest is most important.
+		std::sort(queue.begin(), queue.end());
+
+		ScopeProfiler sp2(g_profiler, "Server: taking block snapshots");
+
+		for(u32 i=0; i<queue.size(); i++)
+		{
+			//TODO: Calculate limit dynamically
+			if(total_sending >= g_settings->getS32
+					("max_simultaneous_block_sends_server_total"))
+				break;
+
+			PrioritySortedBlockTransfer q = queue[i];
+
+			MapBlock *block = NULL;
+			try
+			{
+				block = m_env->getMap().getBlockNoCreate(q.pos);
+			}
+			catch(InvalidPositionException &e)
+			{
 				continue;
+			}
+
+			RemoteClient *client = getClient(q.peer_id);
+			u8 ver = client->serialization_version;
+
+			sends.push_back(QueuedBlockSend());
+			QueuedBlockSend &s = sends.back();
+			s.peer_id = q.peer_id;
+			s.pos = q.pos;
+			s.cached = m_block_cache.get(q.pos, ver,
+					block->getModifiedCounter(), &s.data);
+			if(!s.cached)
+				s.snapshot.take(block, ver);
+
+			client->SentBlock(q.pos);
 
-			client->GetNextBlocks(this, dtime, queue);
+			total_sending++;
 		}
 	}
 
-	// Sort.
-	// Lowest priority number comes first.
-	// Lowest is most important.
-	std::sort(queue.begin(), queue.end());
-
-	for(u32 i=0; i<queue.size(); i++)
+	/*
+		Serialize and send
+	*/
+	for(std::list<QueuedBlockSend>::iterator
+			i = sends.begin();
+			i != sends.end(); ++i)
 	{
-		//TODO: Calculate limit dynamically
-		if(total_sending >= g_settings->getS32
-				("max_simultaneous_block_sends_server_total"))
-			break;
+		QueuedBlockSend &s = *i;
+		MapBlockSnapshot &snapshot = s.snapshot;
 
-		PrioritySortedBlockTransfer q = queue[i];
+		// Another client may have been sent the same block just now
+		if(!s.cached)
+			s.cached = m_block_cache.get(snapshot.pos, snapshot.version,
+					snapshot.modified_counter, &s.data);
 
-		MapBlock *block = NULL;
-		try
+		if(s.cached)
 		{
-			block = m_env->getMap().getBlockNoCreate(q.pos);
+			g_profiler->add("Server: block cache hits", 1);
 		}
-		catch(InvalidPositionException &e)
+		else
 		{
-			continue;
+			std::ostringstream os(std::ios_base::binary);
+			snapshot.serialize(os);
+			s.data = os.str();
+			m_block_cache.set(snapshot.pos, snapshot.version,
+					snapshot.modified_counter, s.data);
 		}
 
-		RemoteClient *client = getClient(q.peer_id);
+		SendBlockData(s.peer_id, s.pos, s.data);
+	}
+	return sends.size();
+}
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version);
+static std::string getSha1Raw(const std::string &data)
+{
+	SHA1 sha1;
+	sha1.addBytes(data.c_str(), data.size());
+	unsigned char *digest = sha1.getDigest();
+	std::string sha1_raw((char*)digest, 20);
+	free(digest);
+	return sha1_raw;
+}
 
-		client->SentBlock(q.pos);
+const CompressedDefinitions &Server::getCompressedDefinitions(
+		u16 protocol_version)
+{
+	std::map<u16, CompressedDefinitions>::iterator i =
+			m_compressed_definitions.find(protocol_version);
+	if(i != m_compressed_definitions.end())
+		return i->second;
 
-		total_sending++;
+	ScopeProfiler sp(g_profiler, "Server: compress definitions", SPT_AVG);
+	CompressedDefinitions &defs = m_compressed_definitions[protocol_version];
+	{
+		std::ostringstream tmp_os(std::ios::binary);
+		m_itemdef->serialize(tmp_os, protocol_version);
+		std::ostringstream tmp_os2(std::ios::binary);
+		compressZlib(tmp_os.str(), tmp_os2);
+		defs.itemdef = tmp_os2.str();
+		defs.itemdef_sha1 = getSha1Raw(defs.itemdef);
+	}
+	{
+		std::ostringstream tmp_os(std::ios::binary);
+		m_nodedef->serialize(tmp_os, protocol_version);
+		std::ostringstream tmp_os2(std::ios::binary);
+		compressZlib(tmp_os.str(), tmp_os2);
+		defs.nodedef = tmp_os2.str();
+		defs.nodedef_sha1 = getSha1Raw(defs.nodedef);
+	}
+	verbosestream<<"Server: Compressed definitions for protocol version "
+			<<protocol_version<<": items "<<defs.itemdef.size()
+			<<" bytes, nodes "<<defs.nodedef.size()<<" bytes"<<std::endl;
+	return defs;
+}
+
+/*
+	Whether zdata decompresses to data. A copy in the compressed media
+	cache may have been cut short by a crash or damaged otherwise, and
+	clients would reject what they get.
+*/
+static bool decompressesTo(const std::string &zdata, const std::string &data)
+{
+	std::istringstream is(zdata, std::ios_base::binary);
+	std::ostringstream os(std::ios_base::binary);
+	try{
+		decompressZlib(is, os);
+	}
+	catch(SerializationError &e){
+		return false;
 	}
+	return os.str() == data;
 }
 
 void Server::fillMediaCache()
@@ -4167,6 +4631,23 @@ void Server::fillMediaCache()
 	std::string path_all = "textures";
 	paths.push_back(path_all + DIR_DELIM + "all");
 
+	/*
+		Compressed copies of the files are kept in a cache, named by
+		the checksum of the original. Formats that are compressed
+		already are sent as they are.
+	*/
+	std::string cache_path = porting::path_user + DIR_DELIM + "cache"
+			+ DIR_DELIM + "media_compressed";
+	if(!fs::CreateAllDirs(cache_path))
+		errorstream<<"Server::fillMediaCache(): Could not create "
+				<<cache_path<<std::endl;
+	FileCache compressed_cache(cache_path);
+	const char *compressible_ext[] = {
+		".bmp", ".tga", ".pcx", ".ppm", ".psd", ".wal", ".rgb",
+		".x", ".b3d", ".md2", ".obj",
+		NULL
+	};
+
 	// Collect media file information from paths into cache
 	for(std::list<std::string>::iterator i = paths.begin();
 			i != paths.end(); i++)
@@ -4238,8 +4719,26 @@ void Server::fillMediaCache()
 			std::string sha1_hex = hex_encode((char*)digest, 20);
 			free(digest);
 
+			std::string compressed_path;
+			if(removeStringEnd(filename, compressible_ext) != ""){
+				std::string name = sha1_hex + ".zlib";
+				std::ostringstream cached_os(std::ios_base::binary);
+				if(fs::PathExists(cache_path + DIR_DELIM + name) &&
+						compressed_cache.load(name, cached_os) &&
+						decompressesTo(cached_os.str(), tmp_os.str())){
+					compressed_path = cache_path + DIR_DELIM + name;
+				} else {
+					std::ostringstream z_os(std::ios_base::binary);
+					compressZlib(tmp_os.str(), z_os);
+					if(z_os.str().size() < tmp_os.str().size() * 9 / 10 &&
+							compressed_cache.update(name, z_os.str()))
+						compressed_path = cache_path + DIR_DELIM + name;
+				}
+			}
+
 			// Put in list
-			this->m_media[filename] = MediaInfo(filepath, sha1_base64);
+			this->m_media[filename] = MediaInfo(filepath, sha1_base64,
+					compressed_path);
 			verbosestream<<"Server: "<<sha1_hex<<" is "<<filename<<std::endl;
 		}
 	}
@@ -4396,7 +4895,7 @@ void Server::sendRequestedMedia(u16 peer_id,
 	u32 num_bunches = file_bunches.size();
 	for(u32 i=0; i<num_bunches; i++)
 	{
-		std::ostringstream os(std::ios_base::binary);
+		con::PacketBuilder os(bytes_per_bunch + 1024);
 
 		/*
 			u16 command
@@ -4420,21 +4919,127 @@ void Server::sendRequestedMedia(u16 peer_id,
 				j = file_bunches[i].begin();
 				j != file_bunches[i].end(); ++j){
 			os<<serializeString(j->name);
-			os<<serializeLongString(j->data);
+			// serializeLongString() without copying the file
+			writeU32(os, j->data.size());
+			os.write(j->data.c_str(), j->data.size());
 		}
 
-		// Make data buffer
-		std::string s = os.str();
+		SharedBuffer<u8> data = os.getBuffer();
 		verbosestream<<"Server::sendRequestedMedia(): bunch "
 				<<i<<"/"<<num_bunches
 				<<" files="<<file_bunches[i].size()
-				<<" size=" <<s.size()<<std::endl;
-		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+				<<" size=" <<data.getSize()<<std::endl;
 		// Send as reliable
 		m_con.Send(peer_id, 0, data, true);
 	}
 }
 
+struct MediaStream
+{
+	std::string name;
+	u8 compression;
+	std::string data;
+	u32 offset;
+};
+
+void Server::sendRequestedMediaChunks(u16 peer_id,
+		const std::list<MediaRequest> &tosend)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	verbosestream<<"Server::sendRequestedMediaChunks(): "
+			<<"Sending files to client"<<std::endl;
+
+	std::list<MediaStream> streams;
+	for(std::list<MediaRequest>::const_iterator i = tosend.begin();
+			i != tosend.end(); ++i)
+	{
+		std::map<std::string, MediaInfo>::iterator n = m_media.find(i->name);
+		if(n == m_media.end()){
+			errorstream<<"Server::sendRequestedMediaChunks(): Client asked "
+					<<"for unknown file \""<<(i->name)<<"\""<<std::endl;
+			continue;
+		}
+		const MediaInfo &info = n->second;
+
+		MediaStream stream;
+		stream.name = i->name;
+		stream.compression = MEDIA_COMPRESSION_NONE;
+		std::ostringstream tmp_os(std::ios_base::binary);
+		bool found = false;
+		if(info.compressed_path != ""){
+			std::ifstream fis(info.compressed_path.c_str(),
+					std::ios_base::binary);
+			if(fis.good()){
+				tmp_os<<fis.rdbuf();
+				found = !fis.bad();
+				stream.compression = MEDIA_COMPRESSION_ZLIB;
+			}
+		}
+		if(!found){
+			tmp_os.str("");
+			std::ifstream fis(info.path.c_str(), std::ios_base::binary);
+			if(fis.good()){
+				tmp_os<<fis.rdbuf();
+				found = !fis.bad();
+				stream.compression = MEDIA_COMPRESSION_NONE;
+			}
+		}
+		if(!found){
+			errorstream<<"Server::sendRequestedMediaChunks(): Could not "
+					<<"read \""<<info.path<<"\""<<std::endl;
+			continue;
+		}
+		stream.data = tmp_os.str();
+		// The client has a piece of some other version of the file
+		// if it is too long
+		stream.offset = i->offset;
+		if(stream.offset > stream.data.size())
+			stream.offset = 0;
+		streams.push_back(stream);
+	}
+
+	/*
+		Send the files in chunks, a chunk of each file in turn, so that
+		small files don't wait for big ones. A file that the client
+		has in full gets an empty chunk to finish it.
+	*/
+	u32 chunk_count = 0;
+	u32 bytes_sent = 0;
+	while(!streams.empty())
+	{
+		for(std::list<MediaStream>::iterator i = streams.begin();
+				i != streams.end();)
+		{
+			MediaStream &stream = *i;
+			u32 len = MYMIN(MEDIA_CHUNK_SIZE,
+					stream.data.size() - stream.offset);
+
+			con::PacketBuilder os(len + stream.name.size() + 17);
+			writeU16(os, TOCLIENT_MEDIA_CHUNK);
+			os<<serializeString(stream.name);
+			writeU8(os, stream.compression);
+			writeU32(os, stream.data.size());
+			writeU32(os, stream.offset);
+			writeU32(os, len);
+			os.write(stream.data.c_str() + stream.offset, len);
+			// Send as reliable
+			m_con.Send(peer_id, MEDIA_CHANNEL, os.getBuffer(), true);
+
+			chunk_count++;
+			bytes_sent += len;
+			stream.offset += len;
+			if(stream.offset == stream.data.size())
+				streams.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	verbosestream<<"Server::sendRequestedMediaChunks(): Sent "
+			<<chunk_count<<" chunks, "<<bytes_sent<<" bytes"<<std::endl;
+}
+
 void Server::sendDetachedInventory(const std::string &name, u16 peer_id)
 {
 	if(m_detached_inventories.count(name) == 0){
@@ -4545,7 +5150,7 @@ void Server::UpdateCrafting(u16 peer_id)
 RemoteClient* Server::getClient(u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
-	//JMutexAutoLock lock(m_con_mutex);
+	//JMutexAutoLock lock(m_clients_mutex);
 	std::map<u16, RemoteClient*>::iterator n;
 	n = m_clients.find(peer_id);
 	// A client should exist for all peers
@@ -4839,6 +5444,13 @@ void Server::queueBlockEmerge(v3s16 blockpos, bool allow_generate)
 	m_emerge->enqueueBlockEmerge(PEER_ID_INEXISTENT, blockpos, allow_generate);
 }
 
+bool Server::migrateMapDatabase(const std::string &target_backend,
+		bool recompress)
+{
+	JMutexAutoLock envlock(m_env_mutex);
+	return m_env->getServerMap().migrateDatabase(target_backend, recompress);
+}
+
 Inventory* Server::createDetachedInventory(const std::string &name)
 {
 	if(m_detached_inventories.count(name) > 0){
@@ -4945,6 +5557,7 @@ IShaderSource* Server::getShaderSource()
 }
 u16 Server::allocateUnknownNodeId(const std::string &name)
 {
+	m_compressed_definitions.clear();
 	return m_nodedef->allocateDummy(name);
 }
 ISoundManager* Server::getSoundManager()
@@ -4966,10 +5579,13 @@ IRollbackReportSink* Server::getRollbackReportSink()
 
 IWritableItemDefManager* Server::getWritableItemDefManager()
 {
+	// The caller is probably going to change something
+	m_compressed_definitions.clear();
 	return m_itemdef;
 }
 IWritableNodeDefManager* Server::getWritableNodeDefManager()
 {
+	m_compressed_definitions.clear();
 	return m_nodedef;
 }
 IWritableCraftDefManager* Server::getWritableCraftDefManager()
@@ -5127,7 +5743,8 @@ PlayerSAO* Server::emergePlayer(const char *name, u16 peer_id)
 void Server::handlePeerChange(PeerChange &c)
 {
 	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	JMutexAutoLock playerslock(m_players_mutex);
+	JMutexAutoLock clientslock(m_clients_mutex);
 
 	if(c.type == PEER_ADDED)
 	{
@@ -5163,6 +5780,7 @@ void Server::handlePeerChange(PeerChange &c)
 			Mark objects to be not known by the client
 		*/
 		RemoteClient *client = n->second;
+		client->joined = false;
 		// Handle objects
 		for(std::set<u16>::iterator
 				i = client->m_known_objects.begin();
@@ -5254,6 +5872,9 @@ void Server::handlePeerChange(PeerChange &c)
 		delete m_clients[c.peer_id];
 		m_clients.erase(c.peer_id);
 
+		// Nobody is waiting for the blocks it requested anymore
+		m_emerge->cancelPeerEmerges(c.peer_id);
+
 		// Send player info to all remaining clients
 		//SendPlayerInfos();
 
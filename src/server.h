@@ -35,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "inventorymanager.h"
 #include "subgame.h"
 #include "sound.h"
+#include "genericobject.h" // ObjectPosition
 #include "util/thread.h"
 #include "util/string.h"
 #include "rollback_interface.h" // Needed for rollbackRevertActions()
@@ -144,6 +145,49 @@ class ServerThread : public SimpleThread
 	void * Thread();
 };
 
+// Time between rounds of sending blocks to clients while there is
+// something to send
+#define BLOCK_SEND_INTERVAL_MS 20
+// The time between rounds is doubled up to this while nothing is sent
+#define BLOCK_SEND_MAX_INTERVAL_MS 100
+
+/*
+	Sends blocks to clients, see Server::SendBlocks()
+*/
+class BlockSendThread : public SimpleThread
+{
+	Server *m_server;
+	Event m_event;
+	// Whether m_event has been signaled since the last round started;
+	// protected by m_triggered_mutex
+	bool m_triggered;
+	JMutex m_triggered_mutex;
+
+public:
+
+	BlockSendThread(Server *server):
+		SimpleThread(),
+		m_server(server),
+		m_triggered(false)
+	{
+		m_triggered_mutex.Init();
+	}
+
+	void * Thread();
+
+	// Start the next round without waiting for the interval; for when
+	// clients may have new blocks to send. Any number of triggers
+	// before the round starts make for one round.
+	void trigger()
+	{
+		JMutexAutoLock lock(m_triggered_mutex);
+		if(m_triggered)
+			return;
+		m_triggered = true;
+		m_event.signal();
+	}
+};
+
 struct PlayerInfo
 {
 	u16 id;
@@ -178,12 +222,60 @@ struct PrioritySortedBlockTransfer
 	u16 peer_id;
 };
 
+/*
+	Serialized MapBlocks as they were sent to clients, so that a block
+	sent to many clients is serialized and compressed only once.
+
+	An entry is used only while the block has the same modified counter
+	as when it was serialized. The least recently used entries are
+	dropped when there are more than max_size of them.
+*/
+#define SERIALIZED_BLOCK_CACHE_SIZE 1024
+
+class SerializedBlockCache
+{
+public:
+	SerializedBlockCache(u32 max_size);
+
+	// modified_counter is MapBlock::getModifiedCounter() of the block.
+	// Returns false if there is no up-to-date entry for it.
+	bool get(v3s16 pos, u8 version, u32 modified_counter,
+			std::string *data);
+	void set(v3s16 pos, u8 version, u32 modified_counter,
+			const std::string &data);
+
+private:
+	typedef std::pair<v3s16, u8> Key;
+	struct Entry
+	{
+		u32 modified_counter;
+		std::string data;
+		std::list<Key>::iterator lru;
+	};
+
+	void remove(std::map<Key, Entry>::iterator i);
+
+	u32 m_max_size;
+	std::map<Key, Entry> m_entries;
+	// Most recently used first
+	std::list<Key> m_lru;
+	JMutex m_mutex;
+};
+
+// Size of a TOCLIENT_MEDIA_CHUNK and the channel they are sent on,
+// apart from the rest of the traffic
+#define MEDIA_CHUNK_SIZE 8192
+#define MEDIA_CHANNEL 2
+
 struct MediaRequest
 {
 	std::string name;
+	// How much of the file the client already has
+	u32 offset;
 
-	MediaRequest(const std::string &name_=""):
-		name(name_)
+	MediaRequest(const std::string &name_="", u32 offset_=0):
+		name(name_),
+		offset(offset_)
 	{}
 };
 
@@ -191,15 +283,33 @@ struct MediaInfo
 {
 	std::string path;
 	std::string sha1_digest;
+	// zlib compressed copy in the media cache, empty if not worth it
+	std::string compressed_path;
 
 	MediaInfo(const std::string path_="",
-			const std::string sha1_digest_=""):
+			const std::string sha1_digest_="",
+			const std::string compressed_path_=""):
 		path(path_),
-		sha1_digest(sha1_digest_)
+		sha1_digest(sha1_digest_),
+		compressed_path(compressed_path_)
 	{
 	}
 };
 
+/*
+	Item and node definitions as sent to clients of one protocol version
+*/
+struct CompressedDefinitions
+{
+	// zlib compressed serialized definitions
+	std::string itemdef;
+	std::string nodedef;
+	// Raw SHA1 of the above; clients with the same ones cached get
+	// nothing else
+	std::string itemdef_sha1;
+	std::string nodedef_sha1;
+};
+
 struct ServerSoundParams
 {
 	float gain;
@@ -233,6 +343,29 @@ struct ServerPlayingSound
 	std::set<u16> clients; // peer ids
 };
 
+/*
+	Position updates of an active object, as sent to one client
+*/
+struct ObjectSendState
+{
+	// Time until the next position update may be sent
+	float timer;
+	// Latest position update that has not been sent yet
+	bool pending;
+	ObjectPosition pending_position;
+	// Last baseline sent to the client, deltas are made against it
+	bool has_baseline;
+	u8 baseline_id;
+	ObjectPosition baseline;
+
+	ObjectSendState():
+		timer(0),
+		pending(false),
+		has_baseline(false),
+		baseline_id(0)
+	{}
+};
+
 class RemoteClient
 {
 public:
@@ -249,6 +382,10 @@ class RemoteClient
 	u8 pending_serialization_version;
 
 	bool definitions_sent;
+	// Set when INIT2 has been handled and the player has a PlayerSAO;
+	// cleared when the player is being removed. Lets commands that
+	// don't lock the environment check that the peer has joined.
+	bool joined;
 
 	RemoteClient():
 		m_time_from_building(9999),
@@ -259,6 +396,7 @@ class RemoteClient
 		net_proto_version = 0;
 		pending_serialization_version = SER_FMT_VER_INVALID;
 		definitions_sent = false;
+		joined = false;
 		m_nearest_unsent_d = 0;
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
@@ -268,8 +406,16 @@ class RemoteClient
 	{
 	}
 
+	/*
+		Steps the send timers and checks whether the client can be sent
+		blocks now, so the environment needn't be locked for clients
+		that can't. Only the clients should be locked when this is called.
+	*/
+	bool isReadyToSendBlocks(float dtime);
+
 	/*
 		Finds block that should be sent next to the client.
+		Call only when isReadyToSendBlocks() returned true.
 		Environment should be locked when this is called.
 		dtime is used for resetting send radius at slow interval
 	*/
@@ -319,6 +465,12 @@ class RemoteClient
 	*/
 	std::set<u16> m_known_objects;
 
+	/*
+		Position update state of the known objects that have sent
+		position updates.
+	*/
+	std::map<u16, ObjectSendState> m_object_send_states;
+
 private:
 	/*
 		Blocks that have been sent to client.
@@ -383,6 +535,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void AsyncRunStep();
 	void Receive();
 	void ProcessData(u8 *data, u32 datasize, u16 peer_id);
+	/*
+		Handles commands that only touch the sending client's entry in
+		m_clients, without locking the environment.
+		Returns false if the command has to go through ProcessData.
+	*/
+	bool ProcessClientData(u8 *data, u32 datasize, u16 peer_id);
 
 	//std::list<PlayerInfo> getPlayerInfo();
 
@@ -489,6 +647,10 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	void queueBlockEmerge(v3s16 blockpos, bool allow_generate);
 
+	// Offline map database maintenance; the server must not be started.
+	// See ServerMap::migrateDatabase().
+	bool migrateMapDatabase(const std::string &target_backend, bool recompress);
+
 	// Creates or resets inventory
 	Inventory* createDetachedInventory(const std::string &name);
 
@@ -561,10 +723,6 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			const std::wstring &reason);
 	static void SendDeathscreen(con::Connection &con, u16 peer_id,
 			bool set_camera_point_target, v3f camera_point_target);
-	static void SendItemDef(con::Connection &con, u16 peer_id,
-			IItemDefManager *itemdef, u16 protocol_version);
-	static void SendNodeDef(con::Connection &con, u16 peer_id,
-			INodeDefManager *nodedef, u16 protocol_version);
 
 	/*
 		Non-static send methods.
@@ -574,6 +732,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	*/
 
 	// Envlock and conlock should be locked when calling these
+	// client_sha1 is the SHA1 of the definitions the client has cached
+	void SendItemDef(u16 peer_id, u16 protocol_version,
+			const std::string &client_sha1);
+	void SendNodeDef(u16 peer_id, u16 protocol_version,
+			const std::string &client_sha1);
 	void SendInventory(u16 peer_id);
 	void SendChatMessage(u16 peer_id, const std::wstring &message);
 	void BroadcastChatMessage(const std::wstring &message);
@@ -600,16 +763,29 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			std::list<u16> *far_players=NULL, float far_d_nodes=100);
 	void setBlockNotSent(v3s16 p);
 
-	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
+	// Sends serialized block data. Needs no locks.
+	void SendBlockData(u16 peer_id, v3s16 p, const std::string &data);
 
-	// Sends blocks to clients (locks env and con on its own)
-	void SendBlocks(float dtime);
+	/*
+		Selects blocks to send to clients and sends them. Locks the
+		environment and the clients on its own, but only for choosing
+		the blocks and copying their data, and the environment only if
+		some client can be sent blocks. Serializing, compressing and
+		sending is done without them.
+		Called by m_block_send_thread. Returns the number of blocks sent.
+	*/
+	u32 SendBlocks(float dtime);
+
+	// Envlock should be locked when calling this
+	const CompressedDefinitions &getCompressedDefinitions(
+			u16 protocol_version);
 
 	void fillMediaCache();
 	void sendMediaAnnouncement(u16 peer_id);
 	void sendRequestedMedia(u16 peer_id,
 			const std::list<MediaRequest> &tosend);
+	void sendRequestedMediaChunks(u16 peer_id,
+			const std::list<MediaRequest> &tosend);
 
 	void sendDetachedInventory(const std::string &name, u16 peer_id);
 	void sendDetachedInventoryToAll(const std::string &name);
@@ -721,17 +897,45 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_savemap_timer;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
-	// NOTE: If connection and environment are both to be locked,
-	// environment shall be locked first.
+	/*
+		Locking
+
+		Server state is split into domains that are locked separately.
+		When more than one is needed, they shall be locked in this order:
+
+		1. m_env_mutex: the environment with its map and active
+		   objects, and rollback.
+		2. m_players_mutex: the players of the environment (including
+		   their inventories) and detached inventories. These are only
+		   modified with both m_env_mutex and m_players_mutex held, so
+		   either one is enough for reading them. Lua callbacks can
+		   reach everything, so scripting needs both.
+		3. m_clients_mutex: m_clients and the per-client state in
+		   RemoteClient (sent blocks, known objects, ...).
+		4. EmergeThread::queuemutex: the emerge queue of one emerge
+		   thread. Only one of these is held at a time.
+		5. EmergeManager::queuecountmutex: the emerge queue counts
+		   the queue limits are checked against.
+
+		Loading and generating blocks, transforming liquids and
+		sending blocks only need m_env_mutex, and saving players only
+		needs m_players_mutex, so these don't wait for each other.
+
+		m_block_cache locks itself and calls nothing while locked.
+
+		m_con is thread-safe by itself and needs none of these. Never
+		hold a lock while waiting for network input.
+	*/
 
 	// Environment
 	ServerEnvironment *m_env;
 	JMutex m_env_mutex;
+	JMutex m_players_mutex;
 
 	// Connection
 	con::Connection m_con;
-	JMutex m_con_mutex;
-	// Connected clients (behind the con mutex)
+	JMutex m_clients_mutex;
+	// Connected clients (behind m_clients_mutex)
 	std::map<u16, RemoteClient*> m_clients;
 	u16 m_clients_number; //for announcing masterserver
 
@@ -746,6 +950,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Emerge manager
 	EmergeManager *m_emerge;
 
+	// Serialized blocks, shared by the clients
+	SerializedBlockCache m_block_cache;
+
 	// Scripting
 	// Envlock and conlock should be locked when using Lua
 	ScriptApi *m_script;
@@ -756,6 +963,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Node definition manager
 	IWritableNodeDefManager *m_nodedef;
 
+	// Definitions by protocol version, built when first needed.
+	// Cleared when the definition managers are handed out for writing.
+	// Envlock should be locked when using this.
+	std::map<u16, CompressedDefinitions> m_compressed_definitions;
+
 	// Craft definition manager
 	IWritableCraftDefManager *m_craftdef;
 
@@ -776,6 +988,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
+	// Blocks are sent to clients in this thread
+	BlockSendThread m_block_send_thread;
 
 	/*
 		Time related stuff
@@ -848,6 +1062,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	u16 m_ignore_map_edit_events_peer_id;
 
 	friend class EmergeThread;
+	friend class BlockSendThread;
 	friend class RemoteClient;
 
 	std::map<std::string,MediaInfo> m_media;
@@ -859,7 +1074,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	s32 m_next_sound_id;
 
 	/*
-		Detached inventories (behind m_env_mutex)
+		Detached inventories (behind m_players_mutex)
 	*/
 	// key = name
 	std::map<std::string, Inventory*> m_detached_inventories;
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "serverobject.h"
+#include "environment.h"
 #include <fstream>
 #include "inventory.h"
 #include "constants.h" // BS
@@ -67,6 +68,13 @@ void ServerActiveObject::registerType(u16 type, Factory f)
 	m_types[type] = f;
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	if(m_env)
+		m_env->activeObjectMoved(this);
+}
+
 float ServerActiveObject::getMinimumSavedMovement()
 {
 	return 2.0*BS;
@@ -44,6 +44,16 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	// recvmmsg() and sendmmsg()
+	#define HAVE_MMSG 1
+#else
+	#define HAVE_MMSG 0
+#endif
+
+// Datagrams per recvmmsg() or sendmmsg() call
+#define MMSG_BATCH_MAX 64
+
 #include "constants.h"
 #include "debug.h"
 #include <stdio.h>
@@ -328,6 +338,98 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 	return received;
 }
 
+int UDPSocket::ReceiveMultiple(Address *senders, void **data, int size,
+		int *sizes, int count)
+{
+#if HAVE_MMSG
+	if(!DP)
+	{
+		if(count > MMSG_BATCH_MAX)
+			count = MMSG_BATCH_MAX;
+		struct mmsghdr msgs[MMSG_BATCH_MAX];
+		struct iovec iovecs[MMSG_BATCH_MAX];
+		sockaddr_in addresses[MMSG_BATCH_MAX];
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for(int i=0; i<count; i++){
+			iovecs[i].iov_base = data[i];
+			iovecs[i].iov_len = size;
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+		}
+		int received = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		if(received < 0)
+			return 0;
+		for(int i=0; i<received; i++){
+			senders[i] = Address(ntohl(addresses[i].sin_addr.s_addr),
+					ntohs(addresses[i].sin_port));
+			sizes[i] = msgs[i].msg_len;
+		}
+		return received;
+	}
+#endif
+	int received = 0;
+	while(received < count)
+	{
+		if(received != 0 && WaitData(0) == false)
+			break;
+		int r = Receive(senders[received], data[received], size);
+		if(r < 0)
+			break;
+		sizes[received] = r;
+		received++;
+	}
+	return received;
+}
+
+int UDPSocket::SendMultiple(const Address *destinations,
+		const void * const *data, const int *sizes, int count)
+{
+#if HAVE_MMSG
+	if(!DP && !INTERNET_SIMULATOR)
+	{
+		int sent_total = 0;
+		while(sent_total < count)
+		{
+			int batch = MYMIN(count - sent_total, MMSG_BATCH_MAX);
+			struct mmsghdr msgs[MMSG_BATCH_MAX];
+			struct iovec iovecs[MMSG_BATCH_MAX];
+			sockaddr_in addresses[MMSG_BATCH_MAX];
+			memset(msgs, 0, sizeof(msgs[0]) * batch);
+			for(int i=0; i<batch; i++){
+				const Address &d = destinations[sent_total + i];
+				addresses[i].sin_family = AF_INET;
+				addresses[i].sin_addr.s_addr = htonl(d.getAddress());
+				addresses[i].sin_port = htons(d.getPort());
+				iovecs[i].iov_base = (void*)data[sent_total + i];
+				iovecs[i].iov_len = sizes[sent_total + i];
+				msgs[i].msg_hdr.msg_iov = &iovecs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &addresses[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			}
+			int sent = sendmmsg(m_handle, msgs, batch, 0);
+			if(sent <= 0)
+				break;
+			sent_total += sent;
+			if(sent < batch)
+				break;
+		}
+		return sent_total;
+	}
+#endif
+	for(int i=0; i<count; i++)
+	{
+		try{
+			Send(destinations[i], data[i], sizes[i]);
+		} catch(SendFailedException &e){
+			return i;
+		}
+	}
+	return count;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -91,6 +91,20 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		Batched I/O; one system call on Linux, a loop elsewhere.
+
+		ReceiveMultiple() receives up to count datagrams that are
+		waiting, without blocking. data[i] has room for size bytes.
+		Sets senders[i] and sizes[i] and returns the number received.
+
+		SendMultiple() returns the number of datagrams sent; the
+		first one not sent failed.
+	*/
+	int ReceiveMultiple(Address *senders, void **data, int size,
+			int *sizes, int count);
+	int SendMultiple(const Address *destinations, const void * const *data,
+			const int *sizes, int count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
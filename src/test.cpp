@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 #include "voxel.h"
 #include "collision.h"
+#include "environment.h"
 #include <sstream>
 #include "porting.h"
 #include "content_mapnode.h"
@@ -42,6 +43,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/serialize.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
+#include "genericobject.h"
+#include "database.h"
+#include "mapdbthread.h"
 #include <algorithm>
 
 /*
@@ -1288,6 +1292,352 @@ struct TestCollision: public TestBase
 	}
 };
 
+struct TestObjectPositionDelta: public TestBase
+{
+	ObjectPosition readDelta(const std::string &data,
+			const ObjectPosition &baseline)
+	{
+		std::istringstream is(data, std::ios::binary);
+		UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_DELTA);
+		UASSERT(readU8(is) == 5);
+		return gob_read_update_position_delta(is, baseline);
+	}
+
+	void Run()
+	{
+		ObjectPosition base;
+		base.position = v3f(1000.123, -20.5, 33.3);
+		base.velocity = v3f(0, -15.2, 3);
+		base.yaw = 350;
+		base.update_interval = 0.09;
+
+		// An unchanged position only takes the header
+		std::string data = gob_cmd_update_position_delta(5, base, base);
+		UASSERT(data.size() == 3);
+		ObjectPosition p = readDelta(data, base);
+		UASSERT(p.position == base.position);
+		UASSERT(p.velocity == base.velocity);
+
+		ObjectPosition moved = base;
+		moved.position += v3f(120.37, 0.04, -3);
+		moved.velocity = v3f(0, -20, 3);
+		moved.yaw = 10.5;
+		moved.do_interpolate = true;
+		data = gob_cmd_update_position_delta(5, base, moved);
+		UASSERT(data.size() < gob_cmd_update_position(moved).size() / 2);
+		p = readDelta(data, base);
+		UASSERT(p.position.getDistanceFrom(moved.position) < 0.1);
+		UASSERT(p.velocity.getDistanceFrom(moved.velocity) < 0.1);
+		UASSERT(p.acceleration == base.acceleration);
+		UASSERT(fabs(p.yaw - moved.yaw) < 0.01);
+		UASSERT(p.do_interpolate == true);
+		UASSERT(p.is_movement_end == false);
+		UASSERT(fabs(p.update_interval - base.update_interval) < 0.001);
+
+		// Too far from the baseline
+		moved.position = base.position + v3f(5000, 0, 0);
+		UASSERT(gob_cmd_update_position_delta(5, base, moved) == "");
+	}
+};
+
+struct TestActiveObjectIndex: public TestBase
+{
+	static bool has(std::list<u16> &l, u16 id)
+	{
+		return std::find(l.begin(), l.end(), id) != l.end();
+	}
+
+	void Run()
+	{
+		ActiveObjectIndex index;
+		index.insert(1, v3f(0,0,0));
+		index.insert(2, v3f(5*BS,0,0));
+		index.insert(3, v3f(100*BS,0,0));
+		index.insert(4, v3f(-100*BS,-20*BS,3*BS));
+		UASSERT(index.size() == 4);
+
+		{
+			std::list<u16> l;
+			index.getObjectsNear(v3f(0,0,0), 10*BS, l);
+			UASSERT(has(l, 1));
+			UASSERT(has(l, 2));
+			UASSERT(!has(l, 3));
+			UASSERT(!has(l, 4));
+		}
+
+		// Moving within and across blocks
+		index.update(1, v3f(1*BS,1*BS,1*BS));
+		index.update(2, v3f(99*BS,0,0));
+		// Unknown ids are ignored
+		index.update(5, v3f(0,0,0));
+		UASSERT(index.size() == 4);
+		{
+			std::list<u16> l;
+			index.getObjectsNear(v3f(100*BS,0,0), 2*BS, l);
+			UASSERT(!has(l, 1));
+			UASSERT(has(l, 2));
+			UASSERT(has(l, 3));
+		}
+
+		// A huge radius falls back to walking the buckets
+		{
+			std::list<u16> l;
+			index.getObjectsNear(v3f(0,0,0), 1e9, l);
+			UASSERT(l.size() == 4);
+		}
+
+		index.remove(3);
+		index.remove(3);
+		UASSERT(index.size() == 3);
+		{
+			std::list<u16> l;
+			index.getObjectsNear(v3f(100*BS,0,0), 2*BS, l);
+			UASSERT(has(l, 2));
+			UASSERT(!has(l, 3));
+		}
+	}
+};
+
+struct TestMapDatabaseThread: public TestBase
+{
+	// Stores blocks in memory; the first batch fails to commit
+	class FlakyDatabase : public MapDatabase
+	{
+	public:
+		FlakyDatabase(): m_failures_left(1) {}
+
+		bool beginSave()
+		{
+			m_batch.clear();
+			return true;
+		}
+		bool endSave()
+		{
+			if(m_failures_left > 0)
+			{
+				m_failures_left--;
+				return false;
+			}
+			for(std::map<v3s16, std::string>::iterator
+					i = m_batch.begin(); i != m_batch.end(); ++i)
+				m_blocks[i->first] = i->second;
+			return true;
+		}
+		bool saveBlock(v3s16 blockpos, const std::string &data)
+		{
+			m_batch[blockpos] = data;
+			return true;
+		}
+		bool loadBlock(v3s16 blockpos, std::string *data)
+		{
+			std::map<v3s16, std::string>::iterator i =
+					m_blocks.find(blockpos);
+			if(i == m_blocks.end())
+				return false;
+			*data = i->second;
+			return true;
+		}
+		void listAllLoadableBlocks(std::list<v3s16> &dst)
+		{
+			for(std::map<v3s16, std::string>::iterator
+					i = m_blocks.begin(); i != m_blocks.end(); ++i)
+				dst.push_back(i->first);
+		}
+		bool exists()
+		{
+			return true;
+		}
+
+		std::map<v3s16, std::string> m_blocks;
+		std::map<v3s16, std::string> m_batch;
+		u32 m_failures_left;
+	};
+
+	void Run()
+	{
+		FlakyDatabase *database = new FlakyDatabase();
+		MapDatabaseThread thread(database);
+
+		thread.saveBlock(v3s16(1,2,3), "a");
+		thread.saveBlock(v3s16(-1,0,0), "b");
+		// The failed batch is queued again and written on a retry
+		UASSERT(thread.flush());
+		UASSERT(thread.getQueuedCount() == 0);
+		UASSERT(database->m_failures_left == 0);
+		UASSERT(database->m_blocks[v3s16(1,2,3)] == "a");
+		UASSERT(database->m_blocks[v3s16(-1,0,0)] == "b");
+
+		std::string data;
+		UASSERT(thread.loadBlock(v3s16(-1,0,0), &data));
+		UASSERT(data == "b");
+		UASSERT(!thread.loadBlock(v3s16(0,0,0), &data));
+	}
+};
+
+struct TestReliablePacketBuffer: public TestBase
+{
+	static con::BufferedPacket makeReliable(u16 seqnum)
+	{
+		Address a;
+		SharedBuffer<u8> data(4);
+		writeU32(&data[0], seqnum);
+		SharedBuffer<u8> r = con::makeReliablePacket(data, seqnum);
+		return con::makePacket(a, r, 0, 0, 0);
+	}
+
+	// Average time of processing an ACK with window packets in flight
+	static float benchmarkAcks(u32 window)
+	{
+		con::ReliablePacketBuffer buf;
+		u16 next = SEQNUM_INITIAL;
+		for(u32 i=0; i<window; i++){
+			con::BufferedPacket p = makeReliable(next++);
+			buf.insert(p);
+		}
+		const u32 ack_count = 20000;
+		u32 t0 = porting::getTimeUs();
+		for(u32 i=0; i<ack_count; i++){
+			// Every other ACK arrives out of order
+			u16 acked = buf.getFirstSeqnum() + 1;
+			if(buf.findPacket(acked) == NULL)
+				acked = buf.getFirstSeqnum();
+			buf.popSeqnum(acked);
+			buf.getPassedByAck(acked, FAST_RESEND_LATER_ACKS);
+			con::BufferedPacket p = makeReliable(next++);
+			buf.insert(p);
+		}
+		u32 t1 = porting::getTimeUs();
+		return (float)(t1 - t0) / ack_count;
+	}
+
+	void Run()
+	{
+		// Seqnums wrapping around in the middle of the buffer
+		{
+			con::ReliablePacketBuffer buf;
+			for(u32 i=0; i<12; i++){
+				con::BufferedPacket p = makeReliable(65530 + i);
+				buf.insert(p);
+			}
+			UASSERT(buf.size() == 12);
+			UASSERT(buf.getFirstSeqnum() == 65530);
+			UASSERT(buf.findPacket(3) != NULL);
+			UASSERT(buf.findPacket(6) == NULL);
+
+			con::BufferedPacket p = makeReliable(2);
+			EXCEPTION_CHECK(AlreadyExistsException, buf.insert(p));
+			// These wrap around past 65535
+			UASSERT(buf.canInsert((u16)(65530 + RELIABLE_BUFFER_SIZE - 1)));
+			UASSERT(!buf.canInsert((u16)(65530 + RELIABLE_BUFFER_SIZE)));
+			UASSERT(!buf.canInsert(65520 - RELIABLE_BUFFER_SIZE));
+
+			buf.popSeqnum(65535);
+			buf.popSeqnum(0);
+			EXCEPTION_CHECK(con::NotFoundException, buf.popSeqnum(0));
+			// The oldest packet has been passed by two ACKs now
+			UASSERT(buf.getPassedByAck(65535, 2).empty());
+			std::list<con::BufferedPacket> passed =
+					buf.getPassedByAck(0, 2);
+			UASSERT(passed.size() == 1);
+			UASSERT(readU16(&passed.front().data[BASE_HEADER_SIZE+1])
+					== 65530);
+			UASSERT(passed.front().resend_count == 1);
+			UASSERT(buf.getPassedByAck(65530, 2).empty());
+			// Re-sent once per loss; only a timeout rearms it
+			UASSERT(buf.getPassedByAck(1, 2).empty());
+			UASSERT(buf.getPassedByAck(2, 2).empty());
+			UASSERT(buf.getPassedByAck(3, 2).empty());
+			buf.incrementTimeouts(1.0);
+			buf.resetTimedOuts(0.5);
+			UASSERT(buf.getPassedByAck(3, 2).empty());
+			UASSERT(buf.getPassedByAck(4, 2).size() == 1);
+
+			for(u32 i=0; i<5; i++)
+				UASSERT(readU16(&buf.popFirst().data[BASE_HEADER_SIZE+1])
+						== (u16)(65530 + i));
+			UASSERT(buf.getFirstSeqnum() == 1);
+			buf.popSeqnum(5);
+			buf.popSeqnum(1);
+			UASSERT(buf.getFirstSeqnum() == 2);
+			while(!buf.empty())
+				buf.popFirst();
+			EXCEPTION_CHECK(con::NotFoundException, buf.getFirstSeqnum());
+			UASSERT(buf.canInsert(30000));
+		}
+
+		// Split packet chunks arriving out of order and twice
+		{
+			con::IncomingSplitBuffer buf;
+			u16 split_seqnum = 100;
+			SharedBuffer<u8> data(1000);
+			for(u32 i=0; i<data.getSize(); i++)
+				data[i] = i % 251;
+			std::list<SharedBuffer<u8> > chunklist =
+					con::makeAutoSplitPacket(data, 300, split_seqnum);
+			UASSERT(chunklist.size() == 4);
+			Address a;
+			std::vector<con::BufferedPacket> chunks;
+			for(std::list<SharedBuffer<u8> >::iterator
+					i = chunklist.begin(); i != chunklist.end(); ++i)
+				chunks.push_back(con::makePacket(a, *i, 0, 0, 0));
+			UASSERT(buf.insert(chunks[3], true).getSize() == 0);
+			UASSERT(buf.insert(chunks[1], true).getSize() == 0);
+			UASSERT(buf.insert(chunks[1], true).getSize() == 0);
+			UASSERT(buf.insert(chunks[2], true).getSize() == 0);
+			SharedBuffer<u8> result = buf.insert(chunks[0], true);
+			UASSERT(result.getSize() == data.getSize());
+			UASSERT(memcmp(*result, *data, data.getSize()) == 0);
+		}
+
+		for(u32 window=16; window<=512; window*=2)
+			infostream<<"TestReliablePacketBuffer: ACK processing with "
+					<<window<<" packets in flight: "
+					<<benchmarkAcks(window)<<"us"<<std::endl;
+	}
+};
+
+struct TestPacketBuilder: public TestBase
+{
+	void Run()
+	{
+		// Headers are written into the headroom of a built packet
+		{
+			con::PacketBuilder os(4);
+			writeU16(os, 0x1234);
+			for(u32 i=0; i<100; i++)
+				writeU32(os, i);
+			SharedBuffer<u8> data = os.getBuffer();
+			UASSERT(data.getSize() == 402);
+			UASSERT(readU32(&data[2 + 99*4]) == 99);
+			u8 *payload = *data;
+
+			Address a;
+			SharedBuffer<u8> r = con::makeReliablePacket(data, 7);
+			con::BufferedPacket p = con::makePacket(a, r, 0, 0, 0);
+			UASSERT(p.data.getSize() == BASE_HEADER_SIZE
+					+ RELIABLE_HEADER_SIZE + 402);
+			UASSERT(*p.data + BASE_HEADER_SIZE
+					+ RELIABLE_HEADER_SIZE == payload);
+			UASSERT(readU16(&p.data[BASE_HEADER_SIZE+1]) == 7);
+			// The headroom is used up; the next one has to copy
+			SharedBuffer<u8> r2 = con::makeReliablePacket(data, 8);
+			UASSERT(*r2 + RELIABLE_HEADER_SIZE != payload);
+			UASSERT(readU16(&r2[RELIABLE_HEADER_SIZE]) == 0x1234);
+		}
+
+		// A buffer that has grown a lot is copied to one of the data's size
+		{
+			con::PacketBuilder os(4096);
+			for(u32 i=0; i<1250; i++)
+				writeU32(os, i);
+			SharedBuffer<u8> data = os.getBuffer();
+			UASSERT(data.getSize() == 5000);
+			UASSERT(readU32(&data[4 * 1249]) == 1249);
+			UASSERT(data.canPrepend(PACKET_HEADROOM));
+		}
+	}
+};
+
 struct TestSocket: public TestBase
 {
 	void Run()
@@ -1766,8 +2116,13 @@ void run_tests()
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestActiveObjectIndex);
+	TEST(TestMapDatabaseThread);
+	TEST(TestObjectPositionDelta);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
+		TEST(TestReliablePacketBuffer);
+		TEST(TestPacketBuilder);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
 		TEST(TestConnection);
 		dout_con<<"=== END RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
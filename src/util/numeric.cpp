@@ -172,29 +172,39 @@ bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 	// Maximum radius of a block.  The magic number is
 	// sqrt(3.0) / 2.0 in literal form.
 	f32 block_max_radius = 0.866025403784 * MAP_BLOCKSIZE * BS;
-	
-	// If block is (nearly) touching the camera, don't
-	// bother validating further (that is, render it anyway)
-	if(d < block_max_radius)
+
+	return isSphereInSight(blockpos, block_max_radius,
+			camera_pos, camera_dir, camera_fov);
+}
+
+bool isSphereInSight(v3f center, f32 radius, v3f camera_pos, v3f camera_dir,
+		f32 camera_fov)
+{
+	// Sphere center relative to camera
+	v3f center_relative = center - camera_pos;
+
+	// If sphere is (nearly) touching the camera, don't
+	// bother validating further (that is, it is visible anyway)
+	if(center_relative.getLength() < radius)
 		return true;
 
 	// Adjust camera position, for purposes of computing the angle,
-	// such that a block that has any portion visible with the
+	// such that a sphere that has any portion visible with the
 	// current camera position will have the center visible at the
 	// adjusted postion
-	f32 adjdist = block_max_radius / cos((M_PI - camera_fov) / 2);
+	f32 adjdist = radius / cos((M_PI - camera_fov) / 2);
 
-	// Block position relative to adjusted camera
-	v3f blockpos_adj = blockpos - (camera_pos - camera_dir * adjdist);
+	// Sphere position relative to adjusted camera
+	v3f center_adj = center - (camera_pos - camera_dir * adjdist);
 
 	// Distance in camera direction (+=front, -=back)
-	f32 dforward = blockpos_adj.dotProduct(camera_dir);
+	f32 dforward = center_adj.dotProduct(camera_dir);
 
 	// Cosine of the angle between the camera direction
-	// and the block direction (camera_dir is an unit vector)
-	f32 cosangle = dforward / blockpos_adj.getLength();
+	// and the sphere direction (camera_dir is an unit vector)
+	f32 cosangle = dforward / center_adj.getLength();
 	
-	// If block is not in the field of view, skip it
+	// If sphere is not in the field of view, skip it
 	if(cosangle < cos(camera_fov / 2))
 		return false;
 
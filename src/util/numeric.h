@@ -210,6 +210,11 @@ int myrand_range(int min, int max);
 bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 		f32 camera_fov, f32 range, f32 *distance_ptr=NULL);
 
+// Whether any part of a sphere can be in the field of view,
+// regardless of distance
+bool isSphereInSight(v3f center, f32 radius, v3f camera_pos, v3f camera_dir,
+		f32 camera_fov);
+
 /*
 	Some helper stuff
 */
@@ -23,6 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../irrlichttypes.h"
 #include "../debug.h" // For assert()
 #include <cstring>
+#if !defined(__GNUC__) && defined(_WIN32)
+#include <windows.h> // For InterlockedIncrement()
+#endif
 
 template <typename T>
 class SharedPtr
@@ -178,6 +181,34 @@ class Buffer
 	unsigned int m_size;
 };
 
+/*
+	Reference counting of SharedBuffer; the buffers are passed between
+	threads, e.g. down to the network send thread.
+*/
+#if defined(__GNUC__)
+inline void sharedbuffer_grab(unsigned int *refcount)
+{
+	__sync_add_and_fetch(refcount, 1);
+}
+// Returns the new reference count
+inline unsigned int sharedbuffer_drop(unsigned int *refcount)
+{
+	return __sync_sub_and_fetch(refcount, 1);
+}
+#elif defined(_WIN32)
+inline void sharedbuffer_grab(unsigned int *refcount)
+{
+	InterlockedIncrement((volatile LONG*)refcount);
+}
+// Returns the new reference count
+inline unsigned int sharedbuffer_drop(unsigned int *refcount)
+{
+	return (unsigned int)InterlockedDecrement((volatile LONG*)refcount);
+}
+#else
+#error "No atomic operations for the SharedBuffer refcount on this compiler"
+#endif
+
 template <typename T>
 class SharedBuffer
 {
@@ -186,8 +217,7 @@ class SharedBuffer
 	{
 		m_size = 0;
 		data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(NULL);
 	}
 	SharedBuffer(unsigned int size)
 	{
@@ -196,27 +226,26 @@ class SharedBuffer
 			data = new T[m_size];
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data);
 	}
 	SharedBuffer(const SharedBuffer &buffer)
 	{
 		//std::cout<<"SharedBuffer(const SharedBuffer &buffer)"<<std::endl;
 		m_size = buffer.m_size;
 		data = buffer.data;
-		refcount = buffer.refcount;
-		(*refcount)++;
+		shared = buffer.shared;
+		sharedbuffer_grab(&shared->refcount);
 	}
 	SharedBuffer & operator=(const SharedBuffer & buffer)
 	{
 		//std::cout<<"SharedBuffer & operator=(const SharedBuffer & buffer)"<<std::endl;
 		if(this == &buffer)
 			return *this;
+		sharedbuffer_grab(&buffer.shared->refcount);
 		drop();
 		m_size = buffer.m_size;
 		data = buffer.data;
-		refcount = buffer.refcount;
-		(*refcount)++;
+		shared = buffer.shared;
 		return *this;
 	}
 	/*
@@ -232,8 +261,7 @@ class SharedBuffer
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data);
 	}
 	/*
 		Copies whole buffer
@@ -248,8 +276,19 @@ class SharedBuffer
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data);
+	}
+	/*
+		Makes a buffer of size elements with room for headroom more in
+		front of them; see prepend()
+	*/
+	static SharedBuffer withHeadroom(unsigned int headroom, unsigned int size)
+	{
+		SharedBuffer b(headroom + size);
+		b.data += headroom;
+		b.m_size = size;
+		b.shared->front = b.data;
+		return b;
 	}
 	~SharedBuffer()
 	{
@@ -272,21 +311,67 @@ class SharedBuffer
 	{
 		return Buffer<T>(data, m_size);
 	}
+	/*
+		Whether count elements can be put in front of the data without
+		copying it. The room in front is handed out once; the buffers
+		sharing the data can't both prepend different things to it.
+	*/
+	bool canPrepend(unsigned int count) const
+	{
+		return (data != NULL && shared->front == data &&
+				(unsigned int)(data - shared->alloc) >= count);
+	}
+	/*
+		Returns a buffer of count more elements in front of this one
+		that shares the data with it. canPrepend(count) has to be true.
+	*/
+	SharedBuffer prepend(unsigned int count) const
+	{
+		assert(canPrepend(count));
+		SharedBuffer b(*this);
+		b.data -= count;
+		b.m_size += count;
+		shared->front = b.data;
+		return b;
+	}
+	// Makes this buffer shorter; the memory stays allocated
+	void shrink(unsigned int size)
+	{
+		assert(size <= m_size);
+		m_size = size;
+	}
 private:
+	struct Shared
+	{
+		unsigned int refcount;
+		// Start of the allocation
+		T *alloc;
+		// Start of the data in use; below it is free headroom
+		T *front;
+	};
+	void init(T *alloc)
+	{
+		shared = new Shared;
+		shared->refcount = 1;
+		shared->alloc = alloc;
+		shared->front = alloc;
+	}
 	void drop()
 	{
-		assert((*refcount) > 0);
-		(*refcount)--;
-		if(*refcount == 0)
+		// Another thread may be changing the count meanwhile, so only
+		// look at the result of the atomic update
+		unsigned int refcount = sharedbuffer_drop(&shared->refcount);
+		assert(refcount != (unsigned int)-1);
+		if(refcount == 0)
 		{
-			if(data)
-				delete[] data;
-			delete refcount;
+			if(shared->alloc)
+				delete[] shared->alloc;
+			delete shared;
 		}
 	}
 	T *data;
 	unsigned int m_size;
-	unsigned int *refcount;
+	Shared *shared;
 };
 
 inline SharedBuffer<u8> SharedBufferFromString(const char *string)